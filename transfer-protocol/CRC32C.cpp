@@ -0,0 +1,129 @@
+#include "CRC32C.h"
+#include <cstring> // memcpy
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h> // _mm_crc32_*
+#define CRC32C_X86
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // reversed Castagnoli polynomial
+
+namespace {
+
+uint32_t table[8][256];
+
+/**
+ * Builds the slicing-by-8 tables: table[0] is the classic byte-at-a-time
+ * table, table[k] advances a byte's contribution over k more zero bytes
+ */
+void build_tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+}
+
+typedef uint32_t (*crc32c_fn)(uint32_t, void const *, size_t);
+
+crc32c_fn select_implementation() {
+    build_tables();
+    return crc32c_hardware_supported() ? crc32c_hardware : crc32c_portable;
+}
+
+// Resolved once at startup so every call is a single indirect jump
+crc32c_fn const implementation = select_implementation();
+
+}
+
+uint32_t crc32c( uint32_t crc, void const *data, size_t len ) {
+    return implementation(crc, data, len);
+}
+
+/**
+ * Slicing-by-8: folds eight bytes per step with eight table lookups
+ * (little endian hosts, the byte order of the x86 hardware path)
+ */
+uint32_t crc32c_portable( uint32_t crc, void const *data, size_t len ) {
+    unsigned char const *buf = (unsigned char const *)data;
+    crc = ~crc;
+
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, buf, sizeof(lo));
+        memcpy(&hi, buf + 4, sizeof(hi));
+        lo ^= crc;
+
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF]
+            ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24]
+            ^ table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF]
+            ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0)
+        crc = (crc >> 8) ^ table[0][(crc ^ *buf++) & 0xFF];
+
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+/**
+ * SSE4.2 crc32 instruction, eight bytes at a time. Compiled for SSE4.2 regardless
+ * of the build flags, crc32c() only calls it once the CPU is known to support it.
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware( uint32_t crc, void const *data, size_t len ) {
+    unsigned char const *buf = (unsigned char const *)data;
+    crc = ~crc;
+
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        buf += 4;
+        len -= 4;
+    }
+
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *buf++);
+
+    return ~crc;
+}
+
+bool crc32c_hardware_supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+uint32_t crc32c_hardware( uint32_t crc, void const *data, size_t len ) {
+    return crc32c_portable(crc, data, len);
+}
+
+bool crc32c_hardware_supported() {
+    return false;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+/**
+ * CRC32C (Castagnoli) checksums, as used by iSCSI and SCTP.
+ *
+ * crc32c() picks the fastest implementation the CPU supports when the
+ * program starts: the SSE4.2 crc32 instruction where available, otherwise a
+ * portable slicing-by-8 table implementation. Both produce identical results.
+ *
+ * Checksums can be computed incrementally by passing the result of the
+ * previous call as crc, starting from 0.
+ */
+uint32_t crc32c( uint32_t crc, void const *data, size_t len );
+
+// The individual implementations, exposed for testing and benchmarking
+uint32_t crc32c_portable( uint32_t crc, void const *data, size_t len );
+uint32_t crc32c_hardware( uint32_t crc, void const *data, size_t len );
+bool     crc32c_hardware_supported();
+
+#endif
@@ -0,0 +1,170 @@
+#include "Compress.h"
+#include <stdint.h> // uint32_t
+#include <cstring> // memcpy, memset
+#include <algorithm> // std::min
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xFFFF
+
+namespace {
+
+uint32_t read32( unsigned char const *p ) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash32( uint32_t v ) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes a length needs beyond the 4 bits of the token
+size_t extra_length_bytes( size_t len ) {
+    return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+unsigned char *write_length( unsigned char *op, size_t len ) {
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// Reads the rest of a length started in a token, false if the block ends first
+bool read_length( unsigned char const *&ip, unsigned char const *end, size_t &len ) {
+    unsigned char b;
+    do {
+        if (ip >= end)
+            return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+unsigned char *write_sequence( unsigned char *op, unsigned char const *literals, size_t lit_len, size_t offset, size_t match_len ) {
+    unsigned char *token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+        op = write_length(op, lit_len);
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len == 0)
+        return op;
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15)
+        op = write_length(op, match_len);
+    return op;
+}
+
+}
+
+size_t lz_compress( void const *src, size_t src_len, void *dst, size_t dst_cap, size_t &consumed ) {
+    unsigned char const *in = (unsigned char const *)src;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned char *op = out;
+    size_t ip = 0, anchor = 0;
+
+    // Positions are stored plus one, zero is an empty slot
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= src_len) {
+        // Literals alone fill the block, no need to look any further
+        if (ip - anchor + 1 >= dst_cap - (size_t)(op - out))
+            break;
+
+        uint32_t h = hash32(read32(in + ip));
+        bool seen = table[h] != 0;
+        size_t candidate = table[h] - 1;
+        table[h] = ip + 1;
+
+        if (!seen || ip - candidate > LZ_MAX_OFFSET || read32(in + candidate) != read32(in + ip)) {
+            ip++;
+            continue;
+        }
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < src_len && in[candidate + match_len] == in[ip + match_len])
+            match_len++;
+
+        // Stop once the sequence no longer fits, the rest goes out as literals
+        size_t lit_len = ip - anchor;
+        size_t cost = 1 + extra_length_bytes(lit_len) + lit_len + 2 + extra_length_bytes(match_len - LZ_MIN_MATCH);
+        if ((size_t)(op - out) + cost > dst_cap)
+            break;
+
+        op = write_sequence(op, in + anchor, lit_len, ip - candidate, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+
+    // Trailing literals, as many as still fit
+    size_t room = dst_cap - (op - out);
+    size_t lit_len = room > 1 ? std::min(src_len - anchor, room - 1) : 0;
+    while (lit_len > 0 && 1 + extra_length_bytes(lit_len) + lit_len > room)
+        lit_len--;
+
+    if (lit_len > 0)
+        op = write_sequence(op, in + anchor, lit_len, 0, 0);
+
+    consumed = anchor + lit_len;
+    return op - out;
+}
+
+bool lz_decompress( void const *src, size_t src_len, void *dst, size_t dst_cap, size_t &len ) {
+    unsigned char const *ip = (unsigned char const *)src;
+    unsigned char const *end = ip + src_len;
+    unsigned char *out = (unsigned char *)dst;
+    size_t op = 0;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_length(ip, end, lit_len))
+            return false;
+        if (lit_len > (size_t)(end - ip) || lit_len > dst_cap - op)
+            return false;
+
+        memcpy(out + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // Only the last sequence goes without a match
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return false;
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(ip, end, match_len))
+            return false;
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || match_len > dst_cap - op)
+            return false;
+
+        // Matches may overlap what they copy, repeating it
+        unsigned char *match = out + op - offset;
+        if (offset >= match_len) {
+            memcpy(out + op, match, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; i++)
+                out[op + i] = match[i];
+        }
+        op += match_len;
+    }
+
+    len = op;
+    return true;
+}
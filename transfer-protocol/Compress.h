@@ -0,0 +1,24 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include <stddef.h> // size_t
+
+/**
+ * LZ77 block compression in the style of LZ4, used to compress data segments.
+ *
+ * Blocks are self contained: a sequence of tokens, each a run of literals
+ * followed by a match (2 byte offset back into the block, length 4 or more),
+ * the last one possibly without its match. Compression is a single greedy
+ * pass over a hash table of 4 byte prefixes, which keeps it cheap enough to
+ * try on every segment.
+ */
+#define LZ_MAX_BLOCK (64 * 1024) // Largest block, matches reach back at most this far
+
+// Compresses as much of src as fits into dst_cap bytes. Returns the size of the
+// compressed block and sets consumed to the bytes of src it holds.
+size_t lz_compress( void const *src, size_t src_len, void *dst, size_t dst_cap, size_t &consumed );
+
+// Decompresses a block into dst. Returns false if the block is malformed or
+// holds more than dst_cap bytes, otherwise sets len to the decompressed size.
+bool lz_decompress( void const *src, size_t src_len, void *dst, size_t dst_cap, size_t &len );
+
+#endif
@@ -0,0 +1,107 @@
+#include "FEC.h"
+#include <stdint.h> // uint64_t
+#include <cstring> // memcpy
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // _mm_*, _mm256_*
+#define FEC_X86
+#endif
+
+namespace {
+
+typedef void (*fec_xor_fn)(void *, void const *, size_t);
+
+fec_xor_fn select_implementation() {
+#ifdef FEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return fec_xor_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return fec_xor_sse2;
+#endif
+    return fec_xor_portable;
+}
+
+// Picked before main() runs, parity encoding then never checks the CPU again
+fec_xor_fn const implementation = select_implementation();
+
+}
+
+void fec_xor( void *dst, void const *src, size_t len ) {
+    implementation(dst, src, len);
+}
+
+void fec_xor_portable( void *dst, void const *src, size_t len ) {
+    unsigned char *d = (unsigned char *)dst;
+    unsigned char const *s = (unsigned char const *)src;
+
+    while (len >= 8) {
+        uint64_t a, b;
+        memcpy(&a, d, sizeof(a));
+        memcpy(&b, s, sizeof(b));
+        a ^= b;
+        memcpy(d, &a, sizeof(a));
+
+        d += 8;
+        s += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0)
+        *d++ ^= *s++;
+}
+
+#ifdef FEC_X86
+
+/**
+ * Compiled for the instruction set regardless of the build flags, fec_xor()
+ * only calls them once the CPU is known to support it. Packet buffers carry
+ * no alignment guarantees, so unaligned loads and stores are used throughout.
+ */
+__attribute__((target("sse2")))
+void fec_xor_sse2( void *dst, void const *src, size_t len ) {
+    char *d = (char *)dst;
+    char const *s = (char const *)src;
+
+    while (len >= 16) {
+        __m128i a = _mm_loadu_si128((__m128i const *)d);
+        __m128i b = _mm_loadu_si128((__m128i const *)s);
+        _mm_storeu_si128((__m128i *)d, _mm_xor_si128(a, b));
+
+        d += 16;
+        s += 16;
+        len -= 16;
+    }
+
+    fec_xor_portable(d, s, len);
+}
+
+__attribute__((target("avx2")))
+void fec_xor_avx2( void *dst, void const *src, size_t len ) {
+    char *d = (char *)dst;
+    char const *s = (char const *)src;
+
+    while (len >= 32) {
+        __m256i a = _mm256_loadu_si256((__m256i const *)d);
+        __m256i b = _mm256_loadu_si256((__m256i const *)s);
+        _mm256_storeu_si256((__m256i *)d, _mm256_xor_si256(a, b));
+
+        d += 32;
+        s += 32;
+        len -= 32;
+    }
+
+    fec_xor_portable(d, s, len);
+}
+
+#else
+
+void fec_xor_sse2( void *dst, void const *src, size_t len ) {
+    fec_xor_portable(dst, src, len);
+}
+
+void fec_xor_avx2( void *dst, void const *src, size_t len ) {
+    fec_xor_portable(dst, src, len);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef FEC_H
+#define FEC_H
+#include <stddef.h> // size_t
+
+/**
+ * XOR kernel used to encode and decode forward error correction parity.
+ *
+ * fec_xor() picks the widest implementation the CPU supports when the
+ * program starts (AVX2, SSE2, or a portable word at a time loop).
+ */
+void fec_xor( void *dst, void const *src, size_t len ); // dst ^= src
+
+// Every variant links on every platform, fec_bench checks each against the
+// others at odd lengths and alignments. Only call the SSE2 and AVX2 ones on
+// CPUs that have the instructions.
+void fec_xor_portable( void *dst, void const *src, size_t len );
+void fec_xor_sse2( void *dst, void const *src, size_t len );
+void fec_xor_avx2( void *dst, void const *src, size_t len );
+
+#endif
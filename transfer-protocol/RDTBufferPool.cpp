@@ -0,0 +1,172 @@
+#include "RDTBufferPool.h"
+#include <cstdlib> // posix_memalign, free
+#include <algorithm> // std::find
+
+RDTBufferPool::buffer::buffer() : chunk( NULL ), ptr( NULL ), len( 0 ) {}
+
+RDTBufferPool::buffer::buffer(buffer const &other) : chunk( other.chunk ), ptr( other.ptr ), len( other.len ) {
+    if (chunk)
+        __sync_fetch_and_add(&chunk->refs, 1);
+}
+
+RDTBufferPool::buffer::~buffer() {
+    reset();
+}
+
+RDTBufferPool::buffer &RDTBufferPool::buffer::operator=(buffer const &other) {
+    buffer copy(other);
+    swap(copy);
+    return *this;
+}
+
+RDTBufferPool::buffer RDTBufferPool::buffer::slice(size_t offset, size_t slice_len) const {
+    buffer part(*this);
+    part.ptr += offset;
+    part.len = slice_len;
+    return part;
+}
+
+void RDTBufferPool::buffer::swap(buffer &other) {
+    std::swap(chunk, other.chunk);
+    std::swap(ptr, other.ptr);
+    std::swap(len, other.len);
+}
+
+void RDTBufferPool::buffer::reset() {
+    if (chunk)
+        RDTBufferPool::release(chunk);
+
+    chunk = NULL;
+    ptr = NULL;
+    len = 0;
+}
+
+RDTBufferPool::RDTBufferPool(size_t chunk_size)
+    :   chunk_size( chunk_size ),
+        current( NULL ),
+        used( 0 )
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+/**
+ * Frees every chunk no buffer uses any more. Chunks still in use are
+ * orphaned, the last buffer released frees them.
+ */
+RDTBufferPool::~RDTBufferPool() {
+    if (current)
+        release(current);
+
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < spare.size(); i++)
+        free_chunk(spare[i]);
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (std::find(spare.begin(), spare.end(), chunks[i]) == spare.end())
+            chunks[i]->pool = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Returns room for up to len bytes at the current end of the carved chunk,
+ * moving on to a fresh chunk if it doesn't fit. NULL if out of memory.
+ */
+char *RDTBufferPool::reserve(size_t len) {
+    if (len > chunk_size)
+        return NULL;
+
+    if (!current || used + len > chunk_size)
+        next_chunk();
+
+    return current ? current->data + used : NULL;
+}
+
+/**
+ * Carves the first len bytes of the room last reserved into a buffer. The
+ * next buffer starts on the following cache line.
+ */
+RDTBufferPool::buffer RDTBufferPool::commit(size_t len) {
+    buffer result;
+    if (!current || used + len > chunk_size)
+        return result;
+
+    __sync_fetch_and_add(&current->refs, 1);
+    result.chunk = current;
+    result.ptr = current->data + used;
+    result.len = len;
+
+    used += (len + RDT_CACHE_LINE - 1) & ~(size_t)(RDT_CACHE_LINE - 1);
+    return result;
+}
+
+/**
+ * Lets go of the chunk being carved (it is recycled once its buffers are
+ * released) and starts carving a spare one, or a newly allocated one if
+ * there are no spares.
+ */
+void RDTBufferPool::next_chunk() {
+    if (current)
+        release(current);
+
+    current = NULL;
+    used = 0;
+
+    pthread_mutex_lock(&lock);
+    if (!spare.empty()) {
+        current = spare.back();
+        spare.pop_back();
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!current) {
+        void *data;
+        if (posix_memalign(&data, RDT_CACHE_LINE, chunk_size) != 0)
+            return;
+
+        current = new chunk_t;
+        current->pool = this;
+        current->data = (char *)data;
+
+        pthread_mutex_lock(&lock);
+        chunks.push_back(current);
+        pthread_mutex_unlock(&lock);
+    }
+
+    current->refs = 1;
+}
+
+/**
+ * Drops a reference to a chunk, handing it back to its pool (or freeing it
+ * if the pool is gone) once the last one is dropped
+ */
+void RDTBufferPool::release(chunk_t *chunk) {
+    if (__sync_sub_and_fetch(&chunk->refs, 1) > 0)
+        return;
+
+    if (chunk->pool)
+        chunk->pool->recycle(chunk);
+    else
+        free_chunk(chunk);
+}
+
+void RDTBufferPool::recycle(chunk_t *chunk) {
+    pthread_mutex_lock(&lock);
+    if (spare.size() < RDT_POOL_SPARE_CHUNKS) {
+        spare.push_back(chunk);
+        chunk = NULL;
+    } else {
+        chunks.erase(std::find(chunks.begin(), chunks.end(), chunk));
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (chunk)
+        free_chunk(chunk);
+}
+
+void RDTBufferPool::free_chunk(chunk_t *chunk) {
+    free(chunk->data);
+    delete chunk;
+}
@@ -0,0 +1,84 @@
+#ifndef RDTPOOL_H
+#define RDTPOOL_H
+#include <stddef.h> // size_t
+#include <pthread.h>
+#include <vector> // std::vector
+
+#define RDT_CACHE_LINE 64 // Every buffer starts on a cache line of its own
+#define RDT_POOL_CHUNK (256 * 1024) // Buffers are carved out of chunks this large
+#define RDT_POOL_SPARE_CHUNKS 4 // Free chunks kept for reuse, the rest go back to the heap
+
+/**
+ * Packet buffers carved back to back out of large cache line aligned chunks,
+ * the way NIC drivers carve receive buffers out of pages. Packets are read
+ * straight into the room reserve() returns and commit() turns the part they
+ * took into a buffer, so a buffer is only as large as its packet and costs no
+ * allocation: a chunk is reused once every buffer carved out of it is gone.
+ *
+ * Buffers are reference counted handles, copies share the same bytes. They may
+ * be handed to (and released by) other threads, but only one thread may carve
+ * buffers out of a pool. Buffers outliving their pool keep their chunk alive
+ * until they are released, as long as no thread releases one while the pool
+ * is being destroyed.
+ */
+class RDTBufferPool {
+    struct chunk_t;
+
+public:
+    class buffer {
+    public:
+        buffer();
+        buffer(buffer const &other);
+        ~buffer();
+        buffer &operator=(buffer const &other);
+
+        char *data() const { return ptr; }
+        size_t size() const { return len; }
+        bool empty() const { return len == 0; }
+
+        buffer slice(size_t offset, size_t slice_len) const; // shares part of the bytes
+        void swap(buffer &other);
+        void reset();
+
+    private:
+        friend class RDTBufferPool;
+
+        chunk_t *chunk;
+        char *ptr;
+        size_t len;
+    };
+
+    RDTBufferPool(size_t chunk_size = RDT_POOL_CHUNK);
+    virtual ~RDTBufferPool();
+
+    // Room for up to len (at most the chunk size) bytes, valid until the next
+    // reserve() or commit(). Committing carves the first len bytes of it into a buffer.
+    char *reserve(size_t len);
+    buffer commit(size_t len);
+
+private:
+    struct chunk_t {
+        RDTBufferPool *pool; // NULL once the pool is gone
+        int refs;            // buffers carved out of it, plus one while the pool carves from it
+        char *data;
+    };
+
+    size_t const chunk_size;
+    chunk_t *current; // chunk being carved, NULL until the first reserve()
+    size_t used;      // bytes of it carved so far
+
+    pthread_mutex_t lock; // guards the chunk lists, buffers may be released on any thread
+    std::vector<chunk_t *> chunks; // every chunk allocated
+    std::vector<chunk_t *> spare;  // those no buffer uses
+
+    void next_chunk();
+    static void release(chunk_t *chunk);
+    void recycle(chunk_t *chunk);
+    static void free_chunk(chunk_t *chunk);
+
+    // Pools are not copyable
+    RDTBufferPool(RDTBufferPool const &);
+    RDTBufferPool &operator=(RDTBufferPool const &);
+};
+
+#endif
@@ -1,40 +1,239 @@
 #include "RDTConnection.h"
-#include <sys/time.h> // gettimeofday
+#include "RDTServer.h"
+#include "CRC32C.h"
+#include "FEC.h"
+#include "Compress.h"
+#include "RDTTrace.h"
+#include <sys/time.h> // timeval, gettimeofday
+#include <time.h> // clock_gettime
 #include <arpa/inet.h> // htonl, ntohl, etc.
 #include <unistd.h>
+#include <fcntl.h> // open
+#include <poll.h>
+#include <limits.h> // PIPE_BUF
+#include <sys/timerfd.h>
+#include <sys/uio.h> // iovec
+#include <sys/random.h> // getrandom
+#include <vector> // std::vector
 #include <cstdlib> // malloc etc.
 #include <cstring> // memset, memcpy, etc.
 #include <cerrno> // errno
 #include <iostream> // std::cout
 #include <sstream> // std::stringstream
+#include <iomanip> // std::setw
 #include <math.h> // ceil
 #include <algorithm> // std::min etc.
+
+/**
+ * A random number no other process or connection can predict or share, from
+ * the kernel's generator (or /dev/urandom should getrandom() be missing)
+ */
+static uint32_t random_id() {
+    uint32_t id = 0;
+    if (getrandom(&id, sizeof(id), 0) == sizeof(id))
+        return id;
+
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || read(fd, &id, sizeof(id)) != sizeof(id)) {
+        timeval now;
+        gettimeofday(&now, NULL);
+        id = (now.tv_sec * 1000003) ^ now.tv_usec ^ ((uint32_t)getpid() << 16);
+    }
+    if (fd != -1)
+        ::close(fd);
+
+    return id;
+}
+
+char const *rdt_drop_reason_name( int reason ) {
+    static char const *names[RDT_DROP_REASONS] = { "loss", "corrupt", "malformed", "unexpected", "stale" };
+    return reason >= 0 && reason < RDT_DROP_REASONS ? names[reason] : "unknown";
+}
+
+rdt_stripe_t::rdt_stripe_t(int index, int count, uint64_t range_size, uint64_t start)
+    :   index( index ),
+        count( count ),
+        range_size( range_size ),
+        start( start )
+{
+}
+
+bool rdt_stripe_t::striped() const {
+    return count > 1 && range_size > 0;
+}
+
+uint64_t rdt_stripe_t::file_offset(uint64_t pos) const {
+    pos += start;
+    if (!striped())
+        return pos;
+
+    return (pos / range_size * count + index) * range_size + pos % range_size;
+}
+
+uint64_t rdt_stripe_t::contiguous(uint64_t pos) const {
+    return striped() ? range_size - (start + pos) % range_size : UINT64_MAX;
+}
+
+/**
+ * Every stripe gets its share of the full ranges, the partial range at the
+ * end (if any) goes to whichever stripe is next in line
+ */
+uint64_t rdt_stripe_t::length(uint64_t region) const {
+    uint64_t len = region;
+
+    if (striped()) {
+        uint64_t ranges = region / range_size;
+        len = (ranges / count + ((uint64_t)index < ranges % count ? 1 : 0)) * range_size;
+
+        if ((uint64_t)index == ranges % count)
+            len += region % range_size;
+    }
+
+    return len - std::min(len, start);
+}
+
 #define round(x) ((x)>=0?(long)((x)+0.5):(long)((x)-0.5))
 
 RDTConnection::RDTConnection(int w_size, double ploss, double pcorrupt)
-    :   window_size( w_size ),
+    :   is_listener( false ),
+        listener_connected( false ),
+        got_FIN( false ),
+        sock_fd( -1 ),
+        server( NULL ),
+        conn_id( 0 ),
+        window_size( w_size ),
+        mtu( RDT_MAX_MTU ),
+        remote_mtu( MTU ),
+        plpmtu( MTU ),
+        probe_high( MTU ),
+        probe_size( 0 ),
+        probe_count( 0 ),
+        receive_window( RDT_RECEIVE_WINDOW ),
+        window_sent( 0 ),
+        local_window_scale( 0 ),
+        remote_window_scale( 0 ),
+        remote_window( 0 ),
         prob_loss( std::max(0.0, std::min(100.0, ploss)) ),
         prob_corrupt( std::max(0.0, std::min(pcorrupt, 100.0)) ),
-        sock_fd( -1 ),
-        got_FIN( false ),
-        is_listener( false ),
-        listener_connected( false )
+        impairment_seed( random_id() ),
+        op( OP_NONE ),
+        op_success( false ),
+        op_callback( NULL ),
+        op_context( NULL ),
+        timer( -1 ),
+        num_timeouts( 0 ),
+        handshake_SYNACK( false ),
+        got_FINACK( false ),
+        fast_open( false ),
+        send_request( false ),
+        request_pending( false ),
+        close_on_EOF( false ),
+        remote_validated( true ),
+        unvalidated_received( 0 ),
+        unvalidated_sent( 0 ),
+        compression( false ),
+        remote_compression( false ),
+        compress_transfer( false ),
+        compress_skip( 0 ),
+        send_src( NULL ),
+        ring_mask( 0 ),
+        ring_head( 0 ),
+        ring_tail( 0 ),
+        sack_high( 0 ),
+        loss_scan( 0 ),
+        current_unacknowledged_bytes( 0 ),
+        unacknowledged_payload( 0 ),
+        total_acknowledged_bytes( 0 ),
+        send_transfer( 0 ),
+        in_recovery( false ),
+        fast_recovery( false ),
+        recover( 0 ),
+        duplicate_acks( 0 ),
+        window_probes( 0 ),
+        min_rtt( 0 ),
+        srtt( 0 ),
+        pacing_tokens( 0 ),
+        pacing_blocked( false ),
+        fec_block( RDT_FEC_BLOCK ),
+        fec_max_parity( 0 ),
+        fec_parity( 0 ),
+        fec_segments( 0 ),
+        fec_count( 0 ),
+        loss_rate( 0 ),
+        recv_transfer( 0 ),
+        last_transfer( -1 ),
+        last_transfer_bytes( 0 ),
+        closing_with_EOF( false ),
+        reorder_bytes( 0 ),
+        fec_recovered( 0 ),
+        undelivered_bytes( 0 ),
+        stream_transfer( false ),
+        streams_blocked( false ),
+        stream_callback( NULL ),
+        ack_every( RDT_ACK_EVERY ),
+        ack_delay( RDT_ACK_DELAY_USEC ),
+        unacked_segments( 0 ),
+        blocked( BLOCKED_NONE ),
+        window_wait( 0 ),
+        pacing_wait( 0 ),
+        stats_fd( -1 ),
+        stats_interval( RDT_STATS_INTERVAL_USEC ),
+        trace_count( 0 ),
+        log_time( 0 )
 {
     memset( &remote_addr, 0, sizeof( remote_addr ));
     memset( &local_addr, 0, sizeof( local_addr ));
-
-    srand(time(0)); // seed for simulating random network errors
+    memset( &deadline, 0, sizeof( deadline ));
+    memset( &probe_sent, 0, sizeof( probe_sent ));
+    memset( &counters, 0, sizeof( counters ));
+    memset( &transfer_start, 0, sizeof( transfer_start ));
+    memset( &transfer_end, 0, sizeof( transfer_end ));
+    memset( &stats_due, 0, sizeof( stats_due ));
+    memset( &blocked_since, 0, sizeof( blocked_since ));
+    memset( &sink_retry, 0, sizeof( sink_retry ));
+
+    set_trace(RDT_TRACE_RECORDS);
+
+    fec_history.reserve(RDT_FEC_HISTORY);
+    fec_history.set_limit(RDT_FEC_HISTORY);
 }
 
 RDTConnection::~RDTConnection() {
+    abort_operation();
+    clear_streams(); // opened for a transfer that never ran
     close(true); // force teardown, object destroyed
+
+    if (timer != -1)
+        ::close(timer);
 }
 
 /**
  * Public interface for establishing connections
  */
 bool RDTConnection::connect( std::string const &afnet_address, int port ) {
-    return connect(afnet_address, port, false);
+    if (!start_connect(afnet_address, port, NULL, NULL))
+        return false;
+
+    return run_operation();
+}
+
+/**
+ * Connects and delivers a short request in one go. The request rides on our
+ * SYN when it fits a packet of the default MTU, so the remote has it (and may
+ * start on its response) a single round trip after we start. Remotes which
+ * don't take requests on the SYN get it sent the usual way once connected.
+ *
+ * Returns true once connected with the request delivered.
+ */
+bool RDTConnection::connect_with_request( std::string const &afnet_address, int port, std::string const &request ) {
+    if (!start_connect_with_request(afnet_address, port, request, NULL, NULL))
+        return false;
+
+    if (run_operation())
+        return true;
+
+    close();
+    return false;
 }
 
 /**
@@ -46,83 +245,379 @@ bool RDTConnection::connect( std::string const &afnet_address, int port ) {
  * Returns true if local-to-remote connection established, false otherwise.
  */
 bool RDTConnection::connect( std::string const &afnet_address, int port, bool sendSYNACK ) {
-    // Listeners have already bound a socket, simply try to connect to the remote
-    // If we are establishing a brand new connection, a bind is still needed
-    if (!is_listener) {
+    if (!start_connect(afnet_address, port, sendSYNACK, NULL, NULL))
+        return false;
+
+    return run_operation();
+}
+
+bool RDTConnection::start_connect( std::string const &afnet_address, int port, rdt_callback_t done, void *context ) {
+    if (busy())
+        return false;
+
+    send_request = false;
+    return start_connect(afnet_address, port, false, done, context);
+}
+
+bool RDTConnection::start_connect_with_request( std::string const &afnet_address, int port, std::string const &request, rdt_callback_t done, void *context ) {
+    if (busy())
+        return false;
+
+    syn_request = request;
+    send_request = true;
+    return start_connect(afnet_address, port, false, done, context);
+}
+
+/**
+ * Begins the handshake with the remote host: a SYN is sent (and resent on
+ * every timeout) until the remote host SYNACKs it.
+ */
+bool RDTConnection::start_connect( std::string const &afnet_address, int port, bool sendSYNACK, rdt_callback_t done, void *context ) {
+    if (busy())
+        return false;
+
+    // Listeners and server sessions already have a socket, simply try to connect to
+    // the remote. If we are establishing a brand new connection, a bind is still needed
+    if (!is_listener && !server) {
         if (!bind()) {
-            log_event("Failed to bind connection socket");
+            LOG_ERROR("Failed to bind connection socket");
             return false;
         }
     }
 
     got_FIN = false;
+    got_FINACK = false;
+    last_transfer = -1;
+    min_rtt = 0; // new path, pace once we have measured it
+    srtt = 0;
+
+    // Pick the smallest scale which can express our window
+    local_window_scale = 0;
+    while ((receive_window >> local_window_scale) > 0xFFFF && local_window_scale < RDT_MAX_WINDOW_SCALE)
+        local_window_scale++;
+
+    // The initiating side picks the connection id, the accepting side reuses
+    // the one from the SYN it received (and already knows the remote's options)
+    if (!sendSYNACK) {
+        do {
+            conn_id = random_id();
+        } while (conn_id == 0);
+
+        remote_mtu = MTU;
+        remote_window_scale = 0;
+        remote_window = 0;
+        remote_compression = false;
+        remote_validated = true; // we picked the address
+
+        // Every path carries a SYN of the default MTU, so that is all the request gets
+        fast_open = send_request && syn_request.size() <= MSS - sizeof(rdt_header_t) - sizeof(rdt_syn_options_t);
+    }
 
     // Establish remote host info
     remote_addr.sin_family = AF_INET;
     remote_addr.sin_port = htons(port);
     if ( inet_pton(AF_INET, afnet_address.c_str(), (void *)&remote_addr.sin_addr.s_addr ) != 1 ) {
-        close();
+        teardown(false);
         return false;
     }
 
-    std::stringstream ip_ss;
-    ip_ss << afnet_address << ":" << port;
-    std::string ip_str = ip_ss.str();
-    log_event("Attempting to connect to " + ip_str);
+    LOG_INFO("Attempting to connect to " << remote_name());
 
-    // Set the socket timeout (inactivity) and bail if setting the option fails
-    timeval timeout;
-    timeout.tv_sec = RDT_TIMEOUT_SEC;
-    timeout.tv_usec = RDT_TIMEOUT_USEC;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
-        close();
-        log_event("failed to set socket timeout");
-        return false;
-    }
+    start_operation(OP_CONNECT, done, context);
+    handshake_SYNACK = sendSYNACK;
 
-    // Send a SYN packet to the remote host
-    rdt_packet_t pkt;
-    build_network_packet(pkt, "");
-    setSYN(pkt);
-    if(sendSYNACK)
-        setSYNACK(pkt);
+    // Our SYNACK (sent again whenever the remote's SYN is) tells the remote we have
+    // the request its SYN carried. Accepting such a SYN needs no SYN of our own, the
+    // response can go out right away, as much of it as amplification_room() allows
+    // until the remote answers.
+    bool accept_fast_open = sendSYNACK && fast_open;
 
     // Bail on transmission errors
-    if ( !broadcast_network_packet(pkt) ) {
-        close();
-        log_event("SYN packet transmission failed");
+    if ( !(accept_fast_open ? send_handshake(false, true) : send_SYN()) ) {
+        LOG_ERROR("SYN packet transmission failed");
+        abort_operation();
+        teardown(false);
         return false;
     }
 
-    // Wait until remote host SYNACKs our SYN packet
-    // SYN packets sent by the remote host are replied by read_network_packet();
-    timeval start, now;
-    gettimeofday(&start, NULL);
-    int delta_sec = RDT_TIMEOUT_SEC;
-    int delta_usec = RDT_TIMEOUT_USEC;
+    if (accept_fast_open) {
+        LOG_INFO("Connected to " << remote_name() << " with a " << syn_request.size() << " byte request");
+        trace_event(RDT_TRACE_CONNECTED);
+        reset_path_mtu();
+        finish_operation(true);
+        return true;
+    }
+
+    set_timeout(RDT_TIMEOUT_USEC);
+    return true;
+}
+
+/**
+ * Sends our SYN, which also SYNACKs the remote's SYN when accepting
+ */
+bool RDTConnection::send_SYN() {
+    return send_handshake(true, handshake_SYNACK);
+}
+
+/**
+ * Sends a handshake packet advertising our options to the remote. SYNACKs
+ * carry them too, the remote may connect on one without ever seeing our SYN.
+ * Every handshake offers to take compressed segments.
+ *
+ * With fast open, our SYN also carries the request after the options (marked
+ * like a transfer: EOF, seq_num its length, then padding), and when accepting,
+ * our SYNACK EOFACKs the request the remote's SYN carried.
+ */
+bool RDTConnection::send_handshake(bool syn, bool synack) {
+    rdt_syn_options_t options;
+    options.mtu = mtu;
+    options.window_scale = local_window_scale;
+
+    std::string payload((char const *)&options, sizeof(options));
+    if (fast_open && syn && !handshake_SYNACK) {
+        // Padded to a full packet, which buys the remote's response room to start in
+        payload += syn_request;
+        payload.resize(MSS - sizeof(rdt_header_t), '\0');
+    }
+
+    rdt_segment_t seg;
+    build_network_packet(seg, payload.data(), payload.size());
+    setCOMPRESS(seg);
+    if (syn)
+        setSYN(seg);
+    if (synack)
+        setSYNACK(seg);
+
+    if (fast_open && syn && !handshake_SYNACK) {
+        seg.header.seq_num = syn_request.size();
+        setEOF(seg);
+    } else if (fast_open && synack && handshake_SYNACK) {
+        seg.header.ack_num = syn_request.size();
+        setEOFACK(seg);
+    }
+
+    return broadcast_network_segment(seg);
+}
+
+/**
+ * Wait until remote host SYNACKs our SYN packet
+ * SYN packets sent by the remote host are replied by read_network_packet();
+ * When accepting, anything else the remote sends on the connection means it
+ * got our SYN even if its SYNACK was lost. That packet is dropped, the remote
+ * retransmits it like any other lost packet.
+ */
+void RDTConnection::connect_packet(rdt_packet_t &pkt) {
+    if (isSYNACK(pkt))
+        read_SYN_options(pkt);
+
+    if (isSYNACK(pkt) || (handshake_SYNACK && !isSYN(pkt))) {
+        validate_remote(); // it got our SYN
+        LOG_INFO("Connected to " << remote_name());
+        trace_event(RDT_TRACE_CONNECTED);
+        reset_path_mtu();
+
+        // A SYNACK which doesn't EOFACK our request means the remote doesn't take
+        // requests on the SYN (or ours didn't fit), send it the usual way. The
+        // connect completes along with that send.
+        if (send_request && !handshake_SYNACK && !(fast_open && isEOFACK(pkt) && pkt.header.ack_num == syn_request.size())) {
+            rdt_callback_t done = op_callback;
+            void *context = op_context;
+
+            fast_open = false;
+            abort_operation();
+            if (!start_send(syn_request, done, context) && done)
+                done(*this, false, context);
+            return;
+        }
+
+        finish_operation(true); // Got the SYNACK, return success!
+    }
+}
+
+/**
+ * Notes the options the remote advertised in its SYN. Remotes which don't
+ * advertise anything only get packets of the default MTU and unscaled windows,
+ * and nothing compressed.
+ */
+void RDTConnection::read_SYN_options(rdt_packet_t const &pkt) {
+    rdt_syn_options_t options;
+    options.mtu = MTU;
+    options.window_scale = 0;
+
+    if (pkt.header.data_len >= sizeof(options))
+        memcpy(&options, pkt.data, sizeof(options));
+
+    remote_mtu = std::max((size_t)MTU, std::min((size_t)RDT_MAX_MTU, (size_t)options.mtu));
+    remote_window_scale = std::min((uint32_t)RDT_MAX_WINDOW_SCALE, options.window_scale);
+    remote_window = (size_t)pkt.header.window << remote_window_scale;
+    remote_compression = isCOMPRESS(pkt);
+}
+
+/**
+ * Picks up the request a fast open SYN (one marked EOF) carries after its
+ * options, for the next receive to hand out. Called on the SYN which opens
+ * a connection we accept, whose remote isn't validated until it answers us.
+ */
+void RDTConnection::read_SYN_request(rdt_packet_t const &pkt) {
+    fast_open = false;
+    request_pending = false;
+    syn_request.clear();
+
+    remote_validated = false;
+    unvalidated_received = sizeof(pkt.header) + pkt.header.data_len;
+    unvalidated_sent = 0;
+
+    if (!isEOF(pkt) || pkt.header.data_len < sizeof(rdt_syn_options_t))
+        return;
+
+    // What follows the request is padding
+    size_t len = pkt.header.data_len - sizeof(rdt_syn_options_t);
+    if (pkt.header.seq_num > len)
+        return;
+
+    fast_open = true;
+    request_pending = true;
+    syn_request.assign(pkt.data + sizeof(rdt_syn_options_t), pkt.header.seq_num);
+}
+
+/**
+ * Bytes we may have in flight: our own window, further limited by what
+ * the remote is willing to receive
+ */
+size_t RDTConnection::send_limit() {
+    return std::min(window_size, remote_window);
+}
+
+/**
+ * Bytes we may still send a remote which hasn't shown it is at its address,
+ * so a SYN sent from someone else's can't make us flood them
+ */
+size_t RDTConnection::amplification_room() {
+    if (remote_validated)
+        return (size_t)-1;
+
+    uint64_t limit = RDT_AMPLIFICATION_LIMIT * unvalidated_received;
+    return unvalidated_sent < limit ? limit - unvalidated_sent : 0;
+}
+
+/**
+ * The remote answered packets we sent it, so it is at its address: sending
+ * is no longer limited and the path MTU may be probed
+ */
+void RDTConnection::validate_remote() {
+    if (remote_validated)
+        return;
+
+    LOG_DEBUG("Remote " << remote_name() << " validated after " << unvalidated_sent << " bytes sent");
+    remote_validated = true;
+}
+
+/**
+ * Our receive window as carried in packet headers: what is left of our receive
+ * buffer. While the sink is behind, the window stays closed until a whole
+ * segment fits, rather than letting the sender dribble out tiny segments as the
+ * sink drains (silly window syndrome).
+ */
+uint16_t RDTConnection::advertised_window() {
+    size_t room = receive_window - std::min(receive_window, undelivered_bytes);
+    if (undelivered_bytes > 0 && room < MSS)
+        room = 0;
+
+    return std::min((size_t)0xFFFF, room >> local_window_scale);
+}
+
+/**
+ * Largest payload a data segment may carry on the current path
+ */
+size_t RDTConnection::max_payload() {
+    return plpmtu - IP_HEADER - UDP_HEADER - sizeof(rdt_header_t);
+}
+
+/**
+ * Starts over with the default MTU, which every path is assumed to carry,
+ * and the largest packet both ends accept as the upper bound of the search
+ */
+void RDTConnection::reset_path_mtu() {
+    plpmtu = MTU;
+    probe_high = std::min(mtu, remote_mtu);
+    probe_size = 0;
+    probe_count = 0;
+}
+
+/**
+ * Packetization layer path MTU discovery (in the spirit of RFC 8899). Called
+ * as data goes out: binary searches for the largest packet which makes it to
+ * the remote by sending padded probes which the remote PROBEACKs. Probes never
+ * carry data, so losing them costs nothing but the probe.
+ */
+void RDTConnection::probe_path_mtu() {
+    timeval now, elapsed;
+    clock_now(now);
+
+    // Probes are as large as the remote's SYN says it takes, not before it is validated
+    if (!remote_validated)
+        return;
+
+    if (probe_size != 0) {
+        timersub(&now, &probe_sent, &elapsed);
+        if (elapsed.tv_sec * USEC_CONVERSION + elapsed.tv_usec < RDT_TIMEOUT_USEC)
+            return; // Still waiting on the probe
+
+        if (probe_count >= MAX_PROBES) {
+            LOG_INFO("Path MTU probe of " << probe_size << " bytes went unanswered");
 
-    do {
-        if (read_network_packet(pkt) && isSYNACK(pkt)) {
-            log_event("Connected to " + ip_str);
-            return true; // Got the SYNACK, return success!
+            probe_high = probe_size - 1;
+            probe_size = 0;
         }
-        else if (errno == EWOULDBLOCK) {
-            break; // Socket timeout, bail
+    }
+
+    while (true) {
+        if (probe_size == 0) {
+            if (probe_high < plpmtu + RDT_PROBE_GRANULARITY)
+                return; // Search is done
+
+            probe_size = plpmtu + (probe_high - plpmtu + 1) / 2;
+            probe_count = 0;
         }
 
-        // Timeout for getting an ACK
-        // this is different from a socket timeout as receiving
-        // garbage packets would keep resetting that timer
-        gettimeofday(&now, NULL);
-    } while (
-            now.tv_usec - start.tv_usec < delta_usec
-        &&  now.tv_sec - start.tv_sec < delta_sec
-    );
+        std::vector<char> padding(probe_size - IP_HEADER - UDP_HEADER - sizeof(rdt_header_t));
+        rdt_segment_t seg;
+        build_network_packet(seg, &padding[0], padding.size());
+        setPROBE(seg);
 
-    // Timed out
-    close();
-    log_event("Connection attempt to " + ip_str + " timed out");
-    return false;
+        if (broadcast_network_segment(seg) || errno != EMSGSIZE)
+            break;
+
+        // Too large for our own interface, no need to wait for an answer
+        probe_high = probe_size - 1;
+        probe_size = 0;
+    }
+
+    probe_count++;
+    probe_sent = now;
+}
+
+void RDTConnection::probe_acked(size_t size) {
+    if (probe_size == 0 || size != probe_size)
+        return;
+
+    plpmtu = probe_size;
+    probe_size = 0;
+
+    LOG_INFO("Path MTU to " << remote_name() << " raised to " << plpmtu << " bytes");
+    trace_event(RDT_TRACE_MTU, plpmtu);
+}
+
+void RDTConnection::connect_timeout() {
+    if (++num_timeouts >= MAX_HANDSHAKE_TIMEOUTS) {
+        LOG_ERROR("Connection attempt to " << remote_name() << " timed out");
+        teardown(false);
+        finish_operation(false);
+        return;
+    }
+
+    send_SYN();
+    set_timeout(RDT_TIMEOUT_USEC);
 }
 
 /**
@@ -143,6 +638,15 @@ bool RDTConnection::bind( int port ) {
         return false;
     }
 
+    // Never let the kernel fragment our packets, path MTU probing finds what fits
+    int pmtud = IP_PMTUDISC_PROBE;
+    setsockopt(sock_fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtud, sizeof(pmtud));
+
+    // A few large packets would otherwise fill the default socket buffers
+    int buf_size = RDT_SOCKET_BUFFER;
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
     // Double check what port the system gave us
     port = port_number();
     local_addr.sin_port = htons(port);
@@ -161,80 +665,117 @@ void RDTConnection::close() {
 }
 
 void RDTConnection::close(bool force_teardown) {
-    // If a non connected listener tries to close the connection it will
-    // get stuck as non-connected listener sockets don't have a timeout
-    if ((!is_listener && sock_fd != -1) || (is_listener && listener_connected)) {
-        std::stringstream ss;
-        char ip_addr[INET_ADDRSTRLEN];
-
-        inet_ntop(AF_INET, &remote_addr.sin_addr.s_addr, ip_addr, sizeof(ip_addr));
-        ss << "Closing connection to " << ip_addr << ":" << ntohs(remote_addr.sin_port);
-        log_event(ss.str());
-
-        int num_timeouts = 0;
-        bool got_ACK = false;
-        bool resend_pkt = true;
-        rdt_packet_t pkt;
-
-        // Wait for the remote host to acknowledge our FIN
-        while (!got_ACK && num_timeouts < MAX_HANDSHAKE_TIMEOUTS) {
-            if (resend_pkt) {
-                build_network_packet(pkt, "");
-                setFIN(pkt);
-                broadcast_network_packet(pkt);
-                resend_pkt = false;
-            }
+    if (start_close(NULL, NULL))
+        run_operation();
 
-            if (read_network_packet(pkt)) {
-                got_ACK = isFINACK(pkt);
-                got_FIN = got_FIN || isFIN(pkt);
-            } else if (errno == EWOULDBLOCK) {
-                resend_pkt = true;
-                num_timeouts++;
-            }
-        }
+    teardown(force_teardown);
+}
 
-        if (got_ACK) { // Successfully got a FINACK
-            num_timeouts = 0;
-            while (!got_FIN && num_timeouts < MAX_HANDSHAKE_TIMEOUTS) {
-                if (read_network_packet(pkt))
-                    got_FIN = isFIN(pkt);
-                else if (errno == EWOULDBLOCK)
-                    num_timeouts++;
-            }
-        } else { // Number of tries exhausted, assume connection is gone
-            log_event("Timeout while waiting for FINACK, terminating connection");
-        }
+/**
+ * Begins tearing down the connection: our FIN is sent until the remote host
+ * FINACKs it, then we wait for the remote's own FIN. Returns false if there
+ * is no established connection to close.
+ *
+ * When the last transfer closed the connection along with its EOF (see
+ * set_close_on_EOF()), either way, there is nothing left to wait for and
+ * the close completes right away.
+ */
+bool RDTConnection::start_close( rdt_callback_t done, void *context ) {
+    // A non connected listener has nobody to say goodbye to
+    if (busy() || !((!is_listener && sock_fd != -1) || (is_listener && listener_connected)))
+        return false;
 
-        if (!got_FIN) {
-            got_FIN = true;
-            log_event("Timeout while waiting for FIN, terminating connection");
+    LOG_INFO("Closing connection to " << remote_name());
+
+    start_operation(OP_CLOSE, done, context);
+    if (got_FINACK && got_FIN) {
+        close_complete();
+        return true;
+    }
+
+    if (!got_FINACK)
+        send_FIN();
+    set_timeout(RDT_TIMEOUT_USEC);
+    return true;
+}
+
+void RDTConnection::send_FIN() {
+    rdt_packet_t pkt;
+    build_network_packet(pkt);
+    setFIN(pkt);
+    broadcast_network_packet(pkt);
+}
+
+void RDTConnection::close_packet(rdt_packet_t &pkt) {
+    // Remote FINs are FINACKed (and noted in got_FIN) by read_network_packet()
+    if (!got_FINACK && isFINACK(pkt)) {
+        got_FINACK = true;
+        num_timeouts = 0;
+        set_timeout(RDT_TIMEOUT_USEC);
+    }
+
+    if (got_FINACK && got_FIN)
+        close_complete();
+}
+
+void RDTConnection::close_timeout() {
+    num_timeouts++;
+
+    if (!got_FINACK) {
+        if (num_timeouts >= MAX_HANDSHAKE_TIMEOUTS) {
+            // Number of tries exhausted, assume connection is gone
+            LOG_WARN("Timeout while waiting for FINACK, terminating connection");
+            close_complete();
         } else {
-            log_event("Connection closed");
+            send_FIN();
+            set_timeout(RDT_TIMEOUT_USEC);
         }
+    } else if (num_timeouts >= MAX_HANDSHAKE_TIMEOUTS) {
+        close_complete();
+    } else {
+        set_timeout(RDT_TIMEOUT_USEC);
+    }
+}
+
+void RDTConnection::close_complete() {
+    bool clean = got_FINACK && got_FIN;
+
+    if (!got_FIN) {
+        got_FIN = true;
+        LOG_WARN("Timeout while waiting for FIN, terminating connection");
+    } else {
+        LOG_INFO("Connection closed");
     }
 
+    teardown(false);
+    finish_operation(clean);
+}
+
+/**
+ * Releases the connection's resources without any handshaking
+ */
+void RDTConnection::teardown(bool force_teardown) {
+    if (remote_addr.sin_port != 0)
+        trace_event(RDT_TRACE_CLOSED);
     memset( &remote_addr, 0, sizeof( remote_addr ));
 
     // Teardown regular sockets or when listener is destroyed
+    // Server sessions only detach, the socket belongs to the server
     if (force_teardown || !is_listener) {
-        if (sock_fd != -1)
+        if (server)
+            server->remove_session(this);
+        else if (sock_fd != -1)
             ::close( sock_fd );
 
+        server = NULL;
+
         sock_fd = -1;
         is_listener = false;
         memset( &local_addr, 0, sizeof( local_addr ));
     }
 
-    if (!force_teardown && is_listener) {
-        // Remove the socket timeout (inactivity) to allow blocking while waiting for connections
-        timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 0;
-        setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
-
+    if (!force_teardown && is_listener)
         listener_connected = false;
-    }
 }
 
 /**
@@ -256,285 +797,2435 @@ bool RDTConnection::listen( int port ) {
  */
 bool RDTConnection::accept() {
     char ip_addr[INET_ADDRSTRLEN];
-    rdt_packet_t pkt;
+    rdt_packet_t *pkt;
     sockaddr_in incoming_addr;
 
     // Only established listeners can accept connections
-    if (!is_listener)
+    if (!is_listener || busy())
         return false;
     else
         listener_connected = false;
 
     while ( !listener_connected ) {
         memset(&incoming_addr, 0, sizeof(incoming_addr));
-        if (!read_network_packet(pkt, false, &incoming_addr))
+        if (!wait_readable(-1) || !(pkt = read_network_packet(false, &incoming_addr)))
             continue;
 
-        if(isSYN(pkt)) {
+        if(isSYN(*pkt)) {
             inet_ntop(AF_INET, &incoming_addr.sin_addr.s_addr, ip_addr, sizeof(ip_addr));
-            std::stringstream ss;
-            ss << "Connection request from " << ip_addr << ":" << pkt.header.src_port;
-            log_event(ss.str());
-            listener_connected = connect(ip_addr, pkt.header.src_port, true);
+            LOG_INFO("Connection request from " << ip_addr << ":" << ntohs(incoming_addr.sin_port));
+            conn_id = pkt->header.conn_id;
+            read_SYN_options(*pkt);
+            read_SYN_request(*pkt);
+            listener_connected = connect(ip_addr, ntohs(incoming_addr.sin_port), true);
         } else {
-            drop_packet(pkt, "non-SYN packet received when awaiting incoming connections");
+            drop_packet(*pkt, RDT_DROP_UNEXPECTED, "non-SYN packet received when awaiting incoming connections");
         }
     }
 
     return listener_connected;
 }
 
-bool RDTConnection::send_data( std::string const &data ) {
-    // First, compute the number of windows we need, then create a little structure 
-    // for storing pertinent information.
-    size_t necessary_windows = (window_size / MSS) + 1;
-    size_t current_window = 0;
-
-    struct connection_window {
-        bool is_acked;          // Used to track if the data in this window was acknowledged.
-        size_t seq_num;         // The sequence number for this particular data item.
-        timeval sent_on_time;   // The time the data was sent on. Used for computing timeout.
-    };
-
-    struct connection_window *windows = (struct connection_window*)malloc(sizeof(struct connection_window) * necessary_windows);
+/**
+ * Payload source backed by an in-memory string owned by the caller
+ */
+class RDTConnection::string_source : public RDTConnection::payload_source {
+public:
+    string_source(std::string const &data) : data(data) {}
 
-    // Configure the default settings of the struct
-    for (int i = 0; i < necessary_windows; i++) {
-        windows[i].is_acked = true;
-        windows[i].seq_num = 0;
-        windows[i].sent_on_time.tv_sec = 0;
-        windows[i].sent_on_time.tv_usec = 0;
+    size_t length() const { return data.length(); }
+    char const *read(size_t offset, size_t len) {
+        return offset + len <= data.length() ? data.data() + offset : NULL;
     }
 
-    size_t current_unacknowledged_bytes = 0;
-    size_t total_acknowledged_bytes = 0;
-    size_t last_ack = 0;
-    uint16_t timeout_count = 0;
+private:
+    std::string const &data;
+};
 
-    size_t data_length = data.length();
-    std::stringstream ss;
-    ss << "Preparing to transmit " << data_length << " bytes!";
-    log_event(ss.str());
+/**
+ * Payload source backed by a region of a file descriptor. Only a window sized
+ * buffer is kept in memory and it is refilled with pread() as the window advances,
+ * (or rewinds on retransmissions) so arbitrarily large files can be streamed.
+ * Striped sources gather their ranges of the region back to back.
+ */
+class RDTConnection::fd_source : public RDTConnection::payload_source {
+public:
+    fd_source(int fd, off_t offset, size_t len, size_t window, rdt_stripe_t const &stripe)
+        :   fd(fd), start(offset), len(stripe.length(len)), stripe(stripe),
+            buf(std::max(window, (size_t)MSS) * 2), buf_offset(0), buf_len(0) {}
+
+    size_t length() const { return len; }
+
+    char const *read(size_t offset, size_t size) {
+        if (offset + size > len || size > buf.size())
+            return NULL;
+
+        // Refill the buffer starting at the requested offset if it isn't resident
+        if (offset < buf_offset || offset + size > buf_offset + buf_len) {
+            size_t want = std::min(buf.size(), len - offset);
+            buf_offset = offset;
+            buf_len = 0;
+
+            while (buf_len < want) {
+                size_t pos = offset + buf_len;
+                size_t piece = std::min((uint64_t)(want - buf_len), stripe.contiguous(pos));
+                ssize_t got = pread(fd, &buf[buf_len], piece, start + stripe.file_offset(pos));
+                if (got == -1 && errno == EINTR)
+                    continue;
+                else if (got <= 0)
+                    break; // error or file shrunk underneath us
+                buf_len += got;
+            }
 
-    rdt_packet_t pkt;
-    size_t current_packet_size;
-    size_t current_packet_max_size;
+            if (buf_len < size)
+                return NULL;
+        }
 
-    bool fast_retransmit = false;
+        return &buf[offset - buf_offset];
+    }
 
-    while (true) {
-        // If everything is acknowledged, we're done!
-        if (total_acknowledged_bytes >= data_length && total_acknowledged_bytes != 0 && data_length != 0) {
-            log_event("Transmission complete.");
-            return true;
-        }
+private:
+    int const fd;
+    off_t const start;
+    size_t const len;
+    rdt_stripe_t const stripe;
 
-        /**
-         * To simplify things, we do this asynchronously. We first send every segment
-         * the window can hold. Once we've filled the window size, we start reading.
-         * We take care to not transmit over an unACKED window.
-         */
-        while (current_unacknowledged_bytes + total_acknowledged_bytes < data_length && current_unacknowledged_bytes < window_size && windows[current_window].is_acked) {
-            // We need to take care to not try to send any more data than the window will allow.
-            current_packet_max_size = std::min((size_t)window_size - current_unacknowledged_bytes, sizeof(pkt.data));
-            current_packet_size = build_network_packet(pkt, data, current_packet_max_size, total_acknowledged_bytes + current_unacknowledged_bytes);
-            current_unacknowledged_bytes += current_packet_size;
-
-            // We also need to set some clerical data for the packet--namely, the sequence number.
-            // The sequence number represents the numerical ID of the /last/ byte of data in the packet.
-            pkt.header.seq_num = total_acknowledged_bytes + current_unacknowledged_bytes;
-            windows[current_window].is_acked = false;
-            windows[current_window].seq_num = pkt.header.seq_num;
-            gettimeofday(&windows[current_window].sent_on_time, NULL);
-
-            if ((current_unacknowledged_bytes + total_acknowledged_bytes) >= data_length) {
-                setEOF(pkt);
-                log_event("Prepared EOF packet for transmission.");
-            }
+    std::vector<char> buf;
+    size_t buf_offset; // transfer offset of buf[0]
+    size_t buf_len;
+};
 
-            // Advance the window
-            current_window = (current_window + 1) % necessary_windows;
-
-            std::stringstream ss;
-            ss << "Preparing to transmit packet with SEQ " << pkt.header.seq_num << " and payload " << current_packet_size;
-            ss << " - Current window has " << current_unacknowledged_bytes << " of " << window_size;
-            log_event(ss.str());
-            broadcast_network_packet(pkt);
-        }
-
-        /**
-         * Now that we've broken out of here, we've either sent enough data, or ran out of windows.
-         * To handle this, we first see if any packets have timed out in the window. If they have,
-         * then we reset to that packet and begin resending. If not, we start checking for ACKs.
-         */
-        for (int i = 0; i < necessary_windows; i++) {
-            timeval now;
-            gettimeofday(&now, NULL);
-
-            long delta_sec  = now.tv_sec  - windows[i].sent_on_time.tv_sec;
-            long delta_usec = now.tv_usec - windows[i].sent_on_time.tv_usec;
-            bool timed_out = delta_sec > RDT_TIMEOUT_SEC || (delta_sec == RDT_TIMEOUT_SEC && delta_usec > RDT_TIMEOUT_USEC);
-
-            if (!windows[i].is_acked && timed_out) {
-                // The packet has timed out. Resend it, and everything after it. To do this, set the
-                // current_unacknowledged_bytes to empty, and make sure every packet after is marked
-                // as acked so we can write over it, and rewind the current_window index.
-                current_unacknowledged_bytes = 0;
-                current_window = (current_window - 1) % necessary_windows;
-
-                for (int j = i; j < necessary_windows; j++)
-                    windows[j].is_acked = true;
-
-                std::stringstream ss;
-                ss << "SEQ NUM " << windows[i].seq_num << " has timed out. Resend!";
-                log_event(ss.str());
-                fast_retransmit = true;
-                break;
-            }
-        }
+/**
+ * Payload sink which accumulates the transfer in a string
+ */
+class RDTConnection::string_sink : public RDTConnection::payload_sink {
+public:
+    string_sink(std::string &data) : data(data) { data = ""; }
 
-        // Avoid reading another network packet and just resend now
-        if (fast_retransmit) {
-            fast_retransmit = false;
-            continue;
-        }
+    ssize_t write(char const *buf, size_t len) {
+        data.append(buf, len);
+        return len;
+    }
 
-        /**
-         * We've sent everything, and nothing has timed out, so let's hunt for an ACK. We're using cumilative ACKS--
-         * this means that we assume the client will only ACK bytes it has received. If we receive an ACK, we mark
-         * every sequence number less than it is as sent.
-         */
-        if (read_network_packet(pkt)) {
-            if (isFIN(pkt)) {
-                log_event("Send data interrupted: remote closed the connection");
-                close();
-                return false;
-            } else if (!isACK(pkt)) {
-                drop_packet(pkt, "expected ACK and received non-ACK packet.");
-            } else {
-                std::stringstream ss;
-                ss << "Received ACK " << pkt.header.ack_num;
-                log_event(ss.str());
-
-                if (pkt.header.ack_num > current_unacknowledged_bytes + total_acknowledged_bytes) {
-                    std::stringstream ss;
-                    ss << "received garbage ACK value. god " << pkt.header.ack_num << ", anticipated " << current_unacknowledged_bytes << "+" << total_acknowledged_bytes;
-                    drop_packet(pkt, ss.str());
-                    continue;
-                }
-
-                if (pkt.header.ack_num < last_ack) {
-                    drop_packet(pkt, "discarding duplicate ACK");
-                } else {
-                    for (int i = 0; i < necessary_windows; i++) {
-                        if (!windows[i].is_acked && windows[i].seq_num <= pkt.header.ack_num) {
-                            windows[i].is_acked = true;
-
-                            std::stringstream ss;
-                            ss << "Marking " << pkt.header.ack_num << " as ACKED.";
-                            log_event(ss.str());
-                        }
-                    }
-                    total_acknowledged_bytes = pkt.header.ack_num;
-                    current_unacknowledged_bytes -= (pkt.header.ack_num - last_ack);
-                    last_ack = pkt.header.ack_num;
-                    timeout_count = 0;
-                }
-            }
-        }
-        else {
-            timeout_count++;
+private:
+    std::string &data;
+};
 
-            if (timeout_count == MAX_TRANSMIT_TIMEOUTS) {
-                log_event("Timeout limit reached. Giving up.");
-                close();
-                return false;
-            }
-        }
+/**
+ * Payload sink which writes the transfer to a file descriptor as it arrives.
+ * Regular files are written with pwrite() starting at the current file offset,
+ * anything unseekable (pipes, terminals) falls back to plain write()s. Striped
+ * sinks scatter the transfer into their ranges of the file, so stripes received
+ * over separate connections (even concurrently) reassemble in place. Those
+ * need a seekable descriptor.
+ *
+ * Descriptors which are full (a pipe to a slow reader, say) take what they
+ * have room for, the connection holds on to the rest and closes its window
+ * until they drain. Unseekable ones are polled before every PIPE_BUF bytes
+ * written, so even blocking ones never stall the connection.
+ */
+class RDTConnection::fd_sink : public RDTConnection::payload_sink {
+public:
+    fd_sink(int fd, rdt_stripe_t const &stripe) : fd(fd), start(lseek(fd, 0, SEEK_CUR)), stripe(stripe), received(0) {}
+
+    // Leave the file offset after the data we wrote, as write() would have.
+    // Stripes only fill in their ranges, other stripes still write around them.
+    ~fd_sink() {
+        if (start != -1 && !stripe.striped())
+            lseek(fd, start + stripe.file_offset(received), SEEK_SET);
     }
-}
 
-bool RDTConnection::receive_data( std::string &data ) {
-    rdt_packet_t pkt;
-    rdt_packet_t response_pkt;
-    uint16_t timeout_count = 0;
-    size_t total_bytes_received = 0;
-    data = "";
-    bool got_EOF = false;
-    while (true) {
-        if (read_network_packet(pkt)) {
-            if (pkt.header.seq_num <= total_bytes_received) {
-                std::stringstream ss;
-                ss << "Duplicate packet " << pkt.header.seq_num << " detected. Resending ACK";
-                log_event(ss.str());
+    ssize_t write(char const *buf, size_t len) {
+        if (start == -1 && stripe.striped())
+            return -1;
+
+        size_t taken = 0;
+        while (taken < len) {
+            size_t piece = std::min((uint64_t)(len - taken), stripe.contiguous(received));
+            if (start == -1 && !writable())
+                break;
+            else if (start == -1)
+                piece = std::min(piece, (size_t)PIPE_BUF);
 
-                build_network_packet(response_pkt, "");
-                response_pkt.header.ack_num = pkt.header.seq_num;
-                setACK(response_pkt);
+            ssize_t written = start == -1 ? ::write(fd, buf + taken, piece) : pwrite(fd, buf + taken, piece, start + stripe.file_offset(received));
 
-                broadcast_network_packet(response_pkt);
+            if (written == -1 && errno == EINTR) {
                 continue;
-            }
-            else if ((int)(pkt.header.seq_num - MSS) > (int)total_bytes_received) {
-                std::stringstream ss;
-                ss << "packet SEQ num " << pkt.header.seq_num << " out of desired range " << total_bytes_received << "+" << MSS;
-                drop_packet(pkt, ss.str());
+            } else if (written == -1 && errno == ESPIPE && start != -1 && !stripe.striped()) {
+                start = -1;
                 continue;
+            } else if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (written <= 0) {
+                return -1;
             }
 
-            // If the above checks pass, this is a valid packet.
-            if ( pkt.header.data_len > 0 ) {
-                data.append(pkt.data, pkt.header.data_len);
-            }
+            taken += written;
+            received += written;
+        }
+
+        return taken;
+    }
 
-            timeout_count = 0;
-            total_bytes_received += pkt.header.data_len;
+private:
+    // Room for PIPE_BUF bytes, or an error the next write() reports
+    bool writable() const {
+        pollfd pfd = { fd, POLLOUT, 0 };
+        return poll(&pfd, 1, 0) != 0;
+    }
 
-            // Now send an ACK
-            build_network_packet(response_pkt, "");
+    int const fd;
+    off_t start; // where the transfer goes, -1 if the descriptor isn't seekable
+    rdt_stripe_t const stripe;
+    uint64_t received;
+};
 
-            std::stringstream ss;
-            ss << "ACK " << pkt.header.seq_num;
-            log_event(ss.str());
+/**
+ * Payload source multiplexing the streams of a stream transfer. The transfer is
+ * laid out as it goes: every new segment goes to the next stream (round robin)
+ * with data left and credit from the remote, so the streams share the window
+ * evenly and one whose destination can't keep up doesn't hold up the others.
+ * Segments are tagged with their stream and where in it they end. Runs of a
+ * stream's data are remembered until ACKed, so retransmissions (and pieces of
+ * them) are tagged the same way.
+ */
+class RDTConnection::stream_source : public RDTConnection::payload_source {
+public:
+    stream_source(std::vector<stream_t> &streams) : streams(streams), len(0), laid_out(0), next(0), sent(streams.size(), 0) {
+        for (size_t i = 0; i < streams.size(); i++)
+            len += stream_length(i);
+    }
 
-            response_pkt.header.ack_num = pkt.header.seq_num;
-            setACK(response_pkt);
+    size_t length() const { return len; }
 
-            if (isEOF(pkt))
-                setEOFACK(response_pkt);
+    size_t place(size_t offset, size_t max_len, rdt_header_t &header) {
+        if (offset >= laid_out && !lay_out(max_len))
+            return 0;
 
-            broadcast_network_packet(response_pkt);
+        std::deque<run_t>::const_iterator run = find_run(offset);
+        size_t run_end = run + 1 == runs.end() ? laid_out : (run + 1)->start;
+        size_t place_len = std::min(max_len, run_end - offset);
+        uint64_t end = run->stream_offset + (offset - run->start) + place_len;
 
-            if (isEOF(pkt)) {
-                log_event("Received EOF packet, transmission complete.");
-                got_EOF = true;
-            }
+        header.flags |= STREAM_MASK;
+        header.stream = run->stream | (end == stream_length(run->stream) ? RDT_STREAM_LAST : 0);
+        header.ack_num = end;
+        return place_len;
+    }
 
-            if (isFIN(pkt)) {
-                log_event("Receive data interrupted: remote closed the connection");
-                close();
-            }
+    // Segments never span runs, place() made sure of that
+    char const *read(size_t offset, size_t size) {
+        if (size == 0)
+            return "";
 
-            if (isEOF(pkt) || isFIN(pkt)) {
-                return got_EOF;
-            }
-        } else {
-            timeout_count++;
+        std::deque<run_t>::const_iterator run = find_run(offset);
+        return streams[run->stream].src->read(run->stream_offset + (offset - run->start), size);
+    }
 
-            std::stringstream ss;
-            ss << "Read timeout. Set timeout count to " << timeout_count;
-            log_event(ss.str());
+    void release(size_t offset) {
+        while (runs.size() > 1 && runs[1].start <= offset)
+            runs.pop_front();
+    }
 
-            if (timeout_count == MAX_TRANSMIT_TIMEOUTS) {
-                std::stringstream ss;
-                ss << "Timeout limit " << MAX_TRANSMIT_TIMEOUTS << " exceeded. Giving up.";
-                log_event(ss.str());
+private:
+    // Transfer data from start up to the next run's start is the stream's from stream_offset on
+    struct run_t {
+        size_t start;
+        uint64_t stream_offset;
+        uint16_t stream;
+    };
 
-                return false;
-            }
-        }
+    size_t stream_length(size_t id) const {
+        return streams[id].src ? streams[id].src->length() : 0;
     }
-}
+
+    std::deque<run_t>::const_iterator find_run(size_t offset) const {
+        std::deque<run_t>::const_iterator low = runs.begin(), high = runs.end();
+        while (high - low > 1) {
+            std::deque<run_t>::const_iterator mid = low + (high - low) / 2;
+            if (mid->start <= offset)
+                low = mid;
+            else
+                high = mid;
+        }
+        return low;
+    }
+
+    // Hands up to max_len more bytes of the transfer to the next stream which may send
+    bool lay_out(size_t max_len) {
+        for (size_t i = 0; i < streams.size(); i++) {
+            size_t id = (next + i) % streams.size();
+            uint64_t allowed = std::min((uint64_t)stream_length(id), streams[id].limit);
+            if (sent[id] >= allowed)
+                continue;
+
+            if (runs.empty() || runs.back().stream != id) {
+                run_t run = { laid_out, sent[id], (uint16_t)id };
+                runs.push_back(run);
+            }
+
+            size_t run_len = std::min((uint64_t)max_len, allowed - sent[id]);
+            sent[id] += run_len;
+            laid_out += run_len;
+            next = id + 1;
+            return true;
+        }
+
+        return false;
+    }
+
+    std::vector<stream_t> &streams;
+    size_t len;
+    size_t laid_out;            // transfer bytes handed to streams so far
+    size_t next;                // stream whose turn is next
+    std::vector<uint64_t> sent; // of each stream, laid out so far
+    std::deque<run_t> runs;     // from the oldest unACKed on
+};
+
+bool RDTConnection::send_data( std::string const &data ) {
+    if (!start_send(data, NULL, NULL))
+        return false;
+
+    return finish_blocking_send();
+}
+
+/**
+ * Transmits len bytes of fd starting at offset. The file is read incrementally
+ * so memory use is bounded by the window size rather than the transfer size.
+ */
+bool RDTConnection::send_fd( int fd, off_t offset, size_t len ) {
+    return send_fd(fd, offset, len, rdt_stripe_t());
+}
+
+/**
+ * Transmits a single stripe of the len bytes of fd starting at offset: its
+ * ranges, back to back (from stripe.start on, resuming). The remote receives
+ * them with receive_to_fd() given the same stripe.
+ */
+bool RDTConnection::send_fd( int fd, off_t offset, size_t len, rdt_stripe_t const &stripe ) {
+    if (!start_send_payload(new fd_source(fd, offset, len, window_size, stripe), NULL, NULL))
+        return false;
+
+    return finish_blocking_send();
+}
+
+/**
+ * Drives a send started by the blocking interface. Failed transfers
+ * (the remote closed on us or stopped responding) close the connection.
+ */
+bool RDTConnection::finish_blocking_send() {
+    if (run_operation())
+        return true;
+
+    close();
+    return false;
+}
+
+bool RDTConnection::start_send( std::string const &data, rdt_callback_t done, void *context ) {
+    return start_send_payload(new string_source(data), done, context);
+}
+
+bool RDTConnection::start_send_fd( int fd, off_t offset, size_t len, rdt_callback_t done, void *context ) {
+    return start_send_payload(new fd_source(fd, offset, len, window_size, rdt_stripe_t()), done, context);
+}
+
+/**
+ * Begins transmitting the payload. Takes ownership of src.
+ */
+bool RDTConnection::start_send_payload( payload_source *src, rdt_callback_t done, void *context ) {
+    if (busy() || sock_fd == -1) {
+        delete src;
+        return false;
+    }
+
+    // Size the send ring for a full window of the smallest segments we send.
+    // Segments carry less than an MSS when they have to leave room for FEC parity headers
+    size_t min_payload = MSS - sizeof(rdt_header_t) - (fec_max_parity > 0 ? sizeof(rdt_fec_header_t) : 0);
+    size_t ring_size = 1;
+    while (ring_size < window_size / min_payload + 1)
+        ring_size <<= 1;
+
+    timeval never;
+    memset(&never, 0, sizeof(never));
+    ring_seq.assign(ring_size, 0);
+    ring_len.assign(ring_size, 0);
+    ring_payload.assign(ring_size, 0);
+    ring_sent.assign(ring_size, never);
+    ring_generation.assign(ring_size, 0);
+    ring_flags.assign(ring_size, 0);
+    ring_mask = ring_size - 1;
+    ring_head = 0;
+    ring_tail = 0;
+    sack_high = 0;
+    loss_scan = 0;
+    rto_heap.clear();
+    resend_queue.clear();
+
+    current_unacknowledged_bytes = 0;
+    unacknowledged_payload = 0;
+    total_acknowledged_bytes = 0;
+    last_ack = 0;
+    sent_EOF = false;
+    send_transfer++;
+    in_recovery = false;
+    fast_recovery = false;
+    recover = 0;
+    duplicate_acks = 0;
+    window_probes = 0;
+
+    pacing_tokens = 0;
+    pacing_blocked = false;
+    clock_now(pacing_refill);
+
+    fec_parity = 0;
+    fec_count = 0;
+    remote_recovered = 0;
+
+    compress_transfer = compression && remote_compression;
+    compress_skip = 0;
+    if (compress_transfer)
+        compress_buf.resize(RDT_MAX_MTU);
+
+    counters.transfer_bytes = 0;
+    clock_now(transfer_start);
+    memset(&transfer_end, 0, sizeof(transfer_end));
+
+    LOG_INFO("Preparing to transmit " << src->length() << " bytes!");
+
+    start_operation(OP_SEND, done, context);
+    send_src = src;
+
+    if (send_window())
+        set_send_timeout();
+
+    return true;
+}
+
+/**
+ * To simplify things, we do this asynchronously. We first resend whatever was
+ * found lost, then send every new segment the window can hold. Once we've
+ * filled the window size, we wait for ACKs.
+ *
+ * Returns false (and fails the operation) if the payload could not be read.
+ */
+bool RDTConnection::send_window() {
+    rdt_segment_t seg;
+    size_t data_length = send_src->length();
+    size_t current_packet_size;
+    size_t current_packet_max_size;
+    size_t window_limit = send_limit();
+    size_t max_packet = plpmtu - IP_HEADER - UDP_HEADER;
+
+    probe_path_mtu();
+    pacing_blocked = false;
+    streams_blocked = false;
+
+    // Lost segments are already inside the window, they only wait on pacing (and
+    // on the remote answering, if it hasn't yet)
+    while (!resend_queue.empty() && pacing_allows() && amplification_room() >= max_packet) {
+        uint64_t segment = resend_queue.front();
+        resend_queue.pop_front();
+
+        if (segment >= ring_head && !(ring_flags[segment & ring_mask] & SEG_SACKED) && !resend_segment(segment))
+            return false;
+    }
+
+    // An empty transfer still sends a single (empty) EOF segment
+    while (resend_queue.empty()
+            && (current_unacknowledged_bytes + total_acknowledged_bytes < data_length || !sent_EOF)
+            && unacknowledged_payload < window_limit
+            && current_unacknowledged_bytes < remote_window
+            && ring_tail - ring_head <= ring_mask
+            && amplification_room() >= max_packet
+            && pacing_allows()) {
+        size_t offset = total_acknowledged_bytes + current_unacknowledged_bytes;
+
+        // Parity can't tell which stream a segment it rebuilds belonged to, so streams go unprotected
+        if (fec_max_parity > 0 && fec_count == 0 && !stream_transfer)
+            start_fec_block(offset);
+
+        // We need to take care to not try to send any more data than the window will allow.
+        // The payload is not copied, the segment simply points into the caller's buffer.
+        // Compressed segments may carry more data than that, as long as the remote has room
+        // for it. FEC protected ones never are, parity covers segments as sent.
+        current_packet_max_size = std::min(window_limit - unacknowledged_payload, fec_parity > 0 ? fec_stride : max_payload());
+        if (compress_transfer && fec_parity == 0)
+            current_packet_size = build_compressed_segment(seg, std::min(window_size, remote_window - current_unacknowledged_bytes), current_packet_max_size, offset);
+        else
+            current_packet_size = build_network_segment(seg, *send_src, current_packet_max_size, offset);
+
+        // Every stream with data left waits on the remote's credit
+        if (current_packet_size == 0 && offset < data_length) {
+            streams_blocked = true;
+            break;
+        }
+
+        current_unacknowledged_bytes += current_packet_size;
+        unacknowledged_payload += seg.header.data_len;
+        counters.segments_sent++;
+        window_probes = 0;
+
+        // Every segment sent for the first time ages the loss estimate
+        loss_rate *= 1 - RDT_LOSS_WEIGHT;
+
+        if (seg.payload == NULL) {
+            LOG_ERROR("Failed to read payload data, aborting transmission");
+            finish_operation(false);
+            return false;
+        }
+
+        // We also need to set some clerical data for the packet--namely, the sequence number.
+        // The sequence number represents the numerical ID of the /last/ byte of data in the packet.
+        seg.header.seq_num = total_acknowledged_bytes + current_unacknowledged_bytes;
+        size_t slot = ring_tail & ring_mask;
+        ring_seq[slot] = seg.header.seq_num;
+        ring_len[slot] = current_packet_size;
+        ring_payload[slot] = seg.header.data_len;
+        ring_flags[slot] = 0;
+        clock_now(ring_sent[slot]);
+        arm_retransmit(ring_tail++);
+
+        if ((current_unacknowledged_bytes + total_acknowledged_bytes) >= data_length) {
+            setEOF(seg);
+            if (close_on_EOF && fast_open)
+                setFIN(seg);
+            sent_EOF = true;
+            LOG_DEBUG("Prepared EOF packet for transmission.");
+        } else if (unacknowledged_payload >= window_limit || current_unacknowledged_bytes >= remote_window
+                || amplification_room() < sizeof(seg.header) + seg.header.data_len + max_packet) {
+            // Nothing more can be sent until this is ACKed, don't let the receiver delay it
+            setACKNOW(seg);
+        }
+
+        LOG_DEBUG("Preparing to transmit packet with SEQ " << seg.header.seq_num << " and payload " << current_packet_size << " - Current window has " << current_unacknowledged_bytes << " of " << window_limit);
+
+        if (fec_parity > 0)
+            add_fec_segment(seg);
+
+        pacing_tokens -= sizeof(seg.header) + seg.header.data_len;
+
+        if (!broadcast_network_segment(seg) && errno == EMSGSIZE) {
+            // The path to the remote shrunk underneath us. The segment is resent (in pieces of
+            // the default MTU) once it times out, and probing searches below its size again.
+            LOG_WARN("Segment exceeds the local MTU, falling back to the default MTU");
+            plpmtu = MTU;
+            trace_event(RDT_TRACE_MTU, plpmtu);
+            probe_high = std::max((size_t)MTU, (size_t)seg.header.data_len + IP_HEADER + UDP_HEADER + sizeof(rdt_header_t) - 1);
+            probe_size = 0;
+        }
+
+        if (fec_parity > 0 && (fec_count == fec_segments || sent_EOF))
+            send_fec_parity();
+    }
+
+    if (sent_EOF && resend_queue.empty())
+        set_blocked(BLOCKED_NONE);
+    else
+        set_blocked(pacing_blocked ? BLOCKED_PACING : BLOCKED_WINDOW);
+
+    return true;
+}
+
+/**
+ * Retransmits a segment in the ring, split into pieces if the path MTU shrunk
+ * since it was first sent. Retransmissions are never FEC protected, the block
+ * the segment was part of carries on with new data. Returns false (and fails
+ * the operation) if the payload could not be read.
+ */
+bool RDTConnection::resend_segment(uint64_t segment) {
+    size_t slot = segment & ring_mask;
+    size_t end = ring_seq[slot];
+
+    for (size_t offset = end - ring_len[slot]; offset < end || ring_len[slot] == 0; ) {
+        rdt_segment_t seg;
+        size_t len = compress_transfer ? build_compressed_segment(seg, end - offset, max_payload(), offset)
+            : build_network_segment(seg, *send_src, end - offset, offset);
+
+        if (seg.payload == NULL) {
+            LOG_ERROR("Failed to read payload data, aborting transmission");
+            finish_operation(false);
+            return false;
+        }
+
+        offset += len;
+        seg.header.seq_num = offset;
+        setACKNOW(seg);
+        if (offset >= send_src->length())
+            setEOF(seg);
+        if (offset >= send_src->length() && close_on_EOF && fast_open)
+            setFIN(seg);
+
+        LOG_DEBUG("Resending packet with SEQ " << seg.header.seq_num << " and payload " << len);
+
+        pacing_tokens -= sizeof(seg.header) + seg.header.data_len;
+        broadcast_network_segment(seg);
+
+        if (len == 0)
+            break;
+    }
+
+    counters.segments_sent++;
+    (fast_recovery ? counters.fast_retransmits : counters.timeout_retransmits)++;
+    loss_rate = std::min(1.0, loss_rate + RDT_LOSS_WEIGHT);
+
+    ring_flags[slot] |= SEG_RESENT;
+    clock_now(ring_sent[slot]);
+    arm_retransmit(segment);
+    return true;
+}
+
+/**
+ * Begins a new FEC block at offset. The amount of parity follows the loss
+ * rate: about twice the losses a block is expected to suffer. A block never
+ * spans more than a window, otherwise a loss would stall the window before
+ * the parity which could repair it goes out.
+ */
+void RDTConnection::start_fec_block(size_t offset) {
+    fec_stride = max_payload() - sizeof(rdt_fec_header_t);
+    fec_segments = std::max(1, std::min(fec_block, (int)(send_limit() / fec_stride)));
+
+    // Negligible loss rates (the estimate never quite decays to zero) get no parity
+    fec_parity = std::min(fec_max_parity, (int)ceil(loss_rate * fec_segments * 2 - 0.1));
+    if (fec_parity <= 0) {
+        fec_parity = 0;
+        return;
+    }
+
+    fec_parity = std::min(fec_parity, fec_segments);
+    fec_count = 0;
+    fec_block_start = offset;
+    fec_eof = false;
+    fec_buf.assign(fec_parity * (sizeof(rdt_fec_header_t) + fec_stride), 0);
+}
+
+/**
+ * Folds a data segment into the parity of its block
+ */
+void RDTConnection::add_fec_segment(rdt_segment_t &seg) {
+    char *parity = &fec_buf[(fec_count % fec_parity) * (sizeof(rdt_fec_header_t) + fec_stride)];
+    fec_xor(parity + sizeof(rdt_fec_header_t), seg.payload, seg.header.data_len);
+
+    fec_lengths[fec_count++] = seg.header.data_len;
+    fec_eof = seg.header.flags & EOF_MASK;
+    setFEC(seg);
+}
+
+/**
+ * Sends the parity of the current block, each parity segment only as long
+ * as the longest data segment it covers
+ */
+void RDTConnection::send_fec_parity() {
+    rdt_fec_header_t fec;
+    memset(&fec, 0, sizeof(fec));
+    fec.block_start = fec_block_start;
+    memcpy(fec.lengths, fec_lengths, fec_count * sizeof(fec_lengths[0]));
+    fec.count = fec_count;
+    fec.interleave = fec_parity;
+    fec.eof = fec_eof;
+
+    // Parity is optional, a remote which hasn't answered yet only gets what the limit leaves room for
+    for (int i = 0; i < fec_parity && i < fec_count && amplification_room() >= plpmtu - IP_HEADER - UDP_HEADER; i++) {
+        size_t parity_len = 0;
+        for (int j = i; j < fec_count; j += fec_parity)
+            parity_len = std::max(parity_len, (size_t)fec_lengths[j]);
+
+        char *parity = &fec_buf[i * (sizeof(rdt_fec_header_t) + fec_stride)];
+        fec.index = i;
+        memcpy(parity, &fec, sizeof(fec));
+
+        rdt_segment_t seg;
+        build_network_packet(seg, parity, sizeof(fec) + parity_len);
+        seg.header.seq_num = total_acknowledged_bytes + current_unacknowledged_bytes;
+        setPARITY(seg);
+        broadcast_network_segment(seg);
+        pacing_tokens -= sizeof(seg.header) + seg.header.data_len;
+    }
+
+    fec_count = 0;
+}
+
+/**
+ * Arms the timer for the oldest unacknowledged segment in the window
+ */
+void RDTConnection::set_send_timeout() {
+    retransmit_timer_t const *oldest = oldest_in_flight();
+
+    // With nothing in flight behind a closed window (or used up stream credit), zero window probes back off
+    if (oldest)
+        deadline = oldest->due;
+    else if (ring_head == ring_tail && (remote_window == 0 || streams_blocked))
+        time_from_now((RDT_TIMEOUT_SEC * USEC_CONVERSION + RDT_TIMEOUT_USEC) << std::min(window_probes, RDT_PERSIST_BACKOFF), deadline);
+    else
+        time_from_now(RDT_TIMEOUT_SEC * USEC_CONVERSION + RDT_TIMEOUT_USEC, deadline);
+
+    // Wake up early to send whatever pacing held back
+    if (pacing_blocked && timercmp(&pacing_deadline, &deadline, <))
+        deadline = pacing_deadline;
+
+    arm_timer();
+}
+
+/**
+ * Keeps the smallest RTT seen over the last RDT_MIN_RTT_WINDOW_SEC. Unlike an
+ * average, it leaves out time the ACK spent delayed or queued behind our own
+ * packets, which pacing would otherwise mistake for a slower path. The
+ * smoothed average is only reported in stats().
+ */
+void RDTConnection::sample_rtt(timeval const &sent) {
+    timeval now, rtt, age;
+    clock_now(now);
+    timersub(&now, &sent, &rtt);
+    timersub(&now, &min_rtt_stamp, &age);
+
+    long usec = std::max(1L, rtt.tv_sec * USEC_CONVERSION + rtt.tv_usec);
+    srtt = srtt == 0 ? usec : srtt + (usec - srtt) / 8;
+
+    if (min_rtt == 0 || usec <= min_rtt || age.tv_sec >= RDT_MIN_RTT_WINDOW_SEC) {
+        min_rtt = usec;
+        min_rtt_stamp = now;
+    }
+}
+
+/**
+ * Bytes per usec we pace segments at, 0 (unpaced) until the RTT is known
+ */
+double RDTConnection::pacing_rate() {
+    if (min_rtt == 0)
+        return 0;
+
+    return RDT_PACING_GAIN * send_limit() / min_rtt;
+}
+
+/**
+ * Refills the token bucket and tells whether another segment may go out now.
+ * If not, pacing_deadline is when it may. The bucket holds at most
+ * RDT_PACING_SLACK_USEC worth of tokens (and at least two full packets),
+ * enough to make up for timers firing late without allowing real bursts.
+ */
+bool RDTConnection::pacing_allows() {
+    double rate = pacing_rate();
+    if (rate == 0)
+        return true;
+
+    timeval now, elapsed;
+    clock_now(now);
+    timersub(&now, &pacing_refill, &elapsed);
+    pacing_refill = now;
+
+    double depth = std::max(2.0 * plpmtu, rate * RDT_PACING_SLACK_USEC);
+    pacing_tokens = std::min(depth, pacing_tokens + rate * (elapsed.tv_sec * USEC_CONVERSION + elapsed.tv_usec));
+
+    if (pacing_tokens >= 0)
+        return true;
+
+    time_from_now((long)ceil(-pacing_tokens / rate), pacing_deadline);
+    pacing_blocked = true;
+    trace_event(RDT_TRACE_PACING_WAIT, total_acknowledged_bytes + current_unacknowledged_bytes);
+    return false;
+}
+
+/**
+ * We're using cumilative ACKS--this means that we assume the client will only ACK
+ * bytes it has received. If we receive an ACK, we mark every sequence number less
+ * than it is as sent.
+ */
+void RDTConnection::send_packet(rdt_packet_t &pkt) {
+    if (isFIN(pkt) && !isFINACK(pkt)) {
+        LOG_ERROR("Send data interrupted: remote closed the connection");
+        finish_operation(false);
+        return;
+    } else if (!isACK(pkt)) {
+        drop_packet(pkt, RDT_DROP_UNEXPECTED, "expected ACK and received non-ACK packet.");
+        return;
+    } else if (pkt.header.transfer != send_transfer) {
+        drop_packet(pkt, RDT_DROP_STALE, "discarding ACK of an earlier transfer");
+        return;
+    }
+
+    LOG_DEBUG("Received ACK " << pkt.header.ack_num);
+
+    if (pkt.header.ack_num > send_src->length()) {
+        LOG_DEBUG("Garbage ACK " << pkt.header.ack_num << ", anticipated " << current_unacknowledged_bytes << "+" << total_acknowledged_bytes);
+        drop_packet(pkt, RDT_DROP_MALFORMED, "received garbage ACK value");
+        return;
+    }
+
+    // The window counts from the ACK it came with, a stale ACK's would overstate it
+    size_t previous_window = remote_window;
+    if (pkt.header.ack_num >= last_ack)
+        remote_window = (size_t)pkt.header.window << remote_window_scale;
+
+    // Segments the remote rebuilt from parity were lost all the same
+    if (pkt.header.seq_num > remote_recovered) {
+        loss_rate = std::min(1.0, loss_rate + (pkt.header.seq_num - remote_recovered) * RDT_LOSS_WEIGHT);
+        remote_recovered = pkt.header.seq_num;
+    }
+
+    if (pkt.header.ack_num < last_ack) {
+        drop_packet(pkt, RDT_DROP_STALE, "discarding duplicate ACK");
+        return;
+    } else if (pkt.header.ack_num > total_acknowledged_bytes + current_unacknowledged_bytes) {
+        drop_packet(pkt, RDT_DROP_MALFORMED, "ACK for data never sent");
+        return;
+    }
+
+    if (isSACK(pkt))
+        receive_SACK(pkt);
+    if (isSTREAM(pkt))
+        receive_stream_credits(pkt);
+
+    // Retire the segments this ACK covers. The most recently sent of them gives
+    // the freshest RTT sample, unless it was resent (its ACK could be for either
+    // copy) or selectively ACKed before (this ACK only waited on an older hole).
+    timeval newest_sent;
+    bool rtt_sampled = false;
+
+    while (ring_head != ring_tail && ring_seq[ring_head & ring_mask] <= pkt.header.ack_num) {
+        size_t slot = ring_head++ & ring_mask;
+        unacknowledged_payload -= ring_payload[slot];
+        if (!(ring_flags[slot] & (SEG_RESENT | SEG_SACKED))) {
+            newest_sent = ring_sent[slot];
+            rtt_sampled = true;
+        }
+    }
+    if (rtt_sampled)
+        sample_rtt(newest_sent);
+
+    // A segment is taken for lost once enough segments sent after it made it
+    // (the same odds as that many duplicate ACKs), unless FEC parity still on
+    // its way may rebuild it. That finds every hole in a window in one round trip.
+    uint64_t threshold = MAX_DUPLICATE_ACK + (fec_parity > 0 ? fec_segments : 0);
+    if (sack_high > threshold)
+        mark_lost(sack_high - threshold);
+
+    // The receiver ACKs every segment beyond a gap right away, so repeats of the
+    // same ACK mean the segment after it was lost. Remotes which send no
+    // selective ACKs are recovered from this way. Repeats which only move the
+    // window are updates sent as the remote's sink drained, not duplicates.
+    if (pkt.header.ack_num == last_ack && current_unacknowledged_bytes > 0 && remote_window == previous_window) {
+        counters.duplicate_acks++;
+
+        if (++duplicate_acks == (int)threshold && !in_recovery)
+            mark_lost(std::max(ring_head + 1, sack_high));
+    } else if (pkt.header.ack_num > last_ack) {
+        duplicate_acks = 0;
+
+        // Recovery ends once everything in flight when it started is ACKed. Until
+        // then an ACK which moves but stops short of that points at the next hole.
+        if (in_recovery && pkt.header.ack_num >= recover)
+            in_recovery = false;
+        else if (in_recovery && ring_head != ring_tail)
+            mark_lost(ring_head + 1);
+    }
+
+    total_acknowledged_bytes = pkt.header.ack_num;
+    current_unacknowledged_bytes -= (pkt.header.ack_num - last_ack);
+    send_src->release(total_acknowledged_bytes);
+    last_ack = pkt.header.ack_num;
+    num_timeouts = 0;
+    counters.transfer_bytes = total_acknowledged_bytes;
+
+    // The remote closes along with ACKing an EOF which carried our FIN
+    if (isFINACK(pkt))
+        got_FINACK = true;
+
+    // If everything is acknowledged, we're done!
+    if (sent_EOF && current_unacknowledged_bytes == 0 && total_acknowledged_bytes >= send_src->length()) {
+        LOG_INFO("Transmission complete.");
+        finish_operation(true);
+        return;
+    }
+
+    if (send_window())
+        set_send_timeout();
+}
+
+/**
+ * Marks the segments inside the selective ACK blocks of pkt, so they aren't
+ * resent. Blocks mostly grow at their end as data keeps arriving beyond a
+ * gap, so each block is marked from its end back to the first segment marked
+ * before, after a binary search for the end: O(log n) plus new segments only.
+ */
+void RDTConnection::receive_SACK(rdt_packet_t const &pkt) {
+    // Stream credits follow the blocks
+    size_t credits_len = isSTREAM(pkt) ? std::min((size_t)pkt.header.data_len, pkt.header.stream * sizeof(rdt_stream_credit_t)) : 0;
+    size_t blocks = std::min((size_t)RDT_SACK_BLOCKS, (pkt.header.data_len - credits_len) / sizeof(rdt_sack_block_t));
+
+    for (size_t i = 0; i < blocks; i++) {
+        rdt_sack_block_t block;
+        memcpy(&block, pkt.data + i * sizeof(block), sizeof(block));
+
+        // Past the last segment ending inside the block
+        uint64_t low = ring_head, high = ring_tail;
+        while (low < high) {
+            uint64_t mid = low + (high - low) / 2;
+            if (ring_seq[mid & ring_mask] <= block.end)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        for (uint64_t segment = low; segment-- > ring_head; ) {
+            size_t slot = segment & ring_mask;
+            if (ring_seq[slot] - ring_len[slot] < block.start || (ring_flags[slot] & SEG_SACKED))
+                break;
+            ring_flags[slot] |= SEG_SACKED;
+            sack_high = std::max(sack_high, segment + 1);
+
+            // The newest segment of a block, newly SACKed and never resent,
+            // gives an RTT sample its later cumulative ACK would not
+            if (segment + 1 == low && !(ring_flags[slot] & SEG_RESENT))
+                sample_rtt(ring_sent[slot]);
+        }
+    }
+}
+
+/**
+ * Takes the stream credits a stream transfer ACK carries after its SACK
+ * blocks. Credits only ever let a stream go further, so stale ones are harmless.
+ */
+void RDTConnection::receive_stream_credits(rdt_packet_t const &pkt) {
+    size_t count = pkt.header.stream;
+    if (count * sizeof(rdt_stream_credit_t) > pkt.header.data_len)
+        return;
+
+    char const *credits = pkt.data + pkt.header.data_len - count * sizeof(rdt_stream_credit_t);
+    for (size_t i = 0; i < count; i++) {
+        rdt_stream_credit_t credit;
+        memcpy(&credit, credits + i * sizeof(credit), sizeof(credit));
+
+        if (credit.stream < streams.size())
+            streams[credit.stream].limit = std::max(streams[credit.stream].limit, credit.limit);
+    }
+}
+
+/**
+ * See if the oldest segment in flight has timed out. If it has, every
+ * segment in flight the remote hasn't selectively ACKed is resent.
+ */
+void RDTConnection::send_timeout() {
+    retransmit_timer_t const *oldest = oldest_in_flight();
+    timeval now;
+    clock_now(now);
+
+    if (oldest && !timercmp(&now, &oldest->due, <)) {
+        if (++num_timeouts >= MAX_TRANSMIT_TIMEOUTS) {
+            LOG_ERROR("Timeout limit reached. Giving up.");
+            finish_operation(false);
+            return;
+        }
+
+        size_t seq_num = ring_seq[oldest->segment & ring_mask];
+        LOG_WARN("SEQ NUM " << seq_num << " has timed out. Resend!");
+        trace_event(RDT_TRACE_RETRANSMIT, seq_num, last_ack);
+
+        start_recovery(false);
+    } else if (!oldest && ring_head == ring_tail && (remote_window == 0 || streams_blocked) && !send_window_probe()) {
+        return;
+    }
+
+    // Even if nothing timed out, the remote may have opened up its window since
+    if (!send_window())
+        return;
+
+    set_send_timeout();
+}
+
+/**
+ * With nothing in flight, no ACK is on its way to tell us when the remote's
+ * closed window opens (or it gives a stream more credit), and the update the
+ * remote sends when it does may get lost. So we ask: the remote answers an
+ * empty probe with an ACK carrying its window and credits. Returns false (and
+ * fails the operation) if it stopped answering.
+ */
+bool RDTConnection::send_window_probe() {
+    if (++num_timeouts >= MAX_TRANSMIT_TIMEOUTS) {
+        LOG_ERROR("Remote stopped answering zero window probes. Giving up.");
+        finish_operation(false);
+        return false;
+    }
+
+    rdt_packet_t probe;
+    build_network_packet(probe);
+    probe.header.seq_num = total_acknowledged_bytes;
+    setWPROBE(probe);
+
+    // A remote which never answered has had all we may send it, the timeouts run out instead
+    if (amplification_room() < sizeof(probe.header))
+        return true;
+
+    LOG_DEBUG("Remote window closed, probing it (" << window_probes << " probes so far)");
+    window_probes++;
+    counters.window_probes++;
+    broadcast_network_packet(probe);
+    return true;
+}
+
+/**
+ * Enters recovery, which lasts until everything in flight now is ACKed.
+ * After a timeout, everything in flight which wasn't selectively ACKed is
+ * queued for retransmission; fast recovery leaves that to mark_lost().
+ */
+void RDTConnection::start_recovery(bool fast) {
+    in_recovery = true;
+    fast_recovery = fast;
+    recover = total_acknowledged_bytes + current_unacknowledged_bytes;
+    duplicate_acks = 0;
+
+    if (fast)
+        return;
+
+    resend_queue.clear();
+    for (uint64_t segment = ring_head; segment != ring_tail; segment++) {
+        size_t slot = segment & ring_mask;
+        if (!(ring_flags[slot] & SEG_SACKED)) {
+            ring_generation[slot]++;
+            resend_queue.push_back(segment);
+        }
+    }
+    loss_scan = ring_tail;
+}
+
+/**
+ * Queues the segments before end which weren't selectively ACKed for a fast
+ * retransmission, starting recovery if need be. Every segment is judged only
+ * once (loss_scan moves past it); should its retransmission get lost too, the
+ * timeout takes care of it. Queued segments drop their timers, which they get
+ * back once resent.
+ */
+void RDTConnection::mark_lost(uint64_t end) {
+    for (loss_scan = std::max(loss_scan, ring_head); loss_scan < std::min(end, ring_tail); loss_scan++) {
+        size_t slot = loss_scan & ring_mask;
+        if (ring_flags[slot] & SEG_SACKED)
+            continue;
+
+        if (!in_recovery) {
+            LOG_WARN("SEQ NUM " << ring_seq[slot] << " was lost. Fast retransmit!");
+            trace_event(RDT_TRACE_RETRANSMIT, ring_seq[slot], last_ack);
+            start_recovery(true);
+        }
+
+        ring_generation[slot]++;
+        resend_queue.push_back(loss_scan);
+    }
+}
+
+/**
+ * Orders the retransmission heap by deadline, soonest on top
+ */
+bool RDTConnection::later_timer(retransmit_timer_t const &a, retransmit_timer_t const &b) {
+    return timercmp(&a.due, &b.due, >);
+}
+
+/**
+ * Starts the retransmission timer of a segment just sent
+ */
+void RDTConnection::arm_retransmit(uint64_t segment) {
+    size_t slot = segment & ring_mask;
+    timeval rto;
+    rto.tv_sec = RDT_TIMEOUT_SEC;
+    rto.tv_usec = RDT_TIMEOUT_USEC;
+
+    retransmit_timer_t entry;
+    timeradd(&ring_sent[slot], &rto, &entry.due);
+    entry.segment = segment;
+    entry.generation = ++ring_generation[slot];
+
+    rto_heap.push_back(entry);
+    std::push_heap(rto_heap.begin(), rto_heap.end(), later_timer);
+}
+
+/**
+ * The timer of the oldest segment still in flight, NULL if none is. Timers of
+ * segments ACKed (or queued to be resent) since they were armed are discarded
+ * on the way, so each costs O(log n) once instead of a scan of the window per check.
+ */
+RDTConnection::retransmit_timer_t const *RDTConnection::oldest_in_flight() {
+    while (!rto_heap.empty()) {
+        retransmit_timer_t const &top = rto_heap.front();
+        size_t slot = top.segment & ring_mask;
+        if (top.segment >= ring_head && ring_generation[slot] == top.generation && !(ring_flags[slot] & SEG_SACKED))
+            return &top;
+
+        std::pop_heap(rto_heap.begin(), rto_heap.end(), later_timer);
+        rto_heap.pop_back();
+    }
+
+    return NULL;
+}
+
+/**
+ * Notes what sending is waiting on from now on, adding up how long it waited
+ */
+void RDTConnection::set_blocked(rdt_blocked_t why) {
+    if (why == blocked)
+        return;
+
+    timeval now, waited;
+    clock_now(now);
+    timersub(&now, &blocked_since, &waited);
+
+    if (blocked == BLOCKED_WINDOW)
+        window_wait += waited.tv_sec * USEC_CONVERSION + waited.tv_usec;
+    else if (blocked == BLOCKED_PACING)
+        pacing_wait += waited.tv_sec * USEC_CONVERSION + waited.tv_usec;
+
+    blocked = why;
+    blocked_since = now;
+}
+
+bool RDTConnection::receive_data( std::string &data ) {
+    if (!start_receive(data, NULL, NULL))
+        return false;
+
+    return finish_blocking_receive();
+}
+
+/**
+ * Receives a transfer and writes it to fd as segments arrive instead of
+ * buffering the whole transfer in memory
+ */
+bool RDTConnection::receive_to_fd( int fd ) {
+    return receive_to_fd(fd, rdt_stripe_t());
+}
+
+/**
+ * Receives a single stripe of a transfer (see send_fd()), writing it into its
+ * ranges of fd, counted from the current file offset. Resumed stripes pick up
+ * at stripe.start, after what an earlier transfer wrote.
+ */
+bool RDTConnection::receive_to_fd( int fd, rdt_stripe_t const &stripe ) {
+    if (!start_receive_payload(new fd_sink(fd, stripe), NULL, NULL))
+        return false;
+
+    return finish_blocking_receive();
+}
+
+/**
+ * Drives a receive started by the blocking interface, closing our end
+ * if the remote closed the connection in the middle of the transfer
+ */
+bool RDTConnection::finish_blocking_receive() {
+    bool success = run_operation();
+
+    if (!success && got_FIN)
+        close();
+
+    return success;
+}
+
+bool RDTConnection::start_receive( std::string &data, rdt_callback_t done, void *context ) {
+    return start_receive_payload(new string_sink(data), done, context);
+}
+
+bool RDTConnection::start_receive_to_fd( int fd, rdt_callback_t done, void *context ) {
+    return start_receive_payload(new fd_sink(fd, rdt_stripe_t()), done, context);
+}
+
+bool RDTConnection::start_receive_to_fd( int fd, rdt_stripe_t const &stripe, rdt_callback_t done, void *context ) {
+    return start_receive_payload(new fd_sink(fd, stripe), done, context);
+}
+
+/**
+ * Opens the next stream of the next stream transfer, see send_streams() and
+ * receive_streams(). Returns its id, -1 if the transfer can't carry any more
+ * streams (or a transfer is running).
+ */
+int RDTConnection::open_stream() {
+    if (busy() || streams.size() >= RDT_MAX_STREAMS)
+        return -1;
+
+    streams.push_back(stream_t());
+    return streams.size() - 1;
+}
+
+/**
+ * Sets the payload of a stream the next stream transfer sends. The string must
+ * outlive the transfer.
+ */
+bool RDTConnection::write_stream( int stream, std::string const &data ) {
+    return set_stream_source(stream, new string_source(data));
+}
+
+/**
+ * Sets the payload of a stream the next stream transfer sends to len bytes of
+ * fd starting at offset, read as the transfer goes
+ */
+bool RDTConnection::write_stream_fd( int stream, int fd, off_t offset, size_t len ) {
+    return set_stream_source(stream, new fd_source(fd, offset, len, window_size, rdt_stripe_t()));
+}
+
+/**
+ * Receives a stream of the next stream transfer into data, which must outlive
+ * the transfer
+ */
+bool RDTConnection::read_stream( int stream, std::string &data ) {
+    return set_stream_sink(stream, new string_sink(data));
+}
+
+/**
+ * Receives a stream of the next stream transfer into fd, written as it arrives
+ * (see receive_to_fd())
+ */
+bool RDTConnection::read_stream_fd( int stream, int fd ) {
+    return set_stream_sink(stream, new fd_sink(fd, rdt_stripe_t()));
+}
+
+/**
+ * Sends the streams opened since the last stream transfer in a single transfer,
+ * interleaved as the window and the credit the remote gives each of them allow.
+ * Streams without a payload are empty.
+ */
+bool RDTConnection::send_streams() {
+    if (!start_send_streams(NULL, NULL))
+        return false;
+
+    return finish_blocking_send();
+}
+
+/**
+ * Receives a stream transfer into the destinations of the streams opened
+ * since the last one. stream_done (if any) is called with the context as
+ * each stream completes.
+ */
+bool RDTConnection::receive_streams( rdt_stream_callback_t stream_done, void *context ) {
+    if (!start_receive_streams(stream_done, NULL, context))
+        return false;
+
+    return finish_blocking_receive();
+}
+
+bool RDTConnection::start_send_streams( rdt_callback_t done, void *context ) {
+    if (busy() || sock_fd == -1)
+        return false;
+
+    stream_transfer = true;
+    return start_send_payload(new stream_source(streams), done, context);
+}
+
+/**
+ * Begins receiving a stream transfer. stream_done (if any) is called with the
+ * context as each stream completes, before the transfer does.
+ */
+bool RDTConnection::start_receive_streams( rdt_stream_callback_t stream_done, rdt_callback_t done, void *context ) {
+    if (busy() || sock_fd == -1)
+        return false;
+
+    stream_transfer = true;
+    stream_callback = stream_done;
+    return start_receive_payload(NULL, done, context);
+}
+
+/**
+ * Sets the payload of a stream opened for the next transfer. Takes ownership
+ * of src.
+ */
+bool RDTConnection::set_stream_source( int stream, payload_source *src ) {
+    if (busy() || stream < 0 || (size_t)stream >= streams.size() || streams[stream].src) {
+        delete src;
+        return false;
+    }
+
+    streams[stream].src = src;
+    return true;
+}
+
+/**
+ * Sets the destination of a stream opened for the next transfer. Takes
+ * ownership of sink.
+ */
+bool RDTConnection::set_stream_sink( int stream, payload_sink *sink ) {
+    if (busy() || stream < 0 || (size_t)stream >= streams.size() || streams[stream].dest.sink) {
+        delete sink;
+        return false;
+    }
+
+    streams[stream].dest.sink = sink;
+    return true;
+}
+
+/**
+ * Begins receiving a transfer. Takes ownership of sink.
+ */
+bool RDTConnection::start_receive_payload( payload_sink *sink, rdt_callback_t done, void *context ) {
+    if (busy() || sock_fd == -1) {
+        delete sink;
+        return false;
+    }
+
+    start_operation(OP_RECEIVE, done, context);
+    recv_dest.sink = sink;
+    total_bytes_received = 0;
+    got_EOF = false;
+    closing_with_EOF = false;
+    unacked_segments = 0;
+    reset_receive_buffers();
+
+    counters.transfer_bytes = 0;
+    clock_now(transfer_start);
+    memset(&transfer_end, 0, sizeof(transfer_end));
+
+    // A request which arrived on the remote's SYN was ACKed along with it
+    if (request_pending) {
+        request_pending = false;
+        got_EOF = true;
+        total_bytes_received = syn_request.size();
+        counters.transfer_bytes = total_bytes_received;
+
+        LOG_INFO("Received " << total_bytes_received << " byte request with the SYN");
+
+        char *room = pool.reserve(syn_request.size());
+        if (room)
+            memcpy(room, syn_request.data(), syn_request.size());
+
+        if (!room || !write_to_sink(recv_dest, pool.commit(syn_request.size())))
+            finish_operation(false);
+        else if (undelivered_bytes == 0)
+            finish_operation(true);
+        else
+            set_receive_timeout();
+        return true;
+    }
+
+    time_from_now(RDT_TIMEOUT_USEC, idle_deadline);
+    set_receive_timeout();
+    return true;
+}
+
+/**
+ * ACKs are cumulative and delayed: in order data is only ACKed every ack_every
+ * segments or ack_delay usec after the oldest unACKed one, whichever is first.
+ * Anything the sender is waiting on (out of order data, duplicates, EOF and
+ * ACKNOW segments) is ACKed right away.
+ *
+ * Out of order segments are held until the gap before them is filled, either
+ * by a retransmission or by rebuilding the missing segment from FEC parity.
+ * In order data the sink has no room for is held too, shrinking our window.
+ */
+void RDTConnection::receive_packet(rdt_packet_t &pkt) {
+    // Any packet from the remote means it is still alive
+    time_from_now(RDT_TIMEOUT_USEC, idle_deadline);
+
+    // Offsets start over with every transfer, so segments of the last one (resent
+    // before our EOFACK got through) would pass for ours. Its sender waits on that EOFACK.
+    if (pkt.header.transfer == last_transfer && (!isFIN(pkt) || isEOF(pkt))) {
+        LOG_DEBUG("Segment " << pkt.header.seq_num << " of the last transfer. Resending its EOFACK");
+        counters.duplicate_segments++;
+
+        ack_last_transfer();
+        set_receive_timeout();
+        return;
+    }
+    recv_transfer = pkt.header.transfer;
+
+    if (!flush_undelivered()) {
+        LOG_ERROR("Failed to store received data, giving up.");
+        finish_operation(false);
+        return;
+    }
+
+    // We have all of it, only the sink is behind. The remote still waiting
+    // on us means our EOFACK got lost.
+    if (got_EOF) {
+        receive_EOF();
+        return;
+    }
+
+    // The remote waits on our window, let it know where it stands
+    if (isWPROBE(pkt)) {
+        send_ACK(false);
+        set_receive_timeout();
+        return;
+    }
+
+    if (isFIN(pkt) && !isEOF(pkt)) {
+        LOG_ERROR("Receive data interrupted: remote closed the connection");
+        finish_operation(got_EOF);
+        return;
+    }
+
+    // The remote closes along with this transfer, our EOFACK answers both
+    if (isFIN(pkt))
+        closing_with_EOF = true;
+
+    if (isPARITY(pkt)) {
+        if (!receive_parity(pkt)) {
+            LOG_ERROR("Failed to store received data, giving up.");
+            finish_operation(false);
+        } else if (got_EOF) {
+            receive_EOF();
+        } else {
+            set_receive_timeout();
+        }
+        return;
+    }
+
+    // Empty segments are only duplicates if they don't start a new transfer (empty EOF)
+    if (pkt.header.seq_num < total_bytes_received || (pkt.header.seq_num == total_bytes_received && pkt.header.data_len > 0)) {
+        LOG_DEBUG("Duplicate packet " << pkt.header.seq_num << " detected. Resending ACK");
+        counters.duplicate_segments++;
+
+        send_ACK(false);
+        set_receive_timeout();
+        return;
+    }
+
+    // Compressed segments carry more data than their payload. FEC parity only covers
+    // segments as they are, so those never come compressed.
+    // Either way the data ends up in a pooled buffer it can be held in as it is.
+    RDTBufferPool::buffer data = recv_packet.slice(sizeof(pkt.header), pkt.header.data_len);
+    size_t data_len = pkt.header.data_len;
+
+    if (isCOMPRESS(pkt)) {
+        char *room = pool.reserve(LZ_MAX_BLOCK);
+
+        if (isFEC(pkt) || !room || !lz_decompress(pkt.data, pkt.header.data_len, room, LZ_MAX_BLOCK, data_len)) {
+            drop_packet(pkt, RDT_DROP_MALFORMED, "compressed segment does not decompress");
+            return;
+        }
+        data = pool.commit(data_len);
+    }
+
+    if (pkt.header.seq_num < data_len || (isSTREAM(pkt) && pkt.header.ack_num < data_len)) {
+        drop_packet(pkt, RDT_DROP_MALFORMED, "segment ends before it starts");
+        return;
+    } else if (isSTREAM(pkt) && (pkt.header.stream & ~RDT_STREAM_LAST) >= RDT_MAX_STREAMS) {
+        drop_packet(pkt, RDT_DROP_MALFORMED, "segment of an impossible stream");
+        return;
+    }
+
+    size_t start = pkt.header.seq_num - data_len;
+
+    if (start > total_bytes_received) {
+        LOG_DEBUG("packet SEQ num " << pkt.header.seq_num << " out of order, expected " << total_bytes_received << "+" << data_len);
+
+        // Hold on to it (as long as it fits our window) and let the sender know where the gap is
+        if (reorder.find(start)) {
+            counters.duplicate_segments++;
+        } else if (undelivered_bytes + reorder_bytes + data_len <= receive_window
+                && reorder.insert(start, data, isEOF(pkt), isFEC(pkt))) {
+            reorder_bytes += data_len;
+
+            // Its stream may well have everything before it
+            if (stream_transfer && isSTREAM(pkt) && !receive_stream_segment(pkt, data)) {
+                LOG_ERROR("Failed to store received data, giving up.");
+                finish_operation(false);
+                return;
+            }
+        }
+
+        send_ACK(false);
+        set_receive_timeout();
+        return;
+    }
+
+    // If the above checks pass, this is the next in order segment. Only a sender
+    // ignoring our window sends more than the sink's backlog leaves room for.
+    if (undelivered_bytes > 0 && undelivered_bytes + data_len > receive_window) {
+        drop_packet(pkt, RDT_DROP_UNEXPECTED, "segment beyond our receive window");
+        send_ACK(false);
+        set_receive_timeout();
+        return;
+    }
+
+    bool filled_gap = !reorder.empty();
+    if ( (stream_transfer && isSTREAM(pkt) && !receive_stream_segment(pkt, data))
+            || !deliver_segment(start, data, isEOF(pkt), isFEC(pkt)) || !deliver_held_segments() ) {
+        LOG_ERROR("Failed to store received data, giving up.");
+        finish_operation(false);
+        return;
+    }
+
+    num_timeouts = 0;
+
+    if (got_EOF) {
+        receive_EOF();
+        return;
+    }
+
+    // Let the sender know right away when it has been told about a gap which just (partly) filled
+    if (++unacked_segments >= ack_every || isACKNOW(pkt) || filled_gap)
+        send_ACK(false);
+    else if (unacked_segments == 1)
+        time_from_now(ack_delay, ack_deadline);
+
+    set_receive_timeout();
+}
+
+/**
+ * Passes whatever part of the segment starting at offset start we don't have
+ * yet on to the sink. Protected segments are also remembered for FEC decoding.
+ * Stream transfers have no sink here, segments went to their streams as they
+ * arrived. Returns false if the sink failed.
+ */
+bool RDTConnection::deliver_segment(size_t start, RDTBufferPool::buffer const &data, bool eof, bool fec) {
+    // A retransmission may have been segmented differently and overlap what we already have
+    size_t overlap = total_bytes_received - start;
+    size_t len = data.size();
+
+    if (len > overlap) {
+        if ( !write_to_sink(recv_dest, data.slice(overlap, len - overlap)) )
+            return false;
+        total_bytes_received += len - overlap;
+        counters.transfer_bytes = total_bytes_received;
+    }
+
+    if (eof && start + len == total_bytes_received)
+        got_EOF = true;
+
+    if (fec) {
+        if (fec_history.full())
+            fec_history.pop_front();
+        fec_history.insert(start, data, eof, fec);
+    }
+
+    return true;
+}
+
+/**
+ * Delivers the held out of order segments which are no longer out of order
+ */
+bool RDTConnection::deliver_held_segments() {
+    while (!reorder.empty() && reorder.front().start <= total_bytes_received) {
+        RDTSegmentRing::segment_t &held = reorder.front();
+
+        if (!deliver_segment(held.start, held.data, held.eof, held.fec))
+            return false;
+
+        reorder_bytes -= held.data.size();
+        reorder.pop_front();
+    }
+
+    return true;
+}
+
+/**
+ * Writes data to the sink of a destination, after whatever is already waiting
+ * for it. What the sink has no room for waits (by reference) to be offered
+ * again. Returns false if the sink failed.
+ */
+bool RDTConnection::write_to_sink(destination_t &dest, RDTBufferPool::buffer const &data) {
+    size_t taken = 0;
+
+    if (!dest.sink)
+        return true;
+
+    if (dest.undelivered.empty()) {
+        ssize_t written = dest.sink->write(data.data(), data.size());
+        if (written < 0)
+            return false;
+
+        taken = written;
+        time_from_now(RDT_SINK_RETRY_USEC, sink_retry);
+    }
+
+    if (taken < data.size()) {
+        dest.undelivered.push_back(data.slice(taken, data.size() - taken));
+        dest.undelivered_bytes += data.size() - taken;
+        undelivered_bytes += data.size() - taken;
+    }
+
+    return true;
+}
+
+/**
+ * Offers the sink of a destination what it had no room for before.
+ * Returns false if the sink failed.
+ */
+bool RDTConnection::flush_destination(destination_t &dest) {
+    while (!dest.undelivered.empty()) {
+        RDTBufferPool::buffer &data = dest.undelivered.front().data;
+        ssize_t written = dest.sink->write(data.data(), data.size());
+        if (written < 0)
+            return false;
+
+        dest.undelivered_bytes -= written;
+        undelivered_bytes -= written;
+        if ((size_t)written < data.size()) {
+            data = data.slice(written, data.size() - written);
+            break;
+        }
+        dest.undelivered.pop_front();
+    }
+
+    return true;
+}
+
+/**
+ * Offers every sink what it had no room for before. Should that open up our
+ * window (from closed, or by half of it), or the credit of a stream by half a
+ * stream window, the remote hears about it right away, it may be waiting on it.
+ * Returns false if a sink failed.
+ */
+bool RDTConnection::flush_undelivered() {
+    if (undelivered_bytes == 0)
+        return true;
+
+    bool update = false;
+    if (!flush_destination(recv_dest))
+        return false;
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        if (streams[i].dest.undelivered.empty())
+            continue;
+        if (!flush_destination(streams[i].dest))
+            return false;
+
+        update = update || stream_credit(streams[i]) - streams[i].limit >= RDT_STREAM_WINDOW / 2;
+        finish_stream(i, false);
+    }
+
+    time_from_now(RDT_SINK_RETRY_USEC, sink_retry);
+
+    size_t window = (size_t)advertised_window() << local_window_scale;
+    update = update || (window > window_sent && (window_sent == 0 || window - window_sent >= receive_window / 2));
+    if (!got_EOF && update)
+        send_ACK(false);
+
+    return true;
+}
+
+/**
+ * The transfer is all here: ACKs its EOF, and completes the receive once the
+ * sinks took all of it
+ */
+void RDTConnection::receive_EOF() {
+    send_ACK(true);
+
+    if (undelivered_bytes > 0) {
+        set_receive_timeout();
+        return;
+    }
+
+    complete_receive();
+}
+
+/**
+ * Completes a receive which the sinks took all of, along with the streams
+ * not complete yet (those which carried nothing)
+ */
+void RDTConnection::complete_receive() {
+    LOG_INFO("Received EOF packet, transmission complete.");
+    last_transfer = recv_transfer;
+    last_transfer_bytes = total_bytes_received;
+
+    for (size_t i = 0; i < streams.size() && stream_transfer; i++)
+        finish_stream(i, true);
+
+    finish_operation(true);
+}
+
+/**
+ * Passes the data of a stream transfer segment on to its stream. Segments
+ * the stream has everything before go to its sink right away, followed by
+ * those held for them, later ones are held. Returns false if the sink failed.
+ */
+bool RDTConnection::receive_stream_segment(rdt_packet_t const &pkt, RDTBufferPool::buffer const &data) {
+    size_t id = pkt.header.stream & ~RDT_STREAM_LAST;
+    if (id >= streams.size())
+        streams.resize(id + 1);
+
+    stream_t &stream = streams[id];
+    size_t end = pkt.header.ack_num;
+    size_t start = end - data.size();
+
+    if (pkt.header.stream & RDT_STREAM_LAST)
+        stream.length = end;
+
+    if (stream.done || end <= stream.received) {
+        return true;
+    } else if (start > stream.received) {
+        // Never at a limit, it only ever holds segments the transfer holds as well
+        if (!stream.reorder.find(start))
+            stream.reorder.insert(start, data);
+        return true;
+    }
+
+    if (!deliver_stream_segment(stream, start, data))
+        return false;
+
+    while (!stream.reorder.empty() && stream.reorder.front().start <= stream.received) {
+        RDTSegmentRing::segment_t &held = stream.reorder.front();
+        if (!deliver_stream_segment(stream, held.start, held.data))
+            return false;
+        stream.reorder.pop_front();
+    }
+
+    finish_stream(id, false);
+    return true;
+}
+
+/**
+ * Passes whatever part of a stream's segment starting at stream offset start
+ * it doesn't have yet on to its sink. Returns false if the sink failed.
+ */
+bool RDTConnection::deliver_stream_segment(stream_t &stream, size_t start, RDTBufferPool::buffer const &data) {
+    size_t overlap = stream.received - start;
+    size_t len = data.size();
+
+    if (len <= overlap)
+        return true;
+    if (!write_to_sink(stream.dest, data.slice(overlap, len - overlap)))
+        return false;
+
+    stream.received += len - overlap;
+    return true;
+}
+
+/**
+ * Completes a stream once its sink took all of it (or, if all_here, whatever
+ * it got, the transfer being over), letting go of its sink
+ */
+void RDTConnection::finish_stream(int id, bool all_here) {
+    stream_t &stream = streams[id];
+    if (stream.done || !stream.dest.undelivered.empty())
+        return;
+    if (!all_here && stream.received != stream.length)
+        return;
+
+    stream.done = true;
+    stream.reorder.clear();
+    delete stream.dest.sink;
+    stream.dest.sink = NULL;
+
+    LOG_DEBUG("Stream " << id << " complete, " << stream.received << " bytes");
+
+    if (stream_callback)
+        stream_callback(*this, id, op_context);
+}
+
+/**
+ * How far into a stream the sender may go: what its sink took so far
+ * plus a stream window
+ */
+uint64_t RDTConnection::stream_credit(stream_t const &stream) {
+    return stream.received - stream.dest.undelivered_bytes + RDT_STREAM_WINDOW;
+}
+
+/**
+ * Forgets the streams of the last stream transfer, along with their
+ * sources and destinations
+ */
+void RDTConnection::clear_streams() {
+    for (size_t i = 0; i < streams.size(); i++) {
+        delete streams[i].src;
+        delete streams[i].dest.sink;
+    }
+
+    streams.clear();
+    stream_transfer = false;
+    streams_blocked = false;
+    stream_callback = NULL;
+}
+
+/**
+ * Looks up a held segment with exactly the given bounds
+ */
+RDTSegmentRing::segment_t const *RDTConnection::find_held_segment(size_t start, size_t len) {
+    RDTSegmentRing::segment_t const *held = reorder.find(start);
+    if (held && held->data.size() == len)
+        return held;
+
+    held = fec_history.find(start);
+    if (held && held->data.size() == len)
+        return held;
+
+    return NULL;
+}
+
+/**
+ * Rebuilds a lost segment from parity: XORing the parity with every other
+ * segment it covers leaves the missing one. Only possible when exactly one
+ * of them is missing. Returns false if the sink failed.
+ */
+bool RDTConnection::receive_parity(rdt_packet_t &pkt) {
+    rdt_fec_header_t fec;
+
+    if (pkt.header.data_len < sizeof(fec)) {
+        drop_packet(pkt, RDT_DROP_MALFORMED, "parity segment too short");
+        return true;
+    }
+
+    memcpy(&fec, pkt.data, sizeof(fec));
+    if (fec.count == 0 || fec.count > RDT_FEC_MAX_BLOCK || fec.interleave == 0 || fec.index >= fec.interleave) {
+        drop_packet(pkt, RDT_DROP_MALFORMED, "malformed parity segment");
+        return true;
+    }
+
+    // The segment is rebuilt in place in the pool, and only carved out if it is kept
+    size_t parity_len = pkt.header.data_len - sizeof(fec);
+    char *rebuilt = pool.reserve(parity_len);
+    if (!rebuilt)
+        return false;
+
+    memcpy(rebuilt, pkt.data + sizeof(fec), parity_len);
+
+    size_t offset = fec.block_start;
+    size_t missing_start = 0;
+    size_t missing_len = 0;
+    bool missing_eof = false;
+    int missing = 0;
+
+    for (int i = 0; i < fec.count; offset += fec.lengths[i++]) {
+        if (i % fec.interleave != fec.index)
+            continue;
+
+        size_t len = fec.lengths[i];
+        RDTSegmentRing::segment_t const *held = find_held_segment(offset, len);
+
+        if (len > parity_len) {
+            drop_packet(pkt, RDT_DROP_MALFORMED, "malformed parity segment");
+            return true;
+        } else if (held) {
+            fec_xor(rebuilt, held->data.data(), len);
+        } else {
+            missing++;
+            missing_start = offset;
+            missing_len = len;
+            missing_eof = fec.eof && i == fec.count - 1;
+        }
+    }
+
+    // Nothing to do if we already have the segment (or can't tell what it was)
+    if (missing != 1 || missing_start + missing_len <= total_bytes_received || reorder.find(missing_start))
+        return true;
+
+    LOG_DEBUG("Rebuilt segment " << missing_start + missing_len << " from parity");
+    trace_event(RDT_TRACE_REBUILT, missing_start + missing_len, total_bytes_received);
+
+    if (!reorder.insert(missing_start, pool.commit(missing_len), missing_eof, true))
+        return true;
+
+    fec_recovered++;
+    reorder_bytes += missing_len;
+
+    if (reorder.front().start > total_bytes_received)
+        return true;
+
+    if (!deliver_held_segments())
+        return false;
+
+    if (!got_EOF)
+        send_ACK(false);
+
+    return true;
+}
+
+/**
+ * Forgets every held segment, keeping the room they took for the next transfer
+ */
+void RDTConnection::reset_receive_buffers() {
+    // As many out of order segments as a full window of the smallest ones
+    // holds, any more are dropped as if the window was full
+    size_t min_payload = MSS - sizeof(rdt_header_t) - sizeof(rdt_fec_header_t);
+    reorder.set_limit(receive_window / min_payload + 1);
+
+    reorder.clear();
+    reorder_bytes = 0;
+    fec_history.clear();
+    fec_recovered = 0;
+    recv_dest.undelivered.clear();
+    recv_dest.undelivered_bytes = 0;
+    undelivered_bytes = 0;
+}
+
+/**
+ * Sends a cumulative ACK covering everything received so far. While segments
+ * are held beyond a gap, the ACK also carries up to RDT_SACK_BLOCKS blocks of
+ * held data (the lowest ones) so the sender only resends what is missing.
+ * ACKs of a stream transfer then carry the credit of every stream not done.
+ */
+void RDTConnection::send_ACK(bool eof) {
+    rdt_sack_block_t blocks[ RDT_SACK_BLOCKS ];
+    size_t num_blocks = 0;
+
+    for (size_t i = 0; i < reorder.size(); i++) {
+        size_t start = reorder[i].start;
+        size_t end = start + reorder[i].data.size();
+
+        if (num_blocks > 0 && start <= blocks[num_blocks - 1].end) {
+            blocks[num_blocks - 1].end = std::max((size_t)blocks[num_blocks - 1].end, end);
+        } else if (num_blocks < RDT_SACK_BLOCKS) {
+            blocks[num_blocks].start = start;
+            blocks[num_blocks++].end = end;
+        } else {
+            break;
+        }
+    }
+
+    // Stream transfers follow up with the credit of every stream still being received
+    char payload[ sizeof(blocks) + RDT_MAX_STREAMS * sizeof(rdt_stream_credit_t) ];
+    size_t payload_len = num_blocks * sizeof(blocks[0]);
+    uint16_t num_credits = 0;
+    memcpy(payload, blocks, payload_len);
+
+    for (size_t i = 0; i < streams.size() && stream_transfer; i++) {
+        if (streams[i].done)
+            continue;
+
+        rdt_stream_credit_t credit;
+        memset(&credit, 0, sizeof(credit));
+        credit.limit = streams[i].limit = stream_credit(streams[i]);
+        credit.stream = i;
+        memcpy(payload + payload_len, &credit, sizeof(credit));
+        payload_len += sizeof(credit);
+        num_credits++;
+    }
+
+    rdt_segment_t response;
+    build_network_packet(response, payload, payload_len);
+
+    LOG_DEBUG("ACK " << total_bytes_received);
+
+    // ACKs carry no data, their sequence number tells the sender how many
+    // segments we rebuilt from parity so it can gauge the loss rate
+    response.header.ack_num = total_bytes_received;
+    response.header.seq_num = fec_recovered;
+    response.header.transfer = recv_transfer;
+    setACK(response);
+
+    if (num_blocks > 0)
+        setSACK(response);
+    if (num_credits > 0) {
+        setSTREAM(response);
+        response.header.stream = num_credits;
+    }
+    if (eof)
+        setEOFACK(response);
+
+    // The remote's FIN rode on its EOF: ACK it and close our end along with it.
+    // Like the EOFACK, our FIN isn't waited on, the remote resends its EOF
+    // until it hears from us.
+    if (eof && closing_with_EOF) {
+        got_FIN = true;
+        got_FINACK = true;
+        setFINACK(response);
+        setFIN(response);
+    }
+
+    broadcast_network_segment(response);
+    unacked_segments = 0;
+    window_sent = (size_t)response.header.window << local_window_scale;
+}
+
+/**
+ * EOFACKs the last transfer received on behalf of its sender, which missed it
+ */
+void RDTConnection::ack_last_transfer() {
+    rdt_packet_t response;
+    build_network_packet(response);
+
+    response.header.ack_num = last_transfer_bytes;
+    response.header.transfer = last_transfer;
+    setACK(response);
+    setEOFACK(response);
+
+    broadcast_network_packet(response);
+}
+
+void RDTConnection::receive_timeout() {
+    timeval now;
+    clock_now(now);
+
+    if (unacked_segments > 0 && !timercmp(&now, &ack_deadline, <))
+        send_ACK(false);
+
+    if (undelivered_bytes > 0 && !timercmp(&now, &sink_retry, <)) {
+        if (!flush_undelivered()) {
+            LOG_ERROR("Failed to store received data, giving up.");
+            finish_operation(false);
+            return;
+        } else if (got_EOF && undelivered_bytes == 0) {
+            complete_receive();
+            return;
+        }
+    }
+
+    // The remote only probes while the sink keeps our window closed, that's no reason to give up on it
+    if (undelivered_bytes > 0 && !timercmp(&now, &idle_deadline, <))
+        time_from_now(RDT_TIMEOUT_USEC, idle_deadline);
+
+    if (timercmp(&now, &idle_deadline, <)) {
+        set_receive_timeout();
+        return;
+    }
+
+    num_timeouts++;
+
+    // A fast open remote sends no more than a few packets before we answer (see
+    // amplification_room()), if those got lost it waits to hear from us
+    if (fast_open && !handshake_SYNACK && unacked_segments == 0)
+        send_ACK(false);
+
+    LOG_WARN("Read timeout. Set timeout count to " << num_timeouts);
+    trace_event(RDT_TRACE_RECEIVE_TIMEOUT, total_bytes_received);
+
+    if (num_timeouts >= MAX_TRANSMIT_TIMEOUTS) {
+        LOG_ERROR("Timeout limit " << MAX_TRANSMIT_TIMEOUTS << " exceeded. Giving up.");
+
+        finish_operation(false);
+        return;
+    }
+
+    time_from_now(RDT_TIMEOUT_USEC, idle_deadline);
+    set_receive_timeout();
+}
+
+/**
+ * The receiver's deadline is whichever comes first of the pending
+ * delayed ACK, offering the sink its backlog again and the sender going silent
+ */
+void RDTConnection::set_receive_timeout() {
+    if (unacked_segments > 0 && timercmp(&ack_deadline, &idle_deadline, <))
+        deadline = ack_deadline;
+    else
+        deadline = idle_deadline;
+
+    if (undelivered_bytes > 0 && timercmp(&sink_retry, &deadline, <))
+        deadline = sink_retry;
+
+    arm_timer();
+}
+
+/**
+ * Marks the start of a new operation. Only one operation may run at a time.
+ */
+void RDTConnection::start_operation(rdt_op_t type, rdt_callback_t done, void *context) {
+    op = type;
+    op_success = false;
+    op_callback = done;
+    op_context = context;
+    num_timeouts = 0;
+}
+
+/**
+ * Completes the current operation and notifies its owner. The callback runs
+ * last so that it is free to start the next operation right away.
+ */
+void RDTConnection::finish_operation(bool success) {
+    rdt_callback_t done = op_callback;
+    void *context = op_context;
+    bool transfer = op == OP_SEND || op == OP_RECEIVE;
+
+    abort_operation();
+    op_success = success;
+
+    if (transfer)
+        log_stats(true);
+
+    if (done)
+        done(*this, success, context);
+}
+
+/**
+ * Forgets the current operation (if any) without notifying anyone
+ */
+void RDTConnection::abort_operation() {
+    if ((op == OP_SEND || op == OP_RECEIVE) && transfer_end.tv_sec == 0)
+        clock_now(transfer_end);
+    set_blocked(BLOCKED_NONE);
+
+    op = OP_NONE;
+    op_callback = NULL;
+    op_context = NULL;
+
+    delete send_src;
+    send_src = NULL;
+    ring_head = ring_tail = sack_high = loss_scan = 0;
+    rto_heap.clear();
+    resend_queue.clear();
+
+    delete recv_dest.sink;
+    recv_dest.sink = NULL;
+    if (stream_transfer)
+        clear_streams();
+    reset_receive_buffers();
+
+    memset(&deadline, 0, sizeof(deadline));
+    arm_timer();
+}
+
+/**
+ * Blocking driver for an operation: waits for packets or the next timeout
+ * and steps the operation until it completes. Returns its result.
+ */
+bool RDTConnection::run_operation() {
+    while (busy()) {
+        if (wait_readable(next_timeout()))
+            on_readable();
+
+        if (busy() && next_timeout() == 0)
+            on_timer();
+    }
+
+    return op_success;
+}
+
+/**
+ * Processes the packets which have arrived for the current operation.
+ * Nothing is read while no operation is pending, packets stay queued
+ * for the next one. Returns after a bounded batch so a busy connection
+ * can't starve others sharing the same event loop.
+ */
+void RDTConnection::on_readable() {
+    rdt_packet_t *pkt;
+    log_stats(false);
+
+    for (int i = 0; i < RDT_READ_BATCH && busy(); i++) {
+        if (!(pkt = read_network_packet()))
+            break;
+
+        // Handshake retransmissions were already answered by read_network_packet()
+        if (isSYN(*pkt) && op != OP_CONNECT)
+            continue;
+
+        switch (op) {
+            case OP_CONNECT: connect_packet(*pkt); break;
+            case OP_SEND:    send_packet(*pkt);    break;
+            case OP_RECEIVE: receive_packet(*pkt); break;
+            case OP_CLOSE:   close_packet(*pkt);   break;
+            case OP_NONE:
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Handles the expiry of the current operation's timer. Safe to call at any
+ * time, nothing happens until the deadline has actually passed.
+ */
+void RDTConnection::on_timer() {
+    // Clear the expiration of the timer fd, it's rearmed below as needed
+    if (timer != -1) {
+        uint64_t expirations;
+        if (read(timer, &expirations, sizeof(expirations)) < 0)
+            expirations = 0;
+    }
+
+    if (!busy())
+        return;
+
+    log_stats(false);
+
+    if (next_timeout() > 0) {
+        arm_timer();
+        return;
+    }
+
+    switch (op) {
+        case OP_CONNECT: connect_timeout(); break;
+        case OP_SEND:    send_timeout();    break;
+        case OP_RECEIVE: receive_timeout(); break;
+        case OP_CLOSE:   close_timeout();   break;
+        case OP_NONE:
+        default:
+            break;
+    }
+}
+
+/**
+ * Socket to watch for readability when driving the connection from an
+ * event loop. Server sessions have no socket of their own and return -1.
+ */
+int RDTConnection::fd() {
+    return server ? -1 : sock_fd;
+}
+
+/**
+ * A timerfd which becomes readable when on_timer() is due, for event loops
+ * which would rather watch a descriptor than track next_timeout()
+ */
+int RDTConnection::timer_fd() {
+    if (timer == -1) {
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        arm_timer();
+    }
+
+    return timer;
+}
+
+/**
+ * Microseconds until on_timer() is due, 0 if overdue and -1 if
+ * there is no pending operation
+ */
+long RDTConnection::next_timeout() {
+    if (!busy())
+        return -1;
+
+    timeval now, remaining;
+    clock_now(now);
+
+    if (!timercmp(&now, &deadline, <))
+        return 0;
+
+    timersub(&deadline, &now, &remaining);
+    return remaining.tv_sec * USEC_CONVERSION + remaining.tv_usec;
+}
+
+/**
+ * Whether an operation is currently in progress
+ */
+bool RDTConnection::busy() {
+    return op != OP_NONE;
+}
+
+/**
+ * Sets the current operation's deadline usec from now
+ */
+void RDTConnection::set_timeout(long usec) {
+    time_from_now(usec, deadline);
+    arm_timer();
+}
+
+/**
+ * Current time on the monotonic clock. Every deadline and RTT is measured on
+ * it, so wall clock adjustments can neither fire timers early nor stall them.
+ */
+void RDTConnection::clock_now(timeval &now) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now.tv_sec = ts.tv_sec;
+    now.tv_usec = ts.tv_nsec / 1000;
+}
+
+/**
+ * Computes the point in time usec from now
+ */
+void RDTConnection::time_from_now(long usec, timeval &when) {
+    timeval now, delta;
+    clock_now(now);
+
+    delta.tv_sec = usec / USEC_CONVERSION;
+    delta.tv_usec = usec % USEC_CONVERSION;
+    timeradd(&now, &delta, &when);
+}
+
+/**
+ * Keeps the timer fd (if anyone asked for it) in sync with the deadline
+ */
+void RDTConnection::arm_timer() {
+    if (timer == -1)
+        return;
+
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+
+    if (busy()) {
+        // A zero it_value would disarm the timer, overdue deadlines fire right away
+        long usec = std::max(1L, next_timeout());
+        spec.it_value.tv_sec = usec / USEC_CONVERSION;
+        spec.it_value.tv_nsec = (usec % USEC_CONVERSION) * 1000;
+    }
+
+    timerfd_settime(timer, 0, &spec, NULL);
+}
+
+/**
+ * Waits up to timeout_usec (forever if negative) for a packet to arrive.
+ * Returns true if one may be read.
+ */
+bool RDTConnection::wait_readable(long timeout_usec) {
+    if (sock_fd == -1)
+        return false;
+
+    if (server)
+        return server->wait_readable(this, timeout_usec);
+
+    pollfd pfd;
+    pfd.fd = sock_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    // Pacing deadlines are finer than poll()'s milliseconds
+    timespec timeout;
+    timeout.tv_sec = timeout_usec / USEC_CONVERSION;
+    timeout.tv_nsec = (timeout_usec % USEC_CONVERSION) * 1000;
+    return ppoll(&pfd, 1, timeout_usec < 0 ? NULL : &timeout, NULL) > 0;
+}
+
+/**
+ * Writes a stats snapshot if one is due (or right away)
+ */
+void RDTConnection::log_stats(bool now) {
+    if (stats_fd == -1)
+        return;
+
+    timeval current;
+    clock_now(current);
+    if (!now && timercmp(&current, &stats_due, <))
+        return;
+
+    time_from_now(stats_interval, stats_due);
+
+    std::string line = stats_json() + "\n";
+    if (write(stats_fd, line.data(), line.size()) != (ssize_t)line.size())
+        LOG_WARN("Failed to write stats snapshot");
+}
+
+/**
+ * Human readable address of the remote host for logging
+ */
+std::string RDTConnection::remote_name() {
+    char ip_addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &remote_addr.sin_addr.s_addr, ip_addr, sizeof(ip_addr));
+
+    std::stringstream ss;
+    ss << ip_addr << ":" << ntohs(remote_addr.sin_port);
+    return ss.str();
+}
+
+/**
+ * Configures delayed ACKs for incoming transfers: an ACK goes out after every
+ * segments in order segments or delay_usec after the first unACKed one. Use 1
+ * segment to ACK every segment right away.
+ */
+void RDTConnection::set_delayed_ack( int segments, long delay_usec ) {
+    ack_every = std::max(1, segments);
+    ack_delay = std::max(0L, delay_usec);
+}
+
+/**
+ * Sets the largest packet (including IP and UDP headers) we are willing to accept,
+ * which bounds the path MTU search. Takes effect on the next connection.
+ */
+void RDTConnection::set_mtu( size_t max_mtu ) {
+    mtu = std::max((size_t)MTU, std::min((size_t)RDT_MAX_MTU, max_mtu));
+}
+
+/**
+ * Enables forward error correction on outgoing transfers: blocks of up to
+ * block_segments data segments are followed by up to max_parity parity
+ * segments, depending on the loss rate observed. Lost segments are rebuilt by
+ * the receiver instead of waiting for a retransmission. A max_parity of 0
+ * disables FEC. Receivers always decode whatever parity they get.
+ */
+void RDTConnection::set_fec( int block_segments, int max_parity ) {
+    fec_block = std::max(1, std::min(RDT_FEC_MAX_BLOCK, block_segments));
+    fec_max_parity = std::max(0, std::min(RDT_FEC_MAX_PARITY, max_parity));
+}
+
+/**
+ * Closes the connection along with our transfers from now on: their EOF
+ * carries our FIN, the remote ACKs it and sends its own FIN along with the
+ * EOFACK, and close() has nothing left to wait for. Only connections the
+ * remote opened with a request on its SYN (see connect_with_request()) are
+ * known to understand this, others close the usual way.
+ */
+void RDTConnection::set_close_on_EOF( bool enabled ) {
+    close_on_EOF = enabled;
+}
+
+/**
+ * Compresses our transfers from the next one on, if the remote offered to
+ * take compressed segments when connecting. Data which doesn't compress is
+ * noticed right away and sent as it is.
+ */
+void RDTConnection::set_compression( bool enabled ) {
+    compression = enabled;
+}
+
+/**
+ * Seeds the simulated loss and corruption, which otherwise start from a seed
+ * of their own. The same seed draws the same sequence of odds, packet after
+ * packet read.
+ */
+void RDTConnection::set_impairment_seed( unsigned int seed ) {
+    impairment_seed = seed;
+}
+
+/**
+ * The connection's counters, along with the RTT, window and transfer progress
+ * as of now
+ */
+rdt_stats_t RDTConnection::stats() {
+    rdt_stats_t result = counters;
+    timeval now, elapsed;
+    clock_now(now);
+
+    result.srtt_usec = srtt;
+    result.min_rtt_usec = min_rtt;
+    result.window = send_limit();
+    result.in_flight = op == OP_SEND ? current_unacknowledged_bytes : 0;
+    result.receive_buffered = undelivered_bytes;
+
+    if (transfer_start.tv_sec != 0) {
+        timersub(transfer_end.tv_sec != 0 ? &transfer_end : &now, &transfer_start, &elapsed);
+        result.transfer_seconds = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+    }
+    if (result.transfer_seconds > 0)
+        result.goodput_mbps = result.transfer_bytes * 8 / result.transfer_seconds / 1e6;
+
+    // Include the wait still going on
+    long waiting = 0;
+    if (blocked != BLOCKED_NONE) {
+        timersub(&now, &blocked_since, &elapsed);
+        waiting = elapsed.tv_sec * USEC_CONVERSION + elapsed.tv_usec;
+    }
+    result.window_blocked_seconds = (window_wait + (blocked == BLOCKED_WINDOW ? waiting : 0)) / 1e6;
+    result.pacing_blocked_seconds = (pacing_wait + (blocked == BLOCKED_PACING ? waiting : 0)) / 1e6;
+
+    return result;
+}
+
+/**
+ * stats() as a single line JSON object, tagged with the connection
+ */
+std::string RDTConnection::stats_json() {
+    rdt_stats_t s = stats();
+    timeval now;
+    gettimeofday(&now, NULL); // wall clock, to line snapshots up with other logs
+
+    std::stringstream json;
+    json << "{\"time\": " << now.tv_sec << "." << std::setfill('0') << std::setw(6) << now.tv_usec << std::setfill(' ')
+        << ", \"conn_id\": " << conn_id << ", \"remote\": \"" << remote_name() << "\""
+        << ", \"packets_sent\": " << s.packets_sent << ", \"bytes_sent\": " << s.bytes_sent
+        << ", \"packets_received\": " << s.packets_received << ", \"bytes_received\": " << s.bytes_received
+        << ", \"segments_sent\": " << s.segments_sent << ", \"timeout_retransmits\": " << s.timeout_retransmits
+        << ", \"fast_retransmits\": " << s.fast_retransmits << ", \"duplicate_segments\": " << s.duplicate_segments
+        << ", \"duplicate_acks\": " << s.duplicate_acks << ", \"compressed_segments\": " << s.compressed_segments
+        << ", \"compression_saved\": " << s.compression_saved << ", \"window_probes\": " << s.window_probes
+        << ", \"drops\": {";
+
+    for (int i = 0; i < RDT_DROP_REASONS; i++)
+        json << (i ? ", " : "") << "\"" << rdt_drop_reason_name(i) << "\": " << s.drops[i];
+
+    json << "}, \"srtt_usec\": " << s.srtt_usec << ", \"min_rtt_usec\": " << s.min_rtt_usec
+        << ", \"window\": " << s.window << ", \"in_flight\": " << s.in_flight << ", \"receive_buffered\": " << s.receive_buffered
+        << ", \"transfer_bytes\": " << s.transfer_bytes << ", \"transfer_seconds\": " << s.transfer_seconds
+        << ", \"goodput_mbps\": " << s.goodput_mbps << ", \"window_blocked_seconds\": " << s.window_blocked_seconds
+        << ", \"pacing_blocked_seconds\": " << s.pacing_blocked_seconds << "}";
+
+    return json.str();
+}
+
+/**
+ * Starts writing a stats_json() line to fd every interval_usec while operations
+ * run, and whenever a transfer completes. The fd stays the caller's and may be
+ * shared by many connections, each line goes out in a single write.
+ */
+void RDTConnection::set_stats_log( int fd, long interval_usec ) {
+    stats_fd = fd;
+    stats_interval = std::max(1L, interval_usec);
+    time_from_now(stats_interval, stats_due);
+}
+
+/**
+ * Sets how many bytes we let the remote have in flight towards us. The window
+ * scale is fixed at connection time, so the window may only grow up to what
+ * the scale picked then can express (0xFFFF << scale).
+ */
+void RDTConnection::set_receive_window( size_t bytes ) {
+    receive_window = bytes;
+}
+
+/**
+ * Largest packet (including IP and UDP headers) currently known to make it
+ * to the remote host. Data segments are sized to fit it.
+ */
+size_t RDTConnection::path_mtu() {
+    return plpmtu;
+}
 
 /**
  * Returns the port a connection is bound to or -1 on failure
@@ -549,192 +3240,448 @@ int RDTConnection::port_number() {
 }
 
 /**
- * Initializes a network packet with as much specified data as the packet can hold
- * Returns the amount of data bytes placed into the packet
+ * Initializes the header of a control (payload-less) network packet.
+ * The payload area is left untouched as data_len marks it as empty.
  */
-inline int RDTConnection::build_network_packet(rdt_packet_t &pkt, std::string const &data, size_t max_data_len, size_t data_offset) {
-    memset((void *)&pkt, 0, sizeof(rdt_packet_t));
-
+inline void RDTConnection::build_network_packet(rdt_packet_t &pkt) {
     pkt.header.magic_num = RDT_MAGIC_NUM;
     pkt.header.src_port  = ntohs(local_addr.sin_port);
     pkt.header.dst_port  = ntohs(remote_addr.sin_port);
     pkt.header.seq_num   = 0;
     pkt.header.ack_num   = 0;
-    pkt.header.data_len  = std::max((unsigned int)0, (unsigned int)std::min(sizeof(pkt.data), data.size() - data_offset));
+    pkt.header.data_len  = 0;
     pkt.header.flags     = 0;
+    pkt.header.conn_id   = conn_id;
+    pkt.header.checksum  = 0;
+    pkt.header.window    = advertised_window();
+    pkt.header.transfer  = send_transfer;
+    pkt.header.stream    = 0;
+}
 
-    // First, ensure the offset is valid
-    if (data_offset > data.size())
-        return 0;
+/**
+ * Initializes a control segment carrying a small payload (options, padding)
+ * referenced in place
+ */
+inline void RDTConnection::build_network_packet(rdt_segment_t &seg, char const *payload, size_t payload_len) {
+    build_network_packet(*(rdt_packet_t *)&seg.header);
+    seg.header.data_len = payload_len;
+    seg.payload = payload;
+}
+
+/**
+ * Initializes a data segment carrying as much of the source's data starting at
+ * data_offset as a packet can hold (further limited by max_data_len if it is
+ * non-zero, and by what the source lets go of, see payload_source::place()).
+ * Only the header is written, the payload is referenced in place. Returns the
+ * amount of data bytes placed into the segment. The segment payload is NULL if
+ * the source failed to provide the data.
+ */
+inline size_t RDTConnection::build_network_segment(rdt_segment_t &seg, payload_source &src, size_t max_data_len, size_t data_offset) {
+    size_t payload_len = 0;
+    size_t data_len = src.length();
+
+    // Only hand out a payload if the offset is valid
+    if (data_offset < data_len) {
+        payload_len = std::min(max_payload(), data_len - data_offset);
+
+        // Next, compute the correct length based on any caller limitations.
+        if (max_data_len != 0)
+            payload_len = std::min(payload_len, max_data_len);
+    }
+
+    seg.header.magic_num = RDT_MAGIC_NUM;
+    seg.header.src_port  = ntohs(local_addr.sin_port);
+    seg.header.dst_port  = ntohs(remote_addr.sin_port);
+    seg.header.seq_num   = 0;
+    seg.header.ack_num   = 0;
+    seg.header.flags     = 0;
+    seg.header.conn_id   = conn_id;
+    seg.header.checksum  = 0;
+    seg.header.window    = advertised_window();
+    seg.header.transfer  = send_transfer;
+    seg.header.stream    = 0;
+
+    // The source may hand out less than that, and tags the segment with where it belongs
+    if (payload_len > 0)
+        payload_len = src.place(data_offset, payload_len, seg.header);
+
+    seg.header.data_len  = payload_len;
+    seg.payload          = src.read(data_offset, payload_len);
+
+    return payload_len;
+}
 
-    // Next, compute the correct length based on any caller limitations.
-    pkt.header.data_len = (max_data_len == 0) ?
-        pkt.header.data_len :
-        std::min((uint16_t)max_data_len, (uint16_t)pkt.header.data_len);
+/**
+ * Initializes a data segment of the payload being sent like build_network_segment(),
+ * compressed if that pays off: the segment then carries as much of the (up to
+ * max_data_len) data starting at data_offset as compresses into max_payload_len
+ * bytes. Data which doesn't compress goes out as it is, and the next few segments
+ * don't even try. Returns the amount of data bytes placed into the segment.
+ */
+size_t RDTConnection::build_compressed_segment(rdt_segment_t &seg, size_t max_data_len, size_t max_payload_len, size_t data_offset) {
+    size_t data_len = data_offset < send_src->length() ? std::min(max_data_len, send_src->length() - data_offset) : 0;
+    char const *data = NULL;
+    size_t payload_len = 0;
+    size_t consumed = 0;
+
+    // A compressed segment never spans data its source tags apart (streams)
+    if (data_len > 0) {
+        rdt_header_t tags;
+        memset(&tags, 0, sizeof(tags));
+        data_len = send_src->place(data_offset, std::min(data_len, (size_t)LZ_MAX_BLOCK), tags);
+    }
+
+    if (compress_skip > 0)
+        compress_skip--;
+    else if (data_len > 0 && (data = send_src->read(data_offset, std::min(data_len, (size_t)LZ_MAX_BLOCK))) != NULL)
+        payload_len = lz_compress(data, std::min(data_len, (size_t)LZ_MAX_BLOCK), &compress_buf[0], max_payload_len, consumed);
+
+    if (data == NULL || consumed <= payload_len || consumed - payload_len < consumed / RDT_COMPRESS_MIN_GAIN) {
+        // Only full sized segments tell, window leftovers are too short to compress
+        if (data != NULL && max_payload_len >= max_payload())
+            compress_skip = RDT_COMPRESS_BACKOFF;
+        return build_network_segment(seg, *send_src, std::min(data_len, max_payload_len), data_offset);
+    }
+
+    build_network_packet(seg, &compress_buf[0], payload_len);
+    send_src->place(data_offset, consumed, seg.header);
+    setCOMPRESS(seg);
+    counters.compressed_segments++;
+    counters.compression_saved += consumed - payload_len;
+    return consumed;
+}
+
+/**
+ * Checksums a packet as it goes out on the wire
+ */
+uint32_t RDTConnection::packet_checksum(rdt_header_t const &header, char const *payload, size_t payload_len) {
+    rdt_header_t unsummed = header;
+    unsummed.checksum = 0;
+
+    uint32_t crc = crc32c(0, &unsummed, sizeof(unsummed));
+    return crc32c(crc, payload, payload_len);
+}
+
+/**
+ * Checks the checksum of a len byte datagram. Only the bytes actually received
+ * are summed so a corrupted data_len can't make us read past them.
+ */
+bool RDTConnection::verify_checksum(rdt_packet_t const &pkt, size_t len) {
+    if (len < sizeof(rdt_header_t))
+        return false;
 
-    memcpy(&pkt.data, (data.substr(data_offset)).c_str(), pkt.header.data_len);
-    return pkt.header.data_len;
+    return pkt.header.checksum == packet_checksum(pkt.header, pkt.data, len - sizeof(rdt_header_t));
 }
 
 /**
- * Sends a formatted packet to remote_addr.
+ * Sends a formatted packet to remote_addr. The packet must hold data_len
+ * bytes of payload (usually none, see broadcast_network_segment).
  * Returns true if packet broadcasted properly, false otherwise
  */
-inline bool RDTConnection::broadcast_network_packet(rdt_packet_t const &pkt) {
-    size_t len = std::min(sizeof(rdt_header_t) + pkt.header.data_len, sizeof(rdt_packet_t));
+inline bool RDTConnection::broadcast_network_packet(rdt_packet_t &pkt) {
+    size_t len = sizeof(rdt_header_t) + pkt.header.data_len;
+    pkt.header.checksum = packet_checksum(pkt.header, pkt.data, len - sizeof(rdt_header_t));
+    trace_packet(RDT_TRACE_SEND, pkt.header, false);
+    counters.packets_sent++;
+    counters.bytes_sent += len;
+    if (!remote_validated)
+        unvalidated_sent += len;
     return len == sendto(sock_fd, &pkt, len, 0, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
 }
 
+/**
+ * Sends a data segment to remote_addr, gathering the header and the payload
+ * slice straight from where they live so the payload is never staged in a packet.
+ * Returns true if the segment was broadcasted properly, false otherwise
+ */
+inline bool RDTConnection::broadcast_network_segment(rdt_segment_t &seg) {
+    seg.header.checksum = packet_checksum(seg.header, seg.payload, seg.header.data_len);
+    trace_packet(RDT_TRACE_SEND, seg.header, false);
+    counters.packets_sent++;
+    counters.bytes_sent += sizeof(seg.header) + seg.header.data_len;
+    if (!remote_validated)
+        unvalidated_sent += sizeof(seg.header) + seg.header.data_len;
+
+    iovec iov[2];
+    iov[0].iov_base = (void *)&seg.header;
+    iov[0].iov_len  = sizeof(seg.header);
+    iov[1].iov_base = (void *)seg.payload;
+    iov[1].iov_len  = seg.header.data_len;
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name    = (void *)&remote_addr;
+    msg.msg_namelen = sizeof(remote_addr);
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = seg.header.data_len > 0 ? 2 : 1;
+
+    ssize_t len = iov[0].iov_len + iov[1].iov_len;
+    return len == sendmsg(sock_fd, &msg, 0);
+}
+
 /**
  * Function will keep reading from the network until it finds (what it sees) as
- * a valid RDT packet. If no data is left (socket times out), the function will
- * return to its caller.
+ * a valid RDT packet. It never blocks: if no data is left the function will
+ * return NULL to its caller. The packet returned lives in recv_packet, a pooled
+ * buffer, and is only valid until the next read unless a reference to the buffer is kept.
  *
  * Function will automatically SYNACK any SYN packets or FINACK any FIN packets. It is
  * the caller's duty to note any incoming FIN packets and take the appropriate action.
+ * Path MTU probes are answered (and their answers consumed) here as well.
  */
-bool RDTConnection::read_network_packet(rdt_packet_t &pkt, bool verify_remote, sockaddr_in *ain) {
-    memset(&pkt, 0, sizeof(pkt));
-
+RDTConnection::rdt_packet_t *RDTConnection::read_network_packet(bool verify_remote, sockaddr_in *ain) {
     sockaddr_in default_addr;
     sockaddr_in *recv_addr = ain ? ain : &default_addr;
-    socklen_t recv_addr_len = sizeof(default_addr);
-
-    ssize_t len = 0;
-    bool valid_header = false;
-    bool valid_packet = false;
-    bool valid_host   = false;
 
     if (sock_fd == -1)
-        return false;
+        return NULL;
 
-    // First we try to find a packet header from the UDP buffer
+    // Every UDP datagram carries exactly one packet, so read it whole and
+    // validate it before handing it to the caller.
     // We reject packets from unexpected hosts after the *entire* packet
     // is read from the UDP buffer so that we can get rid of the garbage data
-    while( !valid_packet ) {
-        while( !valid_header ) {
-            // Reading the header and payload in two reads seems to cause problems
-            // We peek at the header to avoid popping it out of the buffer
-            len = recvfrom(sock_fd, &pkt.header, sizeof(pkt.header), MSG_PEEK, (sockaddr *)recv_addr, &recv_addr_len);
-
-            // Time out, let caller handle problem
-            if (len == -1 && errno == EWOULDBLOCK) {
-                drop_packet(pkt, "socket timeout when waiting for packet to arrive");
-                return false;
-            }
+    while (true) {
+        ssize_t len = receive_datagram(recv_packet, mtu - IP_HEADER - UDP_HEADER, recv_addr);
 
-            // Keep reading until we get the expected size of a packet
-            if (len < sizeof(pkt.header)) {
-                continue; // find header loop
-            } else if (pkt.header.magic_num == RDT_MAGIC_NUM) {
-                // If the magic number is aligned we got a proper header
-                valid_header = true;
-                break;
-            } else { // Misaligned packet, attempt to recover
-                int bytes_dropped = 0;
-                const int MAGIC_NUM = RDT_MAGIC_NUM;
-                char magicbuf[sizeof(pkt.header.magic_num)];
-                memcpy(&magicbuf, &MAGIC_NUM, sizeof(magicbuf));
-
-                // Check if magic number appears in the bytes we've read
-                // If so, move the data up to the start of the header
-                for (int i = 0; i < len - sizeof(magicbuf); i++) {
-                    if ( memcmp( (&pkt.header)+i, &magicbuf, sizeof(magicbuf) ) == 0 ) {
-                        bytes_dropped -= i;
-                        memmove( &pkt.header, (&pkt.header)+i, len - bytes_dropped );
-                        break; // for loop
-                    }
-                }
-
-                std::stringstream ss;
-                ss << "misaligned packet: " << bytes_dropped << " bytes dropped";
-                drop_packet(pkt, ss.str());
-
-                // Reset offset if no memory was moved and allow outer loop to keep reading
-                if (pkt.header.magic_num != RDT_MAGIC_NUM)
-                    valid_header = false;
-            }
+        if (len == -1) {
+            // Nothing left to read, let caller handle it
+            if (errno == EINTR)
+                continue;
+            else if (errno != EWOULDBLOCK && errno != EAGAIN)
+                LOG_ERROR("unknown transmission error");
+            return NULL;
         }
 
-        // Note: we assume if the header has arrived, so has the rest of the packet
-        // They should be sufficiently small so that it would be unlikely for the system
-        // to return before the rest of the packet is received. In such a situation, treat
-        // the packet as corrupted
-        if (valid_header) {
-            size_t max_read = std::min(sizeof(pkt), pkt.header.data_len + sizeof(pkt.header));
-            len = recvfrom(sock_fd, &pkt, max_read, 0, NULL, NULL);
-
-            valid_host = recv_addr->sin_addr.s_addr == remote_addr.sin_addr.s_addr
-                        && htons(pkt.header.src_port) == remote_addr.sin_port;
-
-            if (len == -1) {
-                if (errno == EWOULDBLOCK) {
-                    log_event("socket timeout while receiving packet");
-                    return false;
-                } else {
-                    log_event("unknown transmission error");
-                    valid_header = false;
-                }
-            } else if (len < max_read) {
-                drop_packet(pkt, "received packet was shorter than expected");
-                valid_header = false;
-            } else if (verify_remote && !valid_host) {
-                drop_packet(pkt, "packet received from unexpected host");
-                valid_header = false;
-            } else if ( !isEOFACK(pkt) && (random() % 100 < prob_loss) ) {
-                // Simulate network packet loss
-                // Do not apply this on EOFACK packets to avoid synchronization issues
-                drop_packet(pkt, "(simulated) socket timeout while receiving packet");
-                errno = EWOULDBLOCK;
-                return false;
-            } else if ( !isEOFACK(pkt) && (random() % 100 < prob_corrupt) ) {
-                // Simulate packet corruption
-                // Do not apply this on EOFACK packets to avoid synchronization issues
-                drop_packet(pkt, "packet corrupted");
-                return false;
-            } else if (len == max_read) {
-                valid_packet = true;
-            }
-        } // valid header while loop
-    } // valid packet while loop
+        rdt_packet_t &pkt = *(rdt_packet_t *)recv_packet.data();
+
+        if (len < (ssize_t)sizeof(pkt.header) || pkt.header.magic_num != RDT_MAGIC_NUM) {
+            drop_packet(pkt, RDT_DROP_MALFORMED, "misaligned packet: no RDT header found");
+            continue;
+        } else if ( !isEOFACK(pkt) && (rand_r(&impairment_seed) % 100 < prob_loss) ) {
+            // Simulate network packet loss
+            // Do not apply this on EOFACK packets to avoid synchronization issues
+            drop_packet(pkt, RDT_DROP_LOSS, "(simulated) packet lost in transit");
+            continue;
+        } else if ( !isEOFACK(pkt) && (rand_r(&impairment_seed) % 100 < prob_corrupt) ) {
+            // Simulate packet corruption by flipping a random bit, the checksum must catch it
+            // Do not apply this on EOFACK packets to avoid synchronization issues
+            ((unsigned char *)&pkt)[rand_r(&impairment_seed) % len] ^= 1 << (rand_r(&impairment_seed) % 8);
+        }
+
+        // Nothing from a corrupted packet can be trusted, so reject those first
+        if (!verify_checksum(pkt, len)) {
+            drop_packet(pkt, RDT_DROP_CORRUPT, "packet corrupted: checksum mismatch");
+            continue;
+        }
+
+        bool valid_host = recv_addr->sin_addr.s_addr == remote_addr.sin_addr.s_addr
+                        && recv_addr->sin_port == remote_addr.sin_port
+                        && pkt.header.conn_id == conn_id;
+
+        if ((size_t)len != pkt.header.data_len + sizeof(pkt.header)) {
+            drop_packet(pkt, RDT_DROP_MALFORMED, "received packet was shorter than expected");
+            continue;
+        } else if (verify_remote && !valid_host) {
+            drop_packet(pkt, RDT_DROP_UNEXPECTED, "packet received from unexpected host");
+            continue;
+        }
+
+        trace_packet(RDT_TRACE_RECEIVE, pkt.header, true);
+        counters.packets_received++;
+        counters.bytes_received += len;
+
+        // Repeated SYNs buy a remote we can't reach yet more room, the first ACK shows it is there
+        if (valid_host && !remote_validated && isSYN(pkt))
+            unvalidated_received += len;
+        else if (valid_host && isACK(pkt))
+            validate_remote();
 
-    if (valid_packet) {
         // If remote host we've already connected to sends a SYN packet at any point
         // (because, say, our prevoius SYNACK was dropped) SYNACK it immediately
         rdt_packet_t ack;
-        build_network_packet(ack, "");
 
         if (isSYN(pkt) && verify_remote) {
-            setSYNACK(ack);
-            broadcast_network_packet(ack);
-            log_event("Received SYN packet");
+            read_SYN_options(pkt);
+            send_handshake(false, true);
+            LOG_DEBUG("Received SYN packet");
+        } else if (valid_host && isFIN(pkt) && isEOF(pkt)) {
+            // A FIN riding on an EOF is ACKed along with the transfer (see send_ACK()). If it
+            // shows up again once the transfer is over, our EOFACK got lost: repeat it.
+            if (op != OP_RECEIVE && closing_with_EOF && pkt.header.seq_num == total_bytes_received) {
+                send_ACK(true);
+                continue;
+            }
         } else if (valid_host && isFIN(pkt)) { // Always ignore FIN packets from unknown hosts
             got_FIN = true;
+            build_network_packet(ack);
             setFINACK(ack);
             broadcast_network_packet(ack);
-            log_event("Received FIN packet, remote host closed connection");
+            LOG_INFO("Received FIN packet, remote host closed connection");
+        } else if (valid_host && isPROBE(pkt)) {
+            // Let the remote know a packet of this size made it through
+            build_network_packet(ack);
+            ack.header.ack_num = len + IP_HEADER + UDP_HEADER;
+            setPROBEACK(ack);
+            broadcast_network_packet(ack);
+            continue;
+        } else if (valid_host && isPROBEACK(pkt)) {
+            probe_acked(pkt.header.ack_num);
+            continue;
         }
 
-        return true;
+        return &pkt;
     }
+}
 
-    return false;
+/**
+ * Reads a single datagram of up to len bytes, without blocking, either straight
+ * from our socket into a buffer of our pool or, for server sessions, from the
+ * queue the server demultiplexes our packets into (as the server's buffer).
+ * Returns the datagram length or -1 with errno set (EWOULDBLOCK if none is pending)
+ */
+ssize_t RDTConnection::receive_datagram(RDTBufferPool::buffer &datagram, size_t len, sockaddr_in *from) {
+    datagram.reset();
+
+    if (server)
+        return server->receive_datagram(this, datagram, len, from);
+
+    char *room = pool.reserve(len);
+    if (!room) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    socklen_t from_len = sizeof(*from);
+    ssize_t received = recvfrom(sock_fd, room, len, MSG_DONTWAIT, (sockaddr *)from, &from_len);
+    if (received >= 0)
+        datagram = pool.commit(received);
+
+    return received;
 }
 
 /**
- * Writes to stdout that a packet was dropped for a given reason
+ * Counts, traces (and in debug builds logs) that a packet was dropped
  */
-void RDTConnection::drop_packet(rdt_packet_t &pkt, std::string const &reason) {
-    memset(&pkt, 0, sizeof(pkt));
-    log_event("Dropped packet: " + (reason == "" ? "unknown error" : reason));
+void RDTConnection::drop_packet(rdt_packet_t &pkt, rdt_drop_reason_t reason, char const *msg) {
+    counters.drops[reason]++;
+
+    if (reason == RDT_DROP_LOSS)
+        trace_packet(RDT_TRACE_DROP_LOSS, pkt.header, true);
+    else if (reason == RDT_DROP_CORRUPT)
+        trace_packet(RDT_TRACE_DROP_CORRUPT, pkt.header, true);
+    else
+        trace_packet(RDT_TRACE_DROP, pkt.header, true);
+
+    LOG_DEBUG("Dropped packet: " << msg);
+    (void)msg;
 }
 
 void RDTConnection::log_event(std::string const &msg) {
     time_t now;
-    char date[32];
-
     time(&now);
-    strftime( date, sizeof(date), "%D %T: ", localtime(&now));
 
-    std::cerr << date << msg << std::endl;
+    // Formatting the date is the expensive part, and it only changes once a second
+    if (now != log_time) {
+        struct tm local; // localtime()'s own is shared with every other thread
+        log_time = now;
+        strftime( log_date, sizeof(log_date), "%D %T: ", localtime_r(&now, &local));
+    }
+
+    std::cerr << log_date << msg << std::endl;
+}
+
+/**
+ * Sets how many events the trace ring holds (0 disables tracing) and starts
+ * it over
+ */
+void RDTConnection::set_trace( size_t records ) {
+    trace_ring.assign(records, rdt_trace_record_t());
+    trace_count = 0;
+}
+
+/**
+ * Writes the trace ring to fd (see RDTTrace.h for the format), oldest event
+ * first. Decode it with rdt_trace. Returns false if writing failed.
+ */
+bool RDTConnection::write_trace( int fd ) {
+    size_t count = std::min((size_t)trace_count, trace_ring.size());
+
+    rdt_trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = RDT_TRACE_MAGIC;
+    header.version = RDT_TRACE_VERSION;
+    header.record_size = sizeof(rdt_trace_record_t);
+    header.conn_id = conn_id;
+    header.count = count;
+    header.overwritten = trace_count - count;
+
+    std::string dump((char const *)&header, sizeof(header));
+    for (uint64_t i = trace_count - count; i < trace_count; i++)
+        dump.append((char const *)&trace_ring[i % trace_ring.size()], sizeof(rdt_trace_record_t));
+
+    for (size_t written = 0; written < dump.size(); ) {
+        ssize_t n = write(fd, dump.data() + written, dump.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            return false;
+        written += n;
+    }
+
+    return true;
+}
+
+/**
+ * Writes the trace ring to a new file at path_prefix + ".trace", replacing
+ * any file there. Returns false if it could not be written.
+ */
+bool RDTConnection::save_trace( std::string const &path_prefix ) {
+    std::string path = path_prefix + ".trace";
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd != -1 && write_trace(fd);
+    if (fd != -1)
+        ::close(fd);
+
+    if (!written)
+        LOG_ERROR("Failed to write trace " << path);
+    return written;
+}
+
+/**
+ * Records an event in the trace ring. Cheap enough to do for every packet.
+ */
+void RDTConnection::trace_event( uint16_t event, uint64_t seq, uint64_t ack ) {
+    if (trace_ring.empty())
+        return;
+
+    rdt_trace_record_t &record = trace_ring[trace_count++ % trace_ring.size()];
+    timeval now;
+    gettimeofday(&now, NULL); // wall clock, traces of both ends line up
+
+    record.time_usec = (uint64_t)now.tv_sec * USEC_CONVERSION + now.tv_usec;
+    record.seq = seq;
+    record.ack = ack;
+    record.window = 0;
+    record.in_flight = std::min((size_t)0xFFFFFFFF, current_unacknowledged_bytes);
+    record.event = event;
+    record.flags = 0;
+    record.data_len = 0;
+    record.reserved = 0;
+}
+
+/**
+ * Records a packet we sent or received (incoming) in the trace ring
+ */
+void RDTConnection::trace_packet( uint16_t event, rdt_header_t const &header, bool incoming ) {
+    if (trace_ring.empty())
+        return;
+
+    trace_event(event, header.seq_num, header.ack_num);
+
+    rdt_trace_record_t &record = trace_ring[(trace_count - 1) % trace_ring.size()];
+    size_t window = (size_t)header.window << (incoming ? remote_window_scale : local_window_scale);
+    record.window = std::min((size_t)0xFFFFFFFF, window);
+    record.flags = header.flags;
+    record.data_len = header.data_len;
 }
@@ -1,46 +1,239 @@
 #ifndef RDTConn
 #define RDTConn
 #include <netinet/in.h> // sockaddr_in
+#include <sys/types.h> // off_t
+#include <sys/time.h> // timeval
 #include <string> // std::string
+#include <vector> // std::vector
+#include <deque> // std::deque
+#include "RDTTrace.h"
+#include "RDTBufferPool.h"
+#include "RDTSegmentRing.h"
 
-#define MTU 1024 // Project spec defines max packet size of 1KB
+#define MTU 1024 // Project spec defines max packet size of 1KB, every path is assumed to carry it
+#define RDT_MAX_MTU 65535 // Largest IPv4 datagram
 #define IP_HEADER 20
 #define UDP_HEADER 8
 #define MSS (MTU - IP_HEADER - UDP_HEADER) // Max payload size for an actual segment
 
-#define EOFACK_MASK 1 << 6; // Used to avoid simulated network errors on final ACKs to avoid synchronization issues
-#define EOF_MASK    1 << 5; // Used to represent the last packet in a transmission
-#define FINACK_MASK 1 << 4; // Separate ACK for FIN to avoid confusion from ACK delays
-#define SYNACK_MASK 1 << 3; // Separate ACK for SYN to avoid confusion from ACK delays
-#define ACK_MASK    1 << 2;
-#define SYN_MASK    1 << 1;
-#define FIN_MASK    1 << 0;
+#define RDT_SOCKET_BUFFER (4 * 1024 * 1024) // Room for a window of large packets, capped by the kernel
+#define MAX_PROBES 3 // Unanswered probes before a packet size is deemed too large
+#define RDT_PROBE_GRANULARITY 32 // Path MTU search stops once its bounds are this close
+
+#define STREAM_MASK (1 << 15) // Data: belongs to the stream its header names. ACK: carries stream credits
+#define WPROBE_MASK (1 << 14) // Zero window probe, answered by an ACK carrying the current window
+#define COMPRESS_MASK (1 << 13) // SYN/SYNACK: its sender takes compressed segments. Data: the payload is compressed
+#define SACK_MASK   (1 << 12) // ACK carrying blocks of data held beyond a gap
+#define PARITY_MASK (1 << 11) // FEC parity covering a block of data segments
+#define FEC_MASK    (1 << 10) // Data segment protected by FEC parity
+#define PROBEACK_MASK (1 << 9) // Confirms a path MTU probe made it through
+#define PROBE_MASK  (1 << 8) // Padded packet probing whether a larger MTU works
+#define ACKNOW_MASK (1 << 7) // Asks the receiver to ACK right away instead of delaying it
+#define EOFACK_MASK (1 << 6) // Used to avoid simulated network errors on final ACKs to avoid synchronization issues
+#define EOF_MASK    (1 << 5) // Used to represent the last packet in a transmission
+#define FINACK_MASK (1 << 4) // Separate ACK for FIN to avoid confusion from ACK delays
+#define SYNACK_MASK (1 << 3) // Separate ACK for SYN to avoid confusion from ACK delays
+#define ACK_MASK    (1 << 2)
+#define SYN_MASK    (1 << 1)
+#define FIN_MASK    (1 << 0)
 
 #define RDT_MAGIC_NUM 0xCABBA6E5
 #define RDT_TIMEOUT_SEC 0
 #define RDT_TIMEOUT_USEC 500000 // 500ms
 #define USEC_CONVERSION 1000000
 
+#define RDT_SACK_BLOCKS 4 // Most selective ACK blocks an ACK carries
+
+#define RDT_READ_BATCH 64 // Max packets processed per on_readable() call
+
+#define RDT_RECEIVE_WINDOW (64 * 1024 * 1024) // Bytes a receiver buffers, what it lets the sender have in flight
+#define RDT_SINK_RETRY_USEC 10000 // 10ms, how often data is offered again to a sink which had no room
+#define RDT_PERSIST_BACKOFF 4 // Zero window probes back off up to RDT_TIMEOUT_USEC << this
+#define RDT_MAX_WINDOW_SCALE 30 // Largest window is 0xFFFF << 30 bytes
+
+#define RDT_FEC_BLOCK 16 // Data segments per FEC block
+#define RDT_FEC_MAX_BLOCK 16 // Largest FEC block the packet format can describe
+#define RDT_FEC_MAX_PARITY 4 // Most parity segments sent per FEC block
+#define RDT_FEC_HISTORY 64 // Delivered segments a receiver keeps around for decoding
+#define RDT_LOSS_WEIGHT (1.0 / 64) // Weight of each segment in the loss rate estimate
+
+#define RDT_PACING_GAIN 1.25 // Pace a little faster than a window per RTT so pacing alone never limits throughput
+#define RDT_PACING_SLACK_USEC 500 // Sending time a burst may catch up on after a late wakeup
+#define RDT_MIN_RTT_WINDOW_SEC 10 // How long the smallest RTT sample is trusted
+
+#define RDT_ACK_EVERY 2 // Data segments covered by a single delayed ACK
+#define RDT_ACK_DELAY_USEC 40000 // 40ms, longest an ACK is held back
+
 #define MAX_TRANSMIT_TIMEOUTS 20
 #define MAX_HANDSHAKE_TIMEOUTS 3
-#define MAX_DUPLICATE_ACK 3
+#define MAX_DUPLICATE_ACK 3 // Duplicate ACKs which trigger a fast retransmit
+#define RDT_AMPLIFICATION_LIMIT 3 // Bytes sent per byte received until the remote shows it is at its address
+
+#define RDT_COMPRESS_MIN_GAIN 8 // Segments are only sent compressed if that saves 1/8 of their data
+#define RDT_COMPRESS_BACKOFF 16 // Segments sent as they are after one which didn't compress
+
+#define RDT_STATS_INTERVAL_USEC 1000000 // Default time between JSON stats snapshots
+
+#define RDT_MAX_STRIPES 16 // Most connections a single transfer is striped across
+
+#define RDT_MAX_STREAMS 16 // Most streams a single transfer carries
+#define RDT_STREAM_WINDOW (16 * 1024 * 1024) // Bytes of a stream the receiver takes beyond what its destination took
+#define RDT_STREAM_LAST 0x80 // Set in the stream field of the segment which ends its stream
+
+class RDTServer;
+
+// Why packets get dropped, see rdt_stats_t::drops
+enum rdt_drop_reason_t {
+    RDT_DROP_LOSS,       // lost in transit (simulated)
+    RDT_DROP_CORRUPT,    // failed its checksum
+    RDT_DROP_MALFORMED,  // header or payload makes no sense
+    RDT_DROP_UNEXPECTED, // not from our remote, or not what the operation expects
+    RDT_DROP_STALE,      // ACK older than one we already had
+    RDT_DROP_REASONS
+};
+
+char const *rdt_drop_reason_name( int reason );
+
+/**
+ * How a connection has fared, see RDTConnection::stats(). Counters add up over
+ * the lifetime of the connection, the transfer fields describe the last (or
+ * current) send or receive.
+ */
+struct rdt_stats_t {
+    uint64_t packets_sent;        // every datagram: data, parity and control packets
+    uint64_t bytes_sent;          // of those, RDT headers included
+    uint64_t packets_received;    // valid packets only
+    uint64_t bytes_received;
+    uint64_t segments_sent;       // data segments, retransmissions included
+    uint64_t timeout_retransmits; // data segments resent after a timeout
+    uint64_t fast_retransmits;    // data segments resent after duplicate ACKs
+    uint64_t duplicate_segments;  // data segments received which we already had
+    uint64_t duplicate_acks;
+    uint64_t compressed_segments; // data segments sent compressed
+    uint64_t compression_saved;   // payload bytes compression kept off the wire
+    uint64_t window_probes;       // zero window probes sent
+    uint64_t drops[ RDT_DROP_REASONS ];
+    long srtt_usec;               // smoothed RTT, 0 until measured
+    long min_rtt_usec;
+    size_t window;                // bytes the sender may have in flight
+    size_t in_flight;
+    size_t receive_buffered;      // received in order, waiting for room in the destination
+    uint64_t transfer_bytes;      // payload ACKed (sending) or received so far
+    double transfer_seconds;
+    double goodput_mbps;          // transfer_bytes over transfer_seconds
+    double window_blocked_seconds; // sending waited on a full window
+    double pacing_blocked_seconds; // sending waited on pacing
+};
+
+/**
+ * Stripes a region of a file across count connections: the region is split
+ * into ranges of range_size bytes, dealt round robin, so stripe index carries
+ * ranges index, index + count, ... back to back. Every stripe stays busy until
+ * the end, whatever the size. The default stripe is the whole region.
+ *
+ * A resumed transfer leaves out the first start bytes of its stripe, which an
+ * earlier transfer already got across.
+ */
+struct rdt_stripe_t {
+    int index;
+    int count;
+    uint64_t range_size;
+    uint64_t start;
+
+    rdt_stripe_t(int index = 0, int count = 1, uint64_t range_size = 0, uint64_t start = 0);
+
+    bool striped() const;
+    uint64_t file_offset(uint64_t pos) const; // of byte pos of the stripe, from the region start
+    uint64_t contiguous(uint64_t pos) const;  // bytes from pos on which lie back to back in the file
+    uint64_t length(uint64_t region) const;   // bytes of a region this long the stripe carries
+};
 
 class RDTConnection {
 public:
+    // Completion callback of a non-blocking operation
+    typedef void (*rdt_callback_t)(RDTConnection &conn, bool success, void *context);
+    // Called as each stream of a stream transfer is received in full
+    typedef void (*rdt_stream_callback_t)(RDTConnection &conn, int stream, void *context);
+
     RDTConnection(int w_size, double ploss = 0, double pcorrupt = 0);
     virtual ~RDTConnection();
 
     bool connect( std::string const &afnet_address, int port );
+    bool connect_with_request( std::string const &afnet_address, int port, std::string const &request );
     void close();
     bool listen( int port );
     bool accept();
 
     bool send_data( std::string const &data );
+    bool send_fd( int fd, off_t offset, size_t len );
+    bool send_fd( int fd, off_t offset, size_t len, rdt_stripe_t const &stripe );
     bool receive_data( std::string &data );
+    bool receive_to_fd( int fd );
+    bool receive_to_fd( int fd, rdt_stripe_t const &stripe );
+
+    // Streams: one transfer carrying several payloads side by side, each delivered
+    // in order on its own as it arrives, so a segment lost from one doesn't hold up
+    // the others. Both ends open the streams of a transfer in the same order (ids
+    // count from 0), the sending end writes each one's payload and the receiving
+    // end reads each into its destination, then both run the transfer. Streams
+    // last for a single transfer, those the receiver didn't read are discarded.
+    int  open_stream();
+    bool write_stream( int stream, std::string const &data );
+    bool write_stream_fd( int stream, int fd, off_t offset, size_t len );
+    bool read_stream( int stream, std::string &data );
+    bool read_stream_fd( int stream, int fd );
+    bool send_streams();
+    bool receive_streams( rdt_stream_callback_t stream_done = NULL, void *context = NULL );
+
+    // Non-blocking interface. Start an operation, then call on_readable() whenever fd()
+    // is readable and on_timer() once next_timeout() elapses (or timer_fd() is readable).
+    // The callback runs when the operation completes and may start the next one.
+    // Sources and destinations passed in must outlive the operation.
+    bool start_connect( std::string const &afnet_address, int port, rdt_callback_t done, void *context = NULL );
+    bool start_connect_with_request( std::string const &afnet_address, int port, std::string const &request, rdt_callback_t done, void *context = NULL );
+    bool start_send( std::string const &data, rdt_callback_t done, void *context = NULL );
+    bool start_send_fd( int fd, off_t offset, size_t len, rdt_callback_t done, void *context = NULL );
+    bool start_receive( std::string &data, rdt_callback_t done, void *context = NULL );
+    bool start_receive_to_fd( int fd, rdt_callback_t done, void *context = NULL );
+    bool start_receive_to_fd( int fd, rdt_stripe_t const &stripe, rdt_callback_t done, void *context = NULL );
+    bool start_send_streams( rdt_callback_t done, void *context = NULL );
+    bool start_receive_streams( rdt_stream_callback_t stream_done, rdt_callback_t done, void *context = NULL );
+    bool start_close( rdt_callback_t done, void *context = NULL );
+
+    void on_readable();
+    void on_timer();
+
+    int  fd();
+    int  timer_fd();
+    long next_timeout();
+    bool busy();
 
     int port_number();
 
+    void set_delayed_ack( int segments, long delay_usec );
+    void set_mtu( size_t max_mtu );
+    size_t path_mtu();
+    void set_receive_window( size_t bytes );
+    void set_fec( int block_segments, int max_parity );
+    void set_close_on_EOF( bool enabled );
+    void set_compression( bool enabled );
+    void set_impairment_seed( unsigned int seed );
+
+    // Transfer statistics, as a struct or a single line JSON object. Snapshots may
+    // also be written to fd every interval_usec while operations run (and once each
+    // transfer completes), fd -1 stops them.
+    rdt_stats_t stats();
+    std::string stats_json();
+    void set_stats_log( int fd, long interval_usec = RDT_STATS_INTERVAL_USEC );
+
+    // Binary event trace kept in a ring buffer, see RDTTrace.h
+    void set_trace( size_t records );
+    bool write_trace( int fd );
+    bool save_trace( std::string const &path_prefix );
+
 private:
+    friend class RDTServer;
+
     bool is_listener;
     bool listener_connected;
     bool got_FIN;
@@ -48,51 +241,468 @@ private:
     sockaddr_in remote_addr;
     sockaddr_in local_addr;
 
+    RDTServer *server; // Set for sessions sharing an RDTServer socket
+    uint32_t conn_id;  // Distinguishes connections from the same host and port
+
     size_t const window_size;
 
+    // Path MTU state. Segments are sized for plpmtu, the largest packet known to
+    // make it to the remote, while probes search (plpmtu, probe_high] for more.
+    size_t mtu;        // largest packet we accept, advertised in our SYN
+    size_t remote_mtu; // largest packet the remote accepts
+    size_t plpmtu;
+    size_t probe_high;
+    size_t probe_size; // probe in flight, 0 if none
+    int probe_count;   // probes sent of probe_size
+    timeval probe_sent;
+
+    // Received packets, and the data of the segments they carry, live in pooled
+    // buffers. Segments held out of order (or for FEC) keep a reference to the
+    // packet they came in, so they are never copied between the socket and the sink.
+    RDTBufferPool pool;
+    RDTBufferPool::buffer recv_packet; // last read, from the server's pool for sessions
+
+    // Windows are advertised in every packet in units of 2^scale bytes, each
+    // end picks its scale and announces it in its SYN. The window is what is
+    // left of our receive buffer, so it closes while a slow destination holds
+    // up data we already ACKed.
+    size_t receive_window; // our receive buffer
+    size_t window_sent;    // what our last ACK advertised, in bytes
+    int local_window_scale;
+    int remote_window_scale;
+    size_t remote_window; // what the remote advertised
+
     double const prob_loss; // simulate packet loss, 0 - 100 inclusive
     double const prob_corrupt; // simulate packet corruption, 0 - 100 inclusive
+    unsigned int impairment_seed; // rand_r() state of the simulation, a connection's own
+
+    enum rdt_op_t { OP_NONE, OP_CONNECT, OP_SEND, OP_RECEIVE, OP_CLOSE };
+
+    // State of the operation in progress
+    rdt_op_t op;
+    bool op_success;
+    rdt_callback_t op_callback;
+    void *op_context;
+    timeval deadline; // when on_timer() is due. Like every timeval here, on the monotonic clock
+    int timer; // timerfd mirroring the deadline, created on demand
+    int num_timeouts; // consecutive timeouts of the current operation
+
+    // Handshake state
+    bool handshake_SYNACK; // we are the accepting side
+    bool got_FINACK;
+
+    // Fast open: a short request rides on the SYN and the SYNACK ACKs it, so the
+    // response can follow right away. Connecting, syn_request is what to send (if
+    // send_request), the usual way once connected if the remote won't take it on
+    // the SYN. Accepting, it is what the remote's SYN carried, which the next
+    // receive hands out (if request_pending).
+    bool fast_open;         // both ends speak it, so the remote also takes a FIN on our EOF
+    std::string syn_request;
+    bool send_request;
+    bool request_pending;
+    bool close_on_EOF;      // the EOF of our transfers carries our FIN (when fast_open)
+
+    // Anyone can send a SYN from someone else's address. Until the remote
+    // answers us (see validate_remote()), an accepted connection sends it no
+    // more than RDT_AMPLIFICATION_LIMIT times what it sent us and doesn't probe
+    // the path MTU. Fast open SYNs are padded to a packet of the default MTU,
+    // so the limit still lets the first few segments of a response go out.
+    bool remote_validated;
+    uint64_t unvalidated_received; // bytes the remote sent before then
+    uint64_t unvalidated_sent;     // bytes we sent it before then
+
+    // Segment flags in the send ring
+    enum { SEG_SACKED = 1, SEG_RESENT = 2 };
+
+    // Retransmission deadline of a segment in the send ring
+    struct retransmit_timer_t {
+        timeval due;
+        uint64_t segment;
+        uint32_t generation; // the segment's slot generation when the timer was armed
+    };
+
+    class payload_source;
+    class payload_sink;
+
+    // Compression. Every end takes compressed segments and says so in its handshake,
+    // but only compresses what it sends if asked to. Segments are compressed one by
+    // one, each carrying as much data as compresses into a packet, so every segment
+    // still decodes (and is ACKed and resent) on its own.
+    bool compression;          // compress our transfers if the remote takes it
+    bool remote_compression;   // the remote's handshake offered to take compressed segments
+    bool compress_transfer;    // the send in progress compresses
+    int compress_skip;         // segments left to send as they are, since one didn't compress
+    std::vector<char> compress_buf;   // payload of the segment being sent
+
+    // Sender state. Segments in flight are kept in send order in a ring of
+    // power of two size, one array per field so ACK processing only touches
+    // what it needs. Segments are numbered as sent, segment n lives in slot
+    // n & ring_mask. Cumulative ACKs retire segments from ring_head, selective
+    // ACKs mark them SEG_SACKED, so neither scans the window.
+    payload_source *send_src;
+    std::vector<uint64_t> ring_seq;        // transfer offset the segment ends at
+    std::vector<uint32_t> ring_len;
+    std::vector<uint32_t> ring_payload;    // bytes the segment took on the wire, less with compression
+    std::vector<timeval>  ring_sent;       // last sent
+    std::vector<uint32_t> ring_generation; // bumped every time the slot is sent from, tells stale timers apart
+    std::vector<uint8_t>  ring_flags;
+    size_t ring_mask;
+    uint64_t ring_head;                    // oldest unACKed segment
+    uint64_t ring_tail;                    // next segment to be sent
+    uint64_t sack_high;                    // past the highest segment selectively ACKed
+    uint64_t loss_scan;                    // segments before this were judged lost or not already
+    std::vector<retransmit_timer_t> rto_heap; // min-heap by due, may hold stale timers
+    std::deque<uint64_t> resend_queue;     // segments to retransmit, in order
+    size_t current_unacknowledged_bytes;
+    size_t unacknowledged_payload;         // of those, as sent on the wire. What our window limits
+    size_t total_acknowledged_bytes;
+    size_t last_ack;
+    bool sent_EOF;
+    uint8_t send_transfer; // number of the transfer being sent, its segments carry it
+    bool in_recovery;    // resending lost segments until recover is ACKed
+    bool fast_recovery;  // and it started with duplicate ACKs rather than a timeout
+    size_t recover;
+    int duplicate_acks;  // in a row
+    int window_probes;   // zero window probes sent since a segment last went out
+
+    // Pacing (sender). Segments are spread over the RTT instead of bursting out
+    // a whole window at once: a token bucket filled at about a window per
+    // min_rtt. Tokens are bytes and may go negative, sending waits for the debt.
+    long min_rtt;              // usec, 0 until the first sample
+    long srtt;                 // smoothed RTT in usec, 0 until the first sample
+    timeval min_rtt_stamp;     // when min_rtt was sampled
+    double pacing_tokens;
+    timeval pacing_refill;     // last time tokens were added
+    bool pacing_blocked;       // sending waits on pacing_deadline
+    timeval pacing_deadline;
+
+    // Forward error correction (sender). Blocks of up to fec_block data segments
+    // are followed by fec_parity XOR parity segments, parity i covering segments
+    // i, i + fec_parity, ... so bursts of up to fec_parity losses are recoverable.
+    // fec_parity adapts to the loss rate, bounded by fec_max_parity.
+    int fec_block;
+    int fec_max_parity;
+    int fec_parity;            // parity segments of the block being sent, 0 if unprotected
+    int fec_segments;          // data segments in the block being sent
+    int fec_count;             // data segments sent in the block so far
+    size_t fec_stride;         // largest data segment of the block
+    size_t fec_block_start;
+    uint16_t fec_lengths[ RDT_FEC_MAX_BLOCK ];
+    bool fec_eof;
+    std::vector<char> fec_buf; // room for an rdt_fec_header_t and the parity, per parity segment
+    double loss_rate;          // moving estimate of the fraction of segments lost
+    size_t remote_recovered;   // segments the remote rebuilt, last we heard
+
+    // Where received data goes: the sink (NULL discards the data), and the data,
+    // received in order and ACKed, which it had no room for yet. That takes up
+    // our receive window until the sink takes it.
+    struct destination_t {
+        payload_sink *sink;
+        RDTSegmentRing undelivered; // queued in order, with push_back()
+        size_t undelivered_bytes;
+
+        destination_t() : sink( NULL ), undelivered_bytes( 0 ) {}
+    };
+
+    // Receiver state
+    destination_t recv_dest;
+    size_t total_bytes_received;
+    bool got_EOF;
+    uint8_t recv_transfer;      // number of the transfer being received, as its segments carry it
+    int last_transfer;          // that of the last transfer received, -1 before the first
+    size_t last_transfer_bytes; // and its length
+    bool closing_with_EOF; // the remote's EOF carries its FIN
+    timeval idle_deadline; // when the sender is considered silent
+
+    // Segments held by their transfer offset: those which arrived out of order
+    // (delivered once the gap is filled), and the last RDT_FEC_HISTORY delivered
+    // ones kept to rebuild lost segments of their block from parity
+    RDTSegmentRing reorder;
+    size_t reorder_bytes;
+    RDTSegmentRing fec_history;
+    size_t fec_recovered; // segments rebuilt from parity this transfer
+
+    size_t undelivered_bytes; // waiting on the sinks of every destination
+    timeval sink_retry;       // when undelivered data is offered to the sinks again
+
+    // Streams of the next (or running) stream transfer, by id. Sending, a stream
+    // has a source and goes as far as the remote's credit lets it. Receiving, it
+    // has a destination and its own ordering: its segments are delivered as soon
+    // as the stream has everything before them, whatever other streams miss.
+    struct stream_t {
+        payload_source *src;
+        destination_t dest;
+        uint64_t limit;         // credit: sending, what the remote gave. Receiving, what we last gave
+        uint64_t received;      // in order
+        uint64_t length;        // known from its last segment, -1 before
+        bool done;              // all of it made it to the sink
+        RDTSegmentRing reorder; // held beyond a gap in the stream, by stream offset
+
+        stream_t() : src( NULL ), limit( RDT_STREAM_WINDOW ), received( 0 ), length( (uint64_t)-1 ), done( false ) {}
+    };
+
+    std::vector<stream_t> streams;
+    bool stream_transfer;  // the transfer in progress is a stream transfer
+    bool streams_blocked;  // sending waits on stream credit
+    rdt_stream_callback_t stream_callback;
+
+    // Delayed ACK state
+    int ack_every;
+    long ack_delay;
+    int unacked_segments; // in order segments received since our last ACK
+    timeval ack_deadline; // when the pending ACK must go out
+
+    // Statistics
+    enum rdt_blocked_t { BLOCKED_NONE, BLOCKED_WINDOW, BLOCKED_PACING };
+
+    rdt_stats_t counters;    // only the counters are kept up to date, see stats()
+    timeval transfer_start;
+    timeval transfer_end;    // zero while the transfer runs
+    rdt_blocked_t blocked;   // what sending waits on since blocked_since
+    timeval blocked_since;
+    long window_wait;        // usec blocked on the window, up to blocked_since
+    long pacing_wait;        // usec blocked on pacing, likewise
+    int stats_fd;            // where snapshots go, -1 if nowhere
+    long stats_interval;
+    timeval stats_due;
+
+    // Diagnostics
+    std::vector<rdt_trace_record_t> trace_ring;
+    uint64_t trace_count; // events ever traced, the ring keeps the latest
+    time_t log_time;      // second log_date was formatted for
+    char log_date[32];
 
     struct rdt_header_t {
         uint32_t magic_num; // Used for packet alignment when reading from network
         uint16_t src_port;
         uint16_t dst_port;
-        uint32_t seq_num;
-        uint32_t ack_num;
+        uint64_t seq_num; // Byte offsets, 64 bits never wrap
+        uint64_t ack_num;
         uint16_t data_len;
         uint16_t flags;
+        uint32_t conn_id;
+        uint32_t checksum; // CRC32C of the header (with this field zeroed) and payload
+        uint16_t window;   // Receive window of the sender, scaled by its window scale
+        uint8_t transfer;  // Number of the transfer a data segment belongs to, echoed by ACKs
+        uint8_t stream;    // Stream of a data segment (see STREAM_MASK), credits an ACK carries. Zero otherwise
     };
 
-    // Do not exceed the max MSS allowed
+    // Packets are variable sized, the payload follows the header up to the
+    // negotiated MTU. Only the header of a stack allocated packet is usable.
     struct rdt_packet_t {
         rdt_header_t header;
-        char data[ MSS - sizeof(rdt_header_t) ];
+        char data[];
+    };
+
+    // Leads the payload of parity segments, followed by the XOR of the covered
+    // segments (each zero padded to the longest)
+    struct rdt_fec_header_t {
+        uint64_t block_start; // transfer offset of the block's first segment
+        uint16_t lengths[ RDT_FEC_MAX_BLOCK ]; // payload of each data segment
+        uint8_t  count;       // data segments in the block
+        uint8_t  interleave;  // parity segments in the block
+        uint8_t  index;       // which one this is
+        uint8_t  eof;         // whether the block's last segment is the EOF
+        uint8_t  reserved[4];
+    };
+
+    // Carried as the payload of SACK packets: data from start up to end is held
+    struct rdt_sack_block_t {
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // Carried after the SACK blocks of stream transfer ACKs, one per stream
+    // still being received: how far into the stream the sender may go
+    struct rdt_stream_credit_t {
+        uint64_t limit;
+        uint16_t stream;
+        uint8_t  reserved[6];
+    };
+
+    // Carried as the payload of SYN packets
+    struct rdt_syn_options_t {
+        uint32_t mtu; // largest packet the sender of the SYN accepts
+        uint32_t window_scale; // shift applied to the window of every packet it sends
+    };
+
+    // Supplies the payload of an outgoing transfer. Only bytes inside the current
+    // window are ever requested, so implementations only need to keep that resident
+    class payload_source {
+    public:
+        virtual ~payload_source() {}
+        virtual size_t length() const = 0;
+        virtual char const *read(size_t offset, size_t len) = 0; // NULL on failure
+        // How much of the len bytes at offset a single segment may carry right now (0 if none
+        // may go out yet), tagging its header with where they belong. All of them by default.
+        virtual size_t place(size_t, size_t len, rdt_header_t &) { return len; }
+        // Everything before offset was ACKed and won't be requested again
+        virtual void release(size_t) {}
+    };
+
+    // Consumes the payload of an incoming transfer in order, as it arrives
+    class payload_sink {
+    public:
+        virtual ~payload_sink() {}
+        // Returns the bytes taken, fewer if it has no room for more right now, -1 on failure
+        virtual ssize_t write(char const *data, size_t len) = 0;
+    };
+
+    class string_source;
+    class fd_source;
+    class string_sink;
+    class fd_sink;
+    class stream_source;
+
+    // Outgoing data segment: the header is built in place and the payload
+    // points directly into the caller's buffer so it is never copied
+    struct rdt_segment_t {
+        rdt_header_t header;
+        char const *payload;
     };
 
-    bool isEOFACK(rdt_packet_t &pkt) { return pkt.header.flags & EOFACK_MASK; }
-    bool isEOF(rdt_packet_t &pkt) { return pkt.header.flags & EOF_MASK; }
-    bool isFINACK(rdt_packet_t &pkt) { return pkt.header.flags & FINACK_MASK; }
-    bool isSYNACK(rdt_packet_t &pkt) { return pkt.header.flags & SYNACK_MASK; }
-    bool isACK(rdt_packet_t &pkt) { return pkt.header.flags & ACK_MASK; }
-    bool isSYN(rdt_packet_t &pkt) { return pkt.header.flags & SYN_MASK; }
-    bool isFIN(rdt_packet_t &pkt) { return pkt.header.flags & FIN_MASK; }
+    static bool isSTREAM(rdt_packet_t const &pkt) { return pkt.header.flags & STREAM_MASK; }
+    static bool isWPROBE(rdt_packet_t const &pkt) { return pkt.header.flags & WPROBE_MASK; }
+    static bool isCOMPRESS(rdt_packet_t const &pkt) { return pkt.header.flags & COMPRESS_MASK; }
+    static bool isSACK(rdt_packet_t const &pkt) { return pkt.header.flags & SACK_MASK; }
+    static bool isPARITY(rdt_packet_t const &pkt) { return pkt.header.flags & PARITY_MASK; }
+    static bool isFEC(rdt_packet_t const &pkt) { return pkt.header.flags & FEC_MASK; }
+    static bool isPROBEACK(rdt_packet_t const &pkt) { return pkt.header.flags & PROBEACK_MASK; }
+    static bool isPROBE(rdt_packet_t const &pkt) { return pkt.header.flags & PROBE_MASK; }
+    static bool isACKNOW(rdt_packet_t const &pkt) { return pkt.header.flags & ACKNOW_MASK; }
+    static bool isEOFACK(rdt_packet_t const &pkt) { return pkt.header.flags & EOFACK_MASK; }
+    static bool isEOF(rdt_packet_t const &pkt) { return pkt.header.flags & EOF_MASK; }
+    static bool isFINACK(rdt_packet_t const &pkt) { return pkt.header.flags & FINACK_MASK; }
+    static bool isSYNACK(rdt_packet_t const &pkt) { return pkt.header.flags & SYNACK_MASK; }
+    static bool isACK(rdt_packet_t const &pkt) { return pkt.header.flags & ACK_MASK; }
+    static bool isSYN(rdt_packet_t const &pkt) { return pkt.header.flags & SYN_MASK; }
+    static bool isFIN(rdt_packet_t const &pkt) { return pkt.header.flags & FIN_MASK; }
 
+    void setCOMPRESS(rdt_segment_t &seg) { seg.header.flags |= COMPRESS_MASK; }
+    void setPARITY(rdt_segment_t &seg) { seg.header.flags |= PARITY_MASK; }
+    void setFEC(rdt_segment_t &seg) { seg.header.flags |= FEC_MASK; }
+    void setPROBEACK(rdt_packet_t &pkt) { pkt.header.flags |= PROBEACK_MASK; }
+    void setPROBE(rdt_segment_t &seg) { seg.header.flags |= PROBE_MASK; }
+    void setSYN(rdt_segment_t &seg) { seg.header.flags |= SYN_MASK; }
+    void setSYNACK(rdt_segment_t &seg) { seg.header.flags |= SYNACK_MASK; }
+    void setACKNOW(rdt_segment_t &seg) { seg.header.flags |= ACKNOW_MASK; }
     void setEOFACK(rdt_packet_t &pkt) { pkt.header.flags |= EOFACK_MASK; }
     void setEOF(rdt_packet_t &pkt) { pkt.header.flags |= EOF_MASK; }
+    void setEOF(rdt_segment_t &seg) { seg.header.flags |= EOF_MASK; }
     void setFINACK(rdt_packet_t &pkt) { pkt.header.flags |= FINACK_MASK; }
     void setSYNACK(rdt_packet_t &pkt) { pkt.header.flags |= SYNACK_MASK; }
     void setACK(rdt_packet_t &pkt) { pkt.header.flags |= ACK_MASK; }
+    void setACK(rdt_segment_t &seg) { seg.header.flags |= ACK_MASK; }
+    void setEOFACK(rdt_segment_t &seg) { seg.header.flags |= EOFACK_MASK; }
+    void setSACK(rdt_segment_t &seg) { seg.header.flags |= SACK_MASK; }
+    void setWPROBE(rdt_packet_t &pkt) { pkt.header.flags |= WPROBE_MASK; }
+    void setSTREAM(rdt_segment_t &seg) { seg.header.flags |= STREAM_MASK; }
     void setSYN(rdt_packet_t &pkt) { pkt.header.flags |= SYN_MASK; }
     void setFIN(rdt_packet_t &pkt) { pkt.header.flags |= FIN_MASK; }
+    void setFIN(rdt_segment_t &seg) { seg.header.flags |= FIN_MASK; }
+    void setFINACK(rdt_segment_t &seg) { seg.header.flags |= FINACK_MASK; }
 
-    int  build_network_packet(rdt_packet_t &pkt, std::string const &data, size_t max_data_len = 0, size_t data_offset = 0);
-    bool broadcast_network_packet(rdt_packet_t const &pkt);
-    bool read_network_packet(rdt_packet_t &pkt, bool verify_remote = true, sockaddr_in *ain = NULL);
-    void drop_packet(rdt_packet_t &pkt, std::string const &reason);
+    void   build_network_packet(rdt_packet_t &pkt);
+    void   build_network_packet(rdt_segment_t &seg, char const *payload, size_t payload_len);
+    size_t build_network_segment(rdt_segment_t &seg, payload_source &src, size_t max_data_len, size_t data_offset);
+    size_t build_compressed_segment(rdt_segment_t &seg, size_t max_data_len, size_t max_payload_len, size_t data_offset);
+    bool   broadcast_network_packet(rdt_packet_t &pkt);
+    bool   broadcast_network_segment(rdt_segment_t &seg);
+    static uint32_t packet_checksum(rdt_header_t const &header, char const *payload, size_t payload_len);
+    static bool verify_checksum(rdt_packet_t const &pkt, size_t len);
+    rdt_packet_t *read_network_packet(bool verify_remote = true, sockaddr_in *ain = NULL);
+    ssize_t receive_datagram(RDTBufferPool::buffer &datagram, size_t len, sockaddr_in *from);
+    void drop_packet(rdt_packet_t &pkt, rdt_drop_reason_t reason, char const *msg);
+    void trace_event(uint16_t event, uint64_t seq = 0, uint64_t ack = 0);
+    void trace_packet(uint16_t event, rdt_header_t const &header, bool incoming);
 
     bool connect(std::string const &afnet_address, int port, bool sendSYNACK);
+    bool start_connect(std::string const &afnet_address, int port, bool sendSYNACK, rdt_callback_t done, void *context);
+    bool send_SYN();
+    bool send_handshake(bool syn, bool synack);
+    void connect_packet(rdt_packet_t &pkt);
+    void connect_timeout();
+    void read_SYN_options(rdt_packet_t const &pkt);
+    void read_SYN_request(rdt_packet_t const &pkt);
+
+    size_t max_payload();
+    size_t send_limit();
+    size_t amplification_room();
+    void validate_remote();
+    uint16_t advertised_window();
+    void reset_path_mtu();
+    void probe_path_mtu();
+    void probe_acked(size_t size);
+
     bool bind(int port = 0);
+
     void close(bool force_teardown);
+    void send_FIN();
+    void close_packet(rdt_packet_t &pkt);
+    void close_timeout();
+    void close_complete();
+    void teardown(bool force_teardown);
+
+    bool start_send_payload(payload_source *src, rdt_callback_t done, void *context);
+    bool finish_blocking_send();
+    bool send_window();
+    void start_fec_block(size_t offset);
+    void add_fec_segment(rdt_segment_t &seg);
+    void send_fec_parity();
+    void set_send_timeout();
+    void sample_rtt(timeval const &sent);
+    double pacing_rate();
+    bool pacing_allows();
+    bool resend_segment(uint64_t segment);
+    void send_packet(rdt_packet_t &pkt);
+    void receive_SACK(rdt_packet_t const &pkt);
+    void receive_stream_credits(rdt_packet_t const &pkt);
+    void send_timeout();
+    bool send_window_probe();
+    void start_recovery(bool fast);
+    void mark_lost(uint64_t end);
+    static bool later_timer(retransmit_timer_t const &a, retransmit_timer_t const &b);
+    void arm_retransmit(uint64_t segment);
+    retransmit_timer_t const *oldest_in_flight();
+    void set_blocked(rdt_blocked_t why);
+
+    bool start_receive_payload(payload_sink *sink, rdt_callback_t done, void *context);
+    bool finish_blocking_receive();
+    void receive_packet(rdt_packet_t &pkt);
+    void ack_last_transfer();
+    void receive_timeout();
+    void set_receive_timeout();
+    void send_ACK(bool eof);
+    bool deliver_segment(size_t start, RDTBufferPool::buffer const &data, bool eof, bool fec);
+    bool deliver_held_segments();
+    bool write_to_sink(destination_t &dest, RDTBufferPool::buffer const &data);
+    bool flush_destination(destination_t &dest);
+    bool flush_undelivered();
+    void receive_EOF();
+    void complete_receive();
+    bool receive_stream_segment(rdt_packet_t const &pkt, RDTBufferPool::buffer const &data);
+    bool deliver_stream_segment(stream_t &stream, size_t start, RDTBufferPool::buffer const &data);
+    void finish_stream(int id, bool all_here);
+    bool set_stream_source(int stream, payload_source *src);
+    bool set_stream_sink(int stream, payload_sink *sink);
+    uint64_t stream_credit(stream_t const &stream);
+    void clear_streams();
+    bool receive_parity(rdt_packet_t &pkt);
+    RDTSegmentRing::segment_t const *find_held_segment(size_t start, size_t len);
+    void reset_receive_buffers();
+
+    void start_operation(rdt_op_t type, rdt_callback_t done, void *context);
+    void finish_operation(bool success);
+    void abort_operation();
+    bool run_operation();
+    void set_timeout(long usec);
+    static void clock_now(timeval &now);
+    static void time_from_now(long usec, timeval &when);
+    void arm_timer();
+    bool wait_readable(long timeout_usec);
+    void log_stats(bool now);
+
+    std::string remote_name();
 
     void log_event(std::string const &msg);
 };
@@ -0,0 +1,134 @@
+#include "RDTSegmentRing.h"
+#include <algorithm> // std::swap
+
+RDTSegmentRing::RDTSegmentRing() : mask( 0 ), head( 0 ), count( 0 ), limit( (size_t)-1 ) {}
+
+/**
+ * Looks up the segment starting at start, NULL if none is held
+ */
+RDTSegmentRing::segment_t *RDTSegmentRing::find(size_t start) {
+    size_t i = lower_bound(start);
+    if (i < count && (*this)[i].start == start)
+        return &(*this)[i];
+
+    return NULL;
+}
+
+/**
+ * Holds on to a segment in order of its offset, replacing one starting at the
+ * same offset. Returns false (holding nothing) if the ring is at its limit.
+ */
+bool RDTSegmentRing::insert(size_t start, RDTBufferPool::buffer const &data, bool eof, bool fec) {
+    size_t i = lower_bound(start);
+
+    if (i == count || (*this)[i].start != start) {
+        if (!push_back(data))
+            return false;
+
+        // Moves it down to its place, a segment arriving in order stays put
+        for (size_t j = count - 1; j > i; j--)
+            swap((*this)[j], (*this)[j - 1]);
+    }
+
+    segment_t &held = (*this)[i];
+    held.start = start;
+    held.data = data;
+    held.eof = eof;
+    held.fec = fec;
+    return true;
+}
+
+/**
+ * Holds on to a segment after all the others, whatever its offset.
+ * Returns false (holding nothing) if the ring is at its limit.
+ */
+bool RDTSegmentRing::push_back(RDTBufferPool::buffer const &data) {
+    if (count >= limit)
+        return false;
+    if (count == slots.size())
+        reserve(count + 1);
+
+    segment_t &held = (*this)[count++];
+    held.start = 0;
+    held.data = data;
+    held.eof = false;
+    held.fec = false;
+    return true;
+}
+
+/**
+ * Lets go of the lowest segment
+ */
+void RDTSegmentRing::pop_front() {
+    slots[head].data.reset();
+    head = (head + 1) & mask;
+    count--;
+}
+
+/**
+ * Lets go of every segment, keeping the slots for the next ones
+ */
+void RDTSegmentRing::clear() {
+    while (count > 0)
+        pop_front();
+    head = 0;
+}
+
+/**
+ * Makes room for at least segments without allocating again, moving what is
+ * held (by reference) to the start of the new slots
+ */
+void RDTSegmentRing::reserve(size_t segments) {
+    if (segments <= slots.size())
+        return;
+
+    size_t size = std::max((size_t)RDT_SEGMENT_RING_MIN, slots.size());
+    while (size < segments)
+        size <<= 1;
+
+    std::vector<segment_t> grown(size);
+    for (size_t i = 0; i < count; i++)
+        swap(grown[i], (*this)[i]);
+
+    slots.swap(grown);
+    mask = size - 1;
+    head = 0;
+}
+
+/**
+ * Caps how many segments the ring holds at once, insert() and push_back()
+ * fail beyond that. Slots are only allocated as they are needed.
+ */
+void RDTSegmentRing::set_limit(size_t segments) {
+    limit = segments;
+}
+
+/**
+ * Index of the first segment starting at or after start
+ */
+size_t RDTSegmentRing::lower_bound(size_t start) const {
+    // Most segments go after everything held
+    if (count == 0 || (*this)[count - 1].start < start)
+        return count;
+
+    size_t low = 0, high = count - 1;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if ((*this)[mid].start < start)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/**
+ * Swaps two slots without touching the reference counts of their buffers
+ */
+void RDTSegmentRing::swap(segment_t &a, segment_t &b) {
+    std::swap(a.start, b.start);
+    a.data.swap(b.data);
+    std::swap(a.eof, b.eof);
+    std::swap(a.fec, b.fec);
+}
@@ -0,0 +1,62 @@
+#ifndef RDTSEGMENTRING_H
+#define RDTSEGMENTRING_H
+#include <stddef.h> // size_t
+#include <vector> // std::vector
+#include "RDTBufferPool.h"
+
+#define RDT_SEGMENT_RING_MIN 64 // Slots a ring starts out with once it holds anything
+
+/**
+ * Received segments held in order of their offset, in a power of two ring of
+ * slots. Slots hold buffers by reference, no data is copied. Segments mostly
+ * arrive in order and leave from the front, so inserting and popping is O(1)
+ * and looking one up is a binary search.
+ *
+ * Storage only grows, doubling whenever more segments are held than ever
+ * before (up to the limit), and is reused from then on: a ring which reached
+ * its working size allocates nothing, however many segments pass through it.
+ * Rings may also be used as plain queues with push_back(), which ignores
+ * offsets, as long as they are not mixed with insert().
+ */
+class RDTSegmentRing {
+public:
+    struct segment_t {
+        size_t start; // offset of its first byte
+        RDTBufferPool::buffer data;
+        bool eof;
+        bool fec;
+    };
+
+    RDTSegmentRing();
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    bool full() const { return count >= limit; }
+
+    // The i-th segment held, lowest offset first
+    segment_t &operator[](size_t i) { return slots[(head + i) & mask]; }
+    segment_t const &operator[](size_t i) const { return slots[(head + i) & mask]; }
+    segment_t &front() { return slots[head]; }
+
+    segment_t *find(size_t start);
+    bool insert(size_t start, RDTBufferPool::buffer const &data, bool eof = false, bool fec = false);
+    bool push_back(RDTBufferPool::buffer const &data);
+    void pop_front();
+    void clear();
+
+    // Preallocates room for segments, and caps how many are held at once
+    void reserve(size_t segments);
+    void set_limit(size_t segments);
+
+private:
+    std::vector<segment_t> slots; // power of two size, or empty until something is held
+    size_t mask;
+    size_t head;  // slot of the lowest segment
+    size_t count;
+    size_t limit;
+
+    size_t lower_bound(size_t start) const;
+    static void swap(segment_t &a, segment_t &b);
+};
+
+#endif
@@ -0,0 +1,472 @@
+#include "RDTServer.h"
+#include <sys/time.h> // timeval
+#include <arpa/inet.h> // htonl, ntohl, etc.
+#include <poll.h>
+#include <unistd.h>
+#include <cstring> // memset, etc.
+#include <cerrno> // errno
+#include <ctime> // timespec
+#include <iostream> // std::cerr
+#include <sstream> // std::stringstream
+#include <cstddef> // offsetof
+#include <sched.h> // cpu_set_t
+#include <linux/filter.h> // sock_filter, sock_fprog
+
+RDTServer::RDTServer(int w_size, double ploss, double pcorrupt, size_t backlog)
+    :   sock_fd( -1 ),
+        running( false ),
+        demux_started( false ),
+        window_size( w_size ),
+        prob_loss( ploss ),
+        prob_corrupt( pcorrupt ),
+        max_backlog( backlog ),
+        mtu( RDT_MAX_MTU ),
+        reuse_port( false ),
+        cpu( -1 ),
+        seed_sessions( false ),
+        impairment_seed( 0 )
+{
+    // Sessions wait with deadlines from RDTConnection's monotonic clock
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&backlog_ready, NULL);
+}
+
+/**
+ * Stops serving and releases the socket. Sessions still alive at this
+ * point are detached and will fail any further network operations.
+ */
+RDTServer::~RDTServer() {
+    close();
+
+    pthread_mutex_lock(&lock);
+    while (!sessions.empty()) {
+        session_t *session = sessions.begin()->second;
+        session->conn->server = NULL;
+        session->conn->sock_fd = -1;
+        destroy_session(session);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (sock_fd != -1)
+        ::close(sock_fd);
+
+    pthread_cond_destroy(&backlog_ready);
+    pthread_mutex_destroy(&lock);
+    pthread_condattr_destroy(&monotonic);
+}
+
+/**
+ * Binds the server socket and starts demultiplexing incoming packets
+ */
+bool RDTServer::listen( int port ) {
+    close();
+
+    if (sock_fd != -1) {
+        ::close(sock_fd);
+        sock_fd = -1;
+    }
+
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    local_addr.sin_port = htons(port);
+
+    // Shards have to agree on reusing the port before any of them binds it
+    int reuse = reuse_port ? 1 : 0;
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd != -1 && reuse)
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+    if (sock_fd == -1 || ::bind(sock_fd, (sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
+        LOG_ERROR("Failed to bind server socket");
+        if (sock_fd != -1)
+            ::close(sock_fd);
+        sock_fd = -1;
+        return false;
+    }
+
+    // Never let the kernel fragment our packets, sessions probe the path MTU
+    int pmtud = IP_PMTUDISC_PROBE;
+    setsockopt(sock_fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtud, sizeof(pmtud));
+
+    int buf_size = RDT_SOCKET_BUFFER;
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
+    // Double check what port the system gave us
+    local_addr.sin_port = htons(port_number());
+
+    running = true;
+    if (pthread_create(&demux_thread, NULL, demux_main, this) != 0) {
+        LOG_ERROR("Failed to start demultiplexing thread");
+        running = false;
+        return false;
+    }
+
+    if (cpu >= 0 && !pin_thread(demux_thread, cpu))
+        LOG_WARN("Failed to pin the demultiplexing thread to CPU " << cpu);
+
+    demux_started = true;
+    return true;
+}
+
+/**
+ * Blocks until a pending connection request completes its handshake.
+ * Returns the established session, which the caller owns and must delete,
+ * or NULL once the server has been closed.
+ */
+RDTConnection *RDTServer::accept() {
+    char ip_addr[INET_ADDRSTRLEN];
+
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (running && backlog.empty())
+            pthread_cond_wait(&backlog_ready, &lock);
+
+        if (!running) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+
+        session_t *session = backlog.front();
+        backlog.pop_front();
+
+        RDTConnection *conn = session->conn;
+        inet_ntop(AF_INET, &session->addr.sin_addr.s_addr, ip_addr, sizeof(ip_addr));
+        int port = ntohs(session->addr.sin_port);
+        pthread_mutex_unlock(&lock);
+
+        if (conn->connect(ip_addr, port, true))
+            return conn;
+
+        delete conn; // detaches the session from the server
+    }
+}
+
+/**
+ * Stops accepting connections and demultiplexing packets. Pending
+ * connection requests are discarded and blocked accept() calls return NULL.
+ */
+void RDTServer::close() {
+    pthread_mutex_lock(&lock);
+    running = false;
+    pthread_cond_broadcast(&backlog_ready);
+    pthread_mutex_unlock(&lock);
+
+    if (demux_started) {
+        pthread_join(demux_thread, NULL);
+        demux_started = false;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (!backlog.empty()) {
+        session_t *session = backlog.front();
+        backlog.pop_front();
+
+        // Never connected, so there is nobody to send a FIN to
+        RDTConnection *conn = session->conn;
+        destroy_session(session);
+        conn->server = NULL;
+        conn->sock_fd = -1;
+        delete conn;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Returns the port the server is bound to or -1 on failure
+ */
+int RDTServer::port_number() {
+    sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if ( getsockname(sock_fd, (sockaddr *)&addr, &addr_len) == -1 )
+        return -1;
+    else
+        return ntohs( addr.sin_port );
+}
+
+/**
+ * Sets the largest packet (including IP and UDP headers) sessions accept.
+ * Applies to sessions accepted from then on.
+ */
+void RDTServer::set_mtu( size_t max_mtu ) {
+    pthread_mutex_lock(&lock);
+    mtu = max_mtu;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Seeds the simulated loss and corruption of sessions accepted from then on,
+ * the first with seed, the next with seed + 1 and so on. Unseeded sessions
+ * start from a seed of their own.
+ */
+void RDTServer::set_impairment_seed( unsigned int seed ) {
+    pthread_mutex_lock(&lock);
+    seed_sessions = true;
+    impairment_seed = seed;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Lets other servers listen on the same port, as shards which the kernel
+ * spreads incoming connections across. Applies from the next listen() on,
+ * every shard has to set it.
+ */
+void RDTServer::set_reuse_port( bool reuse ) {
+    reuse_port = reuse;
+}
+
+/**
+ * Pins the demultiplexing thread to a CPU (from the next listen() on), -1 to
+ * let it run anywhere. Shards pinned to CPUs of their own, along with the
+ * threads running their sessions, keep each connection's packets on one CPU.
+ */
+void RDTServer::set_cpu( int cpu ) {
+    this->cpu = cpu;
+}
+
+/**
+ * Has the kernel pick the shard of every datagram arriving on our port from
+ * its connection id instead of a hash of the peer address. Ids are random, so
+ * connections spread evenly however few addresses they come from. Sessions
+ * are still told apart by peer address as well: a peer whose address changes
+ * loses its session, steered or not. Shards are numbered in the order they
+ * started listening, the program runs for the whole group and must be set up
+ * once they all listen.
+ *
+ * The classic BPF program loads the id in network byte order, where we send
+ * it in host order. That's as good a hash as any, ids are random.
+ */
+bool RDTServer::steer_by_conn_id( int shards ) {
+    if (sock_fd == -1 || !reuse_port || shards < 1)
+        return false;
+
+    // Reuseport programs see the datagram from the UDP payload on
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(RDTConnection::rdt_header_t, conn_id)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)shards),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+
+    sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    return setsockopt(sock_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+/**
+ * Pins a thread to a CPU, false if there is no such CPU
+ */
+bool RDTServer::pin_thread( pthread_t thread, int cpu ) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(thread, sizeof(cpus), &cpus) == 0;
+}
+
+void *RDTServer::demux_main(void *server) {
+    ((RDTServer *)server)->demux();
+    return NULL;
+}
+
+/**
+ * Reads every datagram arriving on the server socket and queues it for the
+ * session it belongs to. SYNs from unknown peers open a new session which
+ * waits on the backlog until it is accepted.
+ */
+void RDTServer::demux() {
+    // Sessions may accept up to the largest datagram, check them against their own limits
+    size_t const max_len = RDT_MAX_MTU - IP_HEADER - UDP_HEADER;
+    sockaddr_in from;
+    socklen_t from_len;
+
+    while (running) {
+        // Wake up periodically to notice when the server is closed
+        pollfd pfd;
+        pfd.fd = sock_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, RDT_TIMEOUT_USEC / 1000) <= 0)
+            continue;
+
+        // Only datagrams queued for a session are carved out of the pool, the room
+        // of anything else is read into again
+        char *room = pool.reserve(max_len);
+        if (!room) {
+            LOG_ERROR("Out of memory for packet buffers");
+            usleep(RDT_TIMEOUT_USEC);
+            continue;
+        }
+
+        RDTConnection::rdt_packet_t &pkt = *(RDTConnection::rdt_packet_t *)room;
+        from_len = sizeof(from);
+        ssize_t len = recvfrom(sock_fd, room, max_len, 0, (sockaddr *)&from, &from_len);
+
+        // Sessions validate their packets in full, just make sure we can route it
+        if (len < (ssize_t)sizeof(pkt.header) || pkt.header.magic_num != RDT_MAGIC_NUM)
+            continue;
+
+        session_key_t key;
+        key.addr = from.sin_addr.s_addr;
+        key.port = from.sin_port;
+        key.conn_id = pkt.header.conn_id;
+
+        char const *dropped = NULL;
+
+        pthread_mutex_lock(&lock);
+        session_map_t::iterator iter = sessions.find(key);
+
+        if (iter != sessions.end()) {
+            session_t *session = iter->second;
+
+            // A session which isn't keeping up loses packets, just as a full socket buffer would
+            if (!session->inbox.full()) {
+                session->inbox.push_back(pool.commit(len));
+                pthread_cond_signal(&session->readable);
+            } else {
+                dropped = "session queue full";
+            }
+        } else if (RDTConnection::isSYN(pkt) && !RDTConnection::isSYNACK(pkt) && key.conn_id != 0) {
+            // Sessions check their own packets, but don't open one for a corrupted SYN
+            if (!RDTConnection::verify_checksum(pkt, len)) {
+                dropped = "packet corrupted: checksum mismatch";
+            } else if ((size_t)len != sizeof(pkt.header) + pkt.header.data_len) {
+                dropped = "received packet was shorter than expected";
+            } else if (backlog.size() < max_backlog) {
+                session_t *session = new session_t;
+                session->key = key;
+                session->addr = from;
+                session->inbox.reserve(RDT_SESSION_QUEUE);
+                session->inbox.set_limit(RDT_SESSION_QUEUE);
+                pthread_cond_init(&session->readable, &monotonic);
+
+                session->conn = new RDTConnection(window_size, prob_loss, prob_corrupt);
+                if (seed_sessions)
+                    session->conn->set_impairment_seed(impairment_seed++);
+                session->conn->server = this;
+                session->conn->sock_fd = sock_fd;
+                session->conn->local_addr = local_addr;
+                session->conn->conn_id = key.conn_id;
+                session->conn->set_mtu(mtu);
+                session->conn->read_SYN_options(pkt);
+                session->conn->read_SYN_request(pkt);
+
+                sessions[key] = session;
+                owners[session->conn] = session;
+                backlog.push_back(session);
+                pthread_cond_signal(&backlog_ready);
+            } else {
+                dropped = "SYN backlog full";
+            }
+        } else {
+            dropped = "packet does not belong to any session";
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (dropped)
+            LOG_DEBUG("Dropped packet: " << dropped);
+    }
+}
+
+/**
+ * Waits up to timeout_usec (forever if negative) for a datagram to be
+ * queued for a session. Returns true if one may be read.
+ */
+bool RDTServer::wait_readable(RDTConnection const *conn, long timeout_usec) {
+    timeval end;
+    timespec deadline;
+    RDTConnection::time_from_now(timeout_usec, end);
+    deadline.tv_sec = end.tv_sec;
+    deadline.tv_nsec = end.tv_usec * 1000;
+
+    pthread_mutex_lock(&lock);
+    session_owner_map_t::iterator iter = owners.find(conn);
+    if (iter == owners.end()) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    session_t *session = iter->second;
+    while (session->inbox.empty()) {
+        if (timeout_usec < 0)
+            pthread_cond_wait(&session->readable, &lock);
+        else if (timeout_usec == 0 || pthread_cond_timedwait(&session->readable, &lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    bool readable = !session->inbox.empty();
+    pthread_mutex_unlock(&lock);
+    return readable;
+}
+
+/**
+ * Pops the next datagram queued for a session without waiting, handing over its
+ * buffer. Anything past len bytes is cut off, as a short read would.
+ * Returns the datagram length or -1 with errno set (EWOULDBLOCK if none is queued)
+ */
+ssize_t RDTServer::receive_datagram(RDTConnection const *conn, RDTBufferPool::buffer &datagram, size_t len, sockaddr_in *from) {
+    pthread_mutex_lock(&lock);
+    session_owner_map_t::iterator iter = owners.find(conn);
+    if (iter == owners.end()) {
+        pthread_mutex_unlock(&lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    session_t *session = iter->second;
+    if (session->inbox.empty()) {
+        pthread_mutex_unlock(&lock);
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    datagram.swap(session->inbox.front().data);
+    session->inbox.pop_front();
+    *from = session->addr;
+    pthread_mutex_unlock(&lock);
+
+    if (datagram.size() > len)
+        datagram = datagram.slice(0, len);
+
+    return datagram.size();
+}
+
+/**
+ * Stops routing packets to a session, called when the session tears down
+ */
+void RDTServer::remove_session(RDTConnection const *conn) {
+    pthread_mutex_lock(&lock);
+    session_owner_map_t::iterator iter = owners.find(conn);
+    if (iter != owners.end())
+        destroy_session(iter->second);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Frees a session's routing state. Caller must hold the lock.
+ */
+void RDTServer::destroy_session(session_t *session) {
+    sessions.erase(session->key);
+    owners.erase(session->conn);
+    pthread_cond_destroy(&session->readable);
+    delete session;
+}
+
+void RDTServer::log_event(std::string const &msg) {
+    time_t now;
+    struct tm local; // localtime()'s own is shared with the sessions' threads
+    char date[32];
+
+    time(&now);
+    strftime( date, sizeof(date), "%D %T: ", localtime_r(&now, &local));
+
+    std::cerr << date << msg << std::endl;
+}
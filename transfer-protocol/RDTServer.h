@@ -0,0 +1,112 @@
+#ifndef RDTServ
+#define RDTServ
+#include <netinet/in.h> // sockaddr_in
+#include <pthread.h>
+#include <deque> // std::deque
+#include <map> // std::map
+#include <string> // std::string
+#include "RDTConnection.h"
+
+#define RDT_SYN_BACKLOG 64 // Max connection requests waiting to be accepted
+#define RDT_SESSION_QUEUE 1024 // Max datagrams queued for a single session
+
+/**
+ * Owns a single UDP socket and serves any number of concurrent RDT connections
+ * on it. A demultiplexing thread reads every datagram and routes it by
+ * (address, port, connection id) to the matching session. New SYNs are queued
+ * on a backlog until accept() picks them up.
+ *
+ * Sessions returned by accept() are regular RDTConnection objects which keep all
+ * of their state to themselves, so any thread may drive (and hand off) a session.
+ * Datagrams are read straight into pooled buffers which are queued for their
+ * session as they are. All sessions must be deleted before the server is.
+ *
+ * A single demultiplexing thread only goes so far. Servers set to reuse their
+ * port may listen on the same one as shards of a larger server, each with a
+ * socket, thread and sessions of its own: the kernel spreads connections
+ * across their sockets by hashing the peer address, or by connection id once
+ * steer_by_conn_id() is set up.
+ */
+class RDTServer {
+public:
+    RDTServer(int w_size, double ploss = 0, double pcorrupt = 0, size_t backlog = RDT_SYN_BACKLOG);
+    virtual ~RDTServer();
+
+    bool listen( int port );
+    RDTConnection *accept();
+    void close();
+
+    int port_number();
+    void set_mtu( size_t max_mtu );
+    void set_impairment_seed( unsigned int seed );
+    void set_reuse_port( bool reuse );
+    void set_cpu( int cpu );
+    bool steer_by_conn_id( int shards );
+
+    static bool pin_thread( pthread_t thread, int cpu );
+
+private:
+    friend class RDTConnection;
+
+    struct session_key_t {
+        in_addr_t addr;
+        in_port_t port;
+        uint32_t conn_id;
+
+        bool operator<(session_key_t const &o) const {
+            if (addr != o.addr)
+                return addr < o.addr;
+            if (port != o.port)
+                return port < o.port;
+            return conn_id < o.conn_id;
+        }
+    };
+
+    struct session_t {
+        session_key_t key;
+        sockaddr_in addr;
+        RDTConnection *conn;
+        RDTSegmentRing inbox; // datagrams queued for it, with push_back()
+        pthread_cond_t readable;
+    };
+
+    typedef std::map<session_key_t, session_t *> session_map_t;
+    typedef std::map<RDTConnection const *, session_t *> session_owner_map_t;
+
+    int sock_fd;
+    sockaddr_in local_addr;
+    bool running;
+    bool demux_started;
+
+    size_t const window_size;
+    double const prob_loss;
+    double const prob_corrupt;
+    size_t const max_backlog;
+    size_t mtu; // largest packet sessions accept
+    bool reuse_port; // other servers may listen on our port, see set_reuse_port()
+    int cpu;         // the demultiplexing thread is pinned to, -1 for none
+    bool seed_sessions;           // with impairment_seed, see set_impairment_seed()
+    unsigned int impairment_seed; // of the next session
+
+    RDTBufferPool pool; // datagrams are read into, only the demultiplexing thread carves it
+    pthread_t demux_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t backlog_ready;
+    pthread_condattr_t monotonic; // for session conditions
+
+    session_map_t sessions;
+    session_owner_map_t owners;
+    std::deque<session_t *> backlog;
+
+    static void *demux_main(void *server);
+    void demux();
+
+    bool wait_readable(RDTConnection const *conn, long timeout_usec);
+    ssize_t receive_datagram(RDTConnection const *conn, RDTBufferPool::buffer &datagram, size_t len, sockaddr_in *from);
+    void remove_session(RDTConnection const *conn);
+    void destroy_session(session_t *session);
+
+    void log_event(std::string const &msg);
+};
+
+#endif
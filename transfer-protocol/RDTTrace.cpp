@@ -0,0 +1,21 @@
+#include "RDTTrace.h"
+
+char const *rdt_trace_event_name( uint16_t event ) {
+    static char const *names[RDT_TRACE_MAX_EVENT] = {
+        "unknown",
+        "send",
+        "receive",
+        "drop",
+        "drop-loss",
+        "drop-corrupt",
+        "retransmit",
+        "receive-timeout",
+        "rebuilt",
+        "pacing-wait",
+        "mtu",
+        "connected",
+        "closed"
+    };
+
+    return event < RDT_TRACE_MAX_EVENT ? names[event] : names[0];
+}
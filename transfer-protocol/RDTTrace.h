@@ -0,0 +1,99 @@
+#ifndef RDTTRACE_H
+#define RDTTRACE_H
+#include <stdint.h> // uint64_t etc.
+#include <sstream> // std::stringstream
+
+/**
+ * Diagnostics: leveled logging and the binary trace format.
+ *
+ * Log messages above RDT_LOG_LEVEL (build with -DRDT_LOG_LEVEL=n) are compiled
+ * out entirely, arguments included. The default leaves out the per packet
+ * messages, the trace ring records those far more cheaply.
+ */
+#define RDT_LOG_ERROR 0 // an operation failed
+#define RDT_LOG_WARN  1 // timeouts and other trouble we recover from
+#define RDT_LOG_INFO  2 // connections and transfers starting and ending
+#define RDT_LOG_DEBUG 3 // every packet
+
+#ifndef RDT_LOG_LEVEL
+#define RDT_LOG_LEVEL RDT_LOG_INFO
+#endif
+
+// Logs a message built with <<, e.g. LOG_DEBUG("Received ACK " << ack), through
+// the log_event() of the class it is used in
+#define RDT_LOG(msg) do { std::stringstream rdt_log_ss; rdt_log_ss << msg; log_event(rdt_log_ss.str()); } while (0)
+#define RDT_NO_LOG(msg) do {} while (0)
+
+#if RDT_LOG_LEVEL >= RDT_LOG_ERROR
+#define LOG_ERROR(msg) RDT_LOG(msg)
+#else
+#define LOG_ERROR(msg) RDT_NO_LOG(msg)
+#endif
+
+#if RDT_LOG_LEVEL >= RDT_LOG_WARN
+#define LOG_WARN(msg) RDT_LOG(msg)
+#else
+#define LOG_WARN(msg) RDT_NO_LOG(msg)
+#endif
+
+#if RDT_LOG_LEVEL >= RDT_LOG_INFO
+#define LOG_INFO(msg) RDT_LOG(msg)
+#else
+#define LOG_INFO(msg) RDT_NO_LOG(msg)
+#endif
+
+#if RDT_LOG_LEVEL >= RDT_LOG_DEBUG
+#define LOG_DEBUG(msg) RDT_LOG(msg)
+#else
+#define LOG_DEBUG(msg) RDT_NO_LOG(msg)
+#endif
+
+#define RDT_TRACE_MAGIC 0x52544452 // "RDTR"
+#define RDT_TRACE_VERSION 1
+#define RDT_TRACE_RECORDS 1024 // Default size of a connection's trace ring
+
+enum rdt_trace_event_t {
+    RDT_TRACE_SEND = 1,        // packet sent
+    RDT_TRACE_RECEIVE,         // valid packet received
+    RDT_TRACE_DROP,            // packet discarded
+    RDT_TRACE_DROP_LOSS,       // packet lost (simulated)
+    RDT_TRACE_DROP_CORRUPT,    // packet failed its checksum
+    RDT_TRACE_RETRANSMIT,      // seq timed out, resending from it
+    RDT_TRACE_RECEIVE_TIMEOUT, // nothing arrived for a while, seq is what we have
+    RDT_TRACE_REBUILT,         // segment ending at seq rebuilt from FEC parity
+    RDT_TRACE_PACING_WAIT,     // sending from seq held back by pacing
+    RDT_TRACE_MTU,             // path MTU is now seq bytes
+    RDT_TRACE_CONNECTED,
+    RDT_TRACE_CLOSED,
+    RDT_TRACE_MAX_EVENT
+};
+
+/**
+ * A single traced event. Packet events carry the packet's header fields,
+ * the others whatever seq/ack mean for them.
+ */
+struct rdt_trace_record_t {
+    uint64_t time_usec;  // since the epoch
+    uint64_t seq;
+    uint64_t ack;
+    uint32_t window;     // window the packet advertised, in bytes (saturated)
+    uint32_t in_flight;  // bytes we were waiting to have ACKed (saturated)
+    uint16_t event;
+    uint16_t flags;      // packet flags
+    uint16_t data_len;
+    uint16_t reserved;
+};
+
+// Leads a trace dump, followed by count records, oldest first
+struct rdt_trace_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t conn_id;
+    uint32_t count;
+    uint64_t overwritten; // older records the ring no longer had room for
+};
+
+char const *rdt_trace_event_name( uint16_t event );
+
+#endif
@@ -1,37 +1,524 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring> // memset, etc.
+#include <sstream> // std::stringstream
+#include <fstream> // std::ifstream, std::ofstream
 #include <signal.h>
+#include <fcntl.h> // open
+#include <unistd.h> // STDOUT_FILENO
+#include <sys/stat.h> // fstat
+#include <cstdio> // rename
 #include <netdb.h> // hostent, etc.
 #include <arpa/inet.h> // inet_htop
+#include <pthread.h>
+#include <poll.h>
+#include <vector> // std::vector
+#include <map> // std::map
 #include "RDTConnection.h"
 
 #define DEFAULT_PORT 9529
 #define WINDOW_SIZE 1024
+#define STRIPE_RANGE (1024 * 1024) // Default bytes per range of a striped fetch
+#define CHECKPOINT_INTERVAL (8 * 1024 * 1024) // Bytes a stripe receives between saves of the checkpoint
 
-RDTConnection *conn = NULL;
+int stats_fd = -1;
 
-void sig_handler( int signal ) {
-    std::cout << "Caught signal " << signal << ", exiting" << std::endl;
+// A stripe of the file fetched by a thread of its own
+struct stripe_fetch_t {
+    std::string ip_addr;
+    int port;
+    std::string request;
+    rdt_stripe_t stripe; // stripe.start is where a resumed fetch picks up
+    double pdrop;
+    double pcorrupt;
+    bool resumable;
+    std::string content_id; // of the file we have part of, "-" if none. Then as the server says
+    uint64_t content_size;
+    uint64_t received;      // bytes of the stripe we have, earlier attempts included
+    bool ok;
+};
 
-    if(conn) {
+// The checkpoint of a resumable fetch, while one runs. The stripe threads save
+// it as they go and wait_for_signal() when the fetch is stopped.
+struct checkpoint_t {
+    char const *path;
+    uint64_t range_size;
+    std::vector<stripe_fetch_t> *fetches; // NULL once the fetch is over
+    pthread_mutex_t lock; // held while the fetches' progress changes or is saved
+};
+
+checkpoint_t resume = { NULL, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+// What main() asked for, fetched on a thread of its own
+struct fetch_t {
+    std::string ip_addr;
+    int port;
+    std::string file_name;
+    int stripes;
+    uint64_t range_size;
+    double pdrop;
+    double pcorrupt;
+    char const *checkpoint;
+};
+
+void save_checkpoint( char const *path, std::vector<stripe_fetch_t> const &fetches, uint64_t range_size );
+
+/**
+ * Blocks the signals that stop the fetch in the calling thread and every
+ * thread it starts from then on, wait_for_signal() takes them instead
+ */
+void block_signals( sigset_t &signals ) {
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+/**
+ * Waits for one of the signals to arrive, then saves the checkpoint of a
+ * resumable fetch and exits. Runs as a regular thread, so it may take the
+ * checkpoint's lock. Reports on stderr, stdout may be the file being fetched.
+ */
+void wait_for_signal( sigset_t const &signals ) {
+    int sig = 0;
+    while (sigwait(&signals, &sig) != 0)
+        ;
+
+    std::cerr << "Caught signal " << sig << ", exiting" << std::endl;
+
+    pthread_mutex_lock(&resume.lock);
+    if (resume.fetches) {
+        save_checkpoint(resume.path, *resume.fetches, resume.range_size);
+        std::cerr << "Progress saved to " << resume.path << ", run again to resume" << std::endl;
+    }
+
+    exit(sig);
+}
+
+/**
+ * Saves the connection's event trace to $RDT_TRACE_DIR, if set, for rdt_trace to decode
+ */
+void save_trace( RDTConnection *conn, rdt_stripe_t const &stripe ) {
+    char const *dir = getenv("RDT_TRACE_DIR");
+    if (!dir)
+        return;
+
+    std::stringstream path;
+    path << dir << "/receiver-" << getpid();
+    if (stripe.striped())
+        path << "-" << stripe.index;
+    conn->save_trace(path.str());
+}
+
+void stripe_received( RDTConnection &, bool success, void *context ) {
+    *(bool *)context = success;
+}
+
+/**
+ * Receives the stripe into stdout, driving the connection itself rather than
+ * through receive_to_fd() to keep track of what was written as it goes. A
+ * resumable fetch saves its checkpoint every CHECKPOINT_INTERVAL bytes, so a
+ * crash or kill loses no more than that of each stripe.
+ */
+bool receive_stripe( RDTConnection &stripe_conn, stripe_fetch_t *fetch ) {
+    bool success = false;
+    if (!stripe_conn.start_receive_to_fd(STDOUT_FILENO, fetch->stripe, stripe_received, &success))
+        return false;
+
+    uint64_t saved = fetch->received;
+    while (stripe_conn.busy()) {
+        pollfd readable;
+        readable.fd = stripe_conn.fd();
+        readable.events = POLLIN;
+        readable.revents = 0;
+
+        long timeout = stripe_conn.next_timeout();
+        if (poll(&readable, 1, timeout < 0 ? -1 : (timeout + 999) / 1000) > 0)
+            stripe_conn.on_readable();
+
+        if (stripe_conn.busy() && stripe_conn.next_timeout() == 0)
+            stripe_conn.on_timer();
+
+        // Bytes still buffered in the connection aren't in the output yet
+        rdt_stats_t stats = stripe_conn.stats();
+        pthread_mutex_lock(&resume.lock);
+        fetch->received = fetch->stripe.start + stats.transfer_bytes - stats.receive_buffered;
+        if (fetch->resumable && resume.fetches && fetch->received - saved >= CHECKPOINT_INTERVAL) {
+            save_checkpoint(resume.path, *resume.fetches, resume.range_size);
+            saved = fetch->received;
+        }
+        pthread_mutex_unlock(&resume.lock);
+    }
+
+    return success;
+}
+
+void *fetch_stripe( void *arg ) {
+    stripe_fetch_t *fetch = (stripe_fetch_t *)arg;
+    RDTConnection stripe_conn(WINDOW_SIZE, fetch->pdrop, fetch->pcorrupt);
+    stripe_conn.set_stats_log(stats_fd);
+
+    pthread_mutex_lock(&resume.lock);
+    fetch->received = fetch->stripe.start;
+    pthread_mutex_unlock(&resume.lock);
+
+    fetch->ok = stripe_conn.connect_with_request(fetch->ip_addr, fetch->port, fetch->request);
+
+    // Resumable fetches first hear which version of the file they get. The
+    // server starts a different one than we have part of over.
+    if (fetch->ok && fetch->resumable) {
+        std::string header, content_id;
+        uint64_t content_size = 0;
+        fetch->ok = stripe_conn.receive_data(header);
+
+        std::stringstream ss(header);
+        fetch->ok = fetch->ok && (ss >> content_id >> content_size);
+
+        pthread_mutex_lock(&resume.lock);
+        if (fetch->ok && content_id != fetch->content_id)
+            fetch->stripe.start = fetch->received = 0;
+        if (fetch->ok) {
+            fetch->content_id = content_id;
+            fetch->content_size = content_size;
+        }
+        pthread_mutex_unlock(&resume.lock);
+    }
+
+    if (fetch->ok)
+        fetch->ok = receive_stripe(stripe_conn, fetch);
+
+    stripe_conn.close();
+    save_trace(&stripe_conn, fetch->stripe);
+    return NULL;
+}
+
+/**
+ * Resumable fetches keep their progress in a checkpoint file between attempts,
+ * a single line: "content_id content_size stripes range_size received..." with
+ * the bytes we have of every stripe. Picks up where the checkpoint left off if
+ * it describes the same striping and the output still holds what it says.
+ */
+void load_checkpoint( char const *path, std::vector<stripe_fetch_t> &fetches, uint64_t range_size, off_t output_start ) {
+    std::ifstream in(path);
+    std::string content_id;
+    uint64_t content_size, checkpoint_range;
+    size_t stripes;
+
+    if (!(in >> content_id >> content_size >> stripes >> checkpoint_range))
+        return;
+
+    if (stripes != fetches.size() || checkpoint_range != range_size) {
+        std::cerr << "Checkpoint " << path << " is for " << stripes << " stripes of " << checkpoint_range << " byte ranges, starting over" << std::endl;
+        return;
+    }
+
+    std::vector<uint64_t> received(stripes);
+    uint64_t end = 0;
+    for (size_t i = 0; i < stripes; i++) {
+        if (!(in >> received[i]))
+            return;
+        if (received[i] > 0)
+            end = std::max(end, fetches[i].stripe.file_offset(received[i] - 1) + 1);
+    }
+
+    struct stat output_stat;
+    if (fstat(STDOUT_FILENO, &output_stat) == -1 || output_stat.st_size < output_start + (off_t)end) {
+        std::cerr << "Output is shorter than checkpoint " << path << " says, starting over" << std::endl;
+        return;
+    }
+
+    for (size_t i = 0; i < stripes; i++) {
+        fetches[i].content_id = content_id;
+        fetches[i].stripe.start = received[i];
+    }
+}
+
+/**
+ * Records how far the fetches got. Only one version of the file can be
+ * resumed, stripes which got another one (it changed between connections)
+ * start over next time.
+ */
+void save_checkpoint( char const *path, std::vector<stripe_fetch_t> const &fetches, uint64_t range_size ) {
+    stripe_fetch_t const *newest = &fetches[0];
+    for (size_t i = 0; i < fetches.size(); i++) {
+        if (fetches[i].content_id != "-") {
+            newest = &fetches[i];
+            break;
+        }
+    }
+
+    std::stringstream line;
+    line << newest->content_id << " " << newest->content_size << " " << fetches.size() << " " << range_size;
+    for (size_t i = 0; i < fetches.size(); i++)
+        line << " " << (fetches[i].content_id == newest->content_id ? fetches[i].received : 0);
+
+    // Replace the old checkpoint in one go, so it is never half written
+    std::string tmp_path = std::string(path) + ".tmp";
+    std::ofstream out(tmp_path.c_str());
+    out << line.str() << std::endl;
+    out.close();
+
+    if (!out || rename(tmp_path.c_str(), path) == -1)
+        std::cerr << "Failed to save checkpoint " << path << std::endl;
+}
+
+/**
+ * Fetches the file striped across several connections at once (or a single
+ * one), each on a thread of its own writing its ranges straight into stdout,
+ * which has to be a regular file. The stripe is requested after the file name,
+ * see Sender.cpp.
+ *
+ * Given a checkpoint file, the fetch is resumable: the fetch saves how far it
+ * got there as it goes and once it fails or is stopped by a signal, and running
+ * it again with the same output only fetches the rest.
+ */
+bool fetch_striped( std::string const &ip_addr, int port, std::string const &file_name, int stripes, uint64_t range_size, double pdrop, double pcorrupt, char const *checkpoint ) {
+    std::vector<stripe_fetch_t> fetches(stripes);
+    std::vector<pthread_t> threads(stripes);
+    off_t output_start = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+
+    for (int i = 0; i < stripes; i++) {
+        fetches[i].ip_addr = ip_addr;
+        fetches[i].port = port;
+        fetches[i].stripe = rdt_stripe_t(i, stripes, range_size);
+        fetches[i].pdrop = pdrop;
+        fetches[i].pcorrupt = pcorrupt;
+        fetches[i].resumable = checkpoint != NULL;
+        fetches[i].content_id = "-";
+        fetches[i].content_size = 0;
+        fetches[i].received = 0;
+        fetches[i].ok = false;
+    }
+
+    if (checkpoint) {
+        load_checkpoint(checkpoint, fetches, range_size, output_start);
+
+        pthread_mutex_lock(&resume.lock);
+        for (int i = 0; i < stripes; i++)
+            fetches[i].received = fetches[i].stripe.start;
+        resume.path = checkpoint;
+        resume.range_size = range_size;
+        resume.fetches = &fetches;
+        pthread_mutex_unlock(&resume.lock);
+    }
+
+    for (int i = 0; i < stripes; i++) {
+        std::stringstream stripe_spec;
+        stripe_spec << i << " " << stripes << " " << range_size;
+        if (fetches[i].resumable)
+            stripe_spec << " " << fetches[i].stripe.start << " " << fetches[i].content_id;
+
+        fetches[i].request = file_name + '\0' + stripe_spec.str();
+        pthread_create(&threads[i], NULL, fetch_stripe, &fetches[i]);
+    }
+
+    bool ok = true;
+    for (int i = 0; i < stripes; i++) {
+        pthread_join(threads[i], NULL);
+        if (!fetches[i].ok)
+            std::cerr << "Fetching stripe " << i << " of " << stripes << " failed" << std::endl;
+        ok = ok && fetches[i].ok;
+    }
+
+    // A signal from now on has nothing to save, or saves what we save here
+    pthread_mutex_lock(&resume.lock);
+    resume.fetches = NULL;
+
+    if (checkpoint && ok) {
+        // The output may hold a longer version of the file from before
+        struct stat output_stat;
+        off_t end = output_start + fetches[0].content_size;
+        if (fstat(STDOUT_FILENO, &output_stat) == 0 && output_stat.st_size > end && ftruncate(STDOUT_FILENO, end) == -1)
+            std::cerr << "Failed to truncate the output" << std::endl;
+        unlink(checkpoint);
+    } else if (checkpoint) {
+        save_checkpoint(checkpoint, fetches, range_size);
+        std::cerr << "Progress saved to " << checkpoint << ", run again to resume" << std::endl;
+    }
+    pthread_mutex_unlock(&resume.lock);
+
+    return ok;
+}
+
+/**
+ * Fetches every file a manifest lists, one name per line, over a single
+ * connection. They are asked for in one batch request and arrive
+ * RDT_MAX_STREAMS at a time (see Sender.cpp), each saved under its base name
+ * in the current directory. Files the server can't serve are reported and
+ * skipped. Manifests listing two files with the same base name are refused
+ * before anything is fetched, one would overwrite the other.
+ */
+bool fetch_batch( std::string const &ip_addr, int port, char const *manifest, double pdrop, double pcorrupt ) {
+    std::ifstream in(manifest);
+    std::vector<std::string> files;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty())
+            files.push_back(line);
+    }
+
+    if (files.empty()) {
+        std::cerr << "Manifest " << manifest << " lists no files" << std::endl;
+        return false;
+    }
+
+    std::map<std::string, std::string> local_names; // base name -> the file saved as it
+    bool collisions = false;
+    for (size_t i = 0; i < files.size(); i++) {
+        std::string local_name = files[i].substr(files[i].find_last_of('/') + 1);
+        std::pair<std::map<std::string, std::string>::iterator, bool> added =
+            local_names.insert(std::make_pair(local_name, files[i]));
+
+        if (!added.second) {
+            std::cerr << files[i] << " and " << added.first->second << " would both be saved as " << local_name << std::endl;
+            collisions = true;
+        }
+    }
+
+    if (collisions) {
+        std::cerr << "Manifest " << manifest << " lists files with the same name, aborting" << std::endl;
+        return false;
+    }
+
+    std::string request = std::string(1, '\0') + "batch\n";
+    for (size_t i = 0; i < files.size(); i++)
+        request += files[i] + "\n";
+
+    RDTConnection *conn = new RDTConnection(WINDOW_SIZE, pdrop, pcorrupt);
+    conn->set_stats_log(stats_fd);
+
+    if (!conn->connect_with_request(ip_addr, port, request)) {
+        std::cout << "Connection failed, aborting" << std::endl;
         delete conn;
-        conn = NULL;
+        return false;
     }
 
-    exit(signal);
+    size_t fetched = 0;
+    bool connected = true;
+    for (size_t first = 0; first < files.size() && connected; first += RDT_MAX_STREAMS) {
+        size_t end = std::min(files.size(), first + RDT_MAX_STREAMS);
+        std::vector<int> fds(end - first, -1);
+        std::vector<uint64_t> sizes(end - first, 0);
+        std::vector<bool> saving(end - first, false);
+        std::string status;
+        bool streams = false;
+
+        connected = conn->receive_data(status);
+        std::stringstream lines(status);
+
+        // Files found (but empty) come as streams of the next transfer, in order
+        for (size_t i = first; i < end && connected; i++) {
+            std::string code;
+            std::getline(lines, line);
+            std::stringstream ss(line);
+
+            if (!(ss >> code) || code != "ok" || !(ss >> sizes[i - first])) {
+                std::cerr << files[i] << ": " << (code == "not_found" ? "not found" : "failed") << std::endl;
+                continue;
+            }
+
+            // The content comes either way, somewhere has to take it
+            std::string local_name = files[i].substr(files[i].find_last_of('/') + 1);
+            fds[i - first] = open(local_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            saving[i - first] = fds[i - first] != -1;
+            if (!saving[i - first]) {
+                std::cerr << "Failed to open " << local_name << ", discarding " << files[i] << std::endl;
+                fds[i - first] = open("/dev/null", O_WRONLY);
+            }
+
+            if (sizes[i - first] > 0) {
+                conn->read_stream_fd(conn->open_stream(), fds[i - first]);
+                streams = true;
+            }
+        }
+
+        if (connected && streams)
+            connected = conn->receive_streams();
+
+        for (size_t i = first; i < end; i++) {
+            struct stat file_stat;
+            int fd = fds[i - first];
+            if (fd == -1)
+                continue;
+
+            if (saving[i - first] && connected && fstat(fd, &file_stat) == 0 && (uint64_t)file_stat.st_size == sizes[i - first]) {
+                std::cout << files[i] << ": " << sizes[i - first] << " bytes" << std::endl;
+                fetched++;
+            } else {
+                std::cerr << files[i] << ": failed" << std::endl;
+            }
+            close(fd);
+        }
+    }
+
+    conn->close();
+    save_trace(conn, rdt_stripe_t());
+
+    delete conn;
+
+    std::cout << "Fetched " << fetched << " of " << files.size() << " files" << std::endl;
+    return fetched == files.size();
+}
+
+/**
+ * Fetches the file over a single connection, writing it to stdout as it arrives
+ */
+bool fetch_file( std::string const &ip_addr, int port, std::string const &file_name, double pdrop, double pcorrupt ) {
+    RDTConnection conn(WINDOW_SIZE, pdrop, pcorrupt);
+    conn.set_stats_log(stats_fd);
+
+    // The file name rides on the SYN, so the file starts coming one round trip in
+    if (!conn.connect_with_request(ip_addr, port, file_name)) {
+        std::cout << "Connection failed, aborting" << std::endl;
+        return false;
+    }
+
+    // Write the file to stdout as it arrives rather than buffering all of it
+    std::cout.flush();
+    conn.receive_to_fd(STDOUT_FILENO);
+    conn.close();
+    save_trace(&conn, rdt_stripe_t());
+
+    return true;
+}
+
+/**
+ * Runs the fetch main() asked for, then exits with how it went
+ */
+void *fetch_main( void *arg ) {
+    fetch_t *fetch = (fetch_t *)arg;
+    bool ok;
+
+    // "@manifest" fetches every file the manifest lists
+    if (!fetch->file_name.empty() && fetch->file_name[0] == '@')
+        ok = fetch_batch(fetch->ip_addr, fetch->port, fetch->file_name.c_str() + 1, fetch->pdrop, fetch->pcorrupt);
+    else if (fetch->stripes > 1 || fetch->checkpoint)
+        ok = fetch_striped(fetch->ip_addr, fetch->port, fetch->file_name, fetch->stripes, fetch->range_size, fetch->pdrop, fetch->pcorrupt, fetch->checkpoint);
+    else
+        ok = fetch_file(fetch->ip_addr, fetch->port, fetch->file_name, fetch->pdrop, fetch->pcorrupt);
+
+    exit(ok ? 0 : -1);
 }
 
 int main( int argc, char** argv ) {
-    signal( SIGHUP, sig_handler );
-    signal( SIGINT, sig_handler );
-    signal( SIGTERM, sig_handler );
+    // Before any thread starts, so all of them leave the signals to us
+    sigset_t signals;
+    block_signals(signals);
 
     std::string hostname = "localhost";
     int port = DEFAULT_PORT;
     std::string file_name = "index.html";
     double pdrop = 0;
     double pcorrupt = 0;
+    int stripes = 1;
+    uint64_t range_size = STRIPE_RANGE;
+
+    // The stripe count and range size are optional, after the rest
+    if (argc > 7)
+        range_size = strtoull(argv[--argc], NULL, 10);
+    if (argc > 6)
+        stripes = atoi(argv[--argc]);
 
     switch (std::min(argc, 5)) {
         case 5:
@@ -60,18 +547,41 @@ int main( int argc, char** argv ) {
         exit(-1);
     }
 
-    conn = new RDTConnection(WINDOW_SIZE, pdrop, pcorrupt);
+    // JSON stats snapshots of the transfer, one per line
+    char const *stats_file = getenv("RDT_STATS_FILE");
+    if (stats_file && (stats_fd = open(stats_file, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+        std::cerr << "Failed to open stats file " << stats_file << std::endl;
 
-    if (!conn->connect(ip_addr, port)) {
-        std::cout << "Connection failed, aborting" << std::endl;
-        exit(-1);
+    // Fetches are resumable given a checkpoint file. The output has to be opened
+    // without truncating it to resume (e.g. 1<>file rather than >file).
+    char const *checkpoint = getenv("RDT_RESUME_FILE");
+
+    stripes = std::max(1, std::min(RDT_MAX_STRIPES, stripes));
+    if (range_size == 0) {
+        stripes = 1;
+        range_size = STRIPE_RANGE;
     }
 
-    std::string server_data;
-    conn->send_data(file_name);
-    conn->receive_data(server_data);
-    conn->close();
+    if ((stripes > 1 || checkpoint) && lseek(STDOUT_FILENO, 0, SEEK_CUR) == -1) {
+        std::cerr << "Striping and resuming need stdout redirected to a file, fetching over a single connection" << std::endl;
+        stripes = 1;
+        checkpoint = NULL;
+    }
 
-    std::cout << server_data;
+    fetch_t fetch;
+    fetch.ip_addr = ip_addr;
+    fetch.port = port;
+    fetch.file_name = file_name;
+    fetch.stripes = stripes;
+    fetch.range_size = range_size;
+    fetch.pdrop = pdrop;
+    fetch.pcorrupt = pcorrupt;
+    fetch.checkpoint = checkpoint;
+
+    pthread_t fetcher;
+    pthread_create(&fetcher, NULL, fetch_main, &fetch);
+
+    // The fetch exits once it is done, unless a signal stops it first
+    wait_for_signal(signals);
     return 0;
-}
\ No newline at end of file
+}
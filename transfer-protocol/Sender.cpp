@@ -1,32 +1,272 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring> // memset, etc.
+#include <sstream> // std::stringstream
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
-#include "RDTConnection.h"
+#include <pthread.h>
+#include <sys/stat.h> // fstat
+#include <vector> // std::vector
+#include "RDTServer.h"
 
 #define DEFAULT_PORT 9529
 #define WINDOW_SIZE 1024
-#define MAX_BUF_SIZE 8192
+#define NUM_WORKERS RDT_MAX_STRIPES // Transfers each shard serves concurrently, a striped fetch takes one per stripe
+#define MAX_SHARDS 64
 
-RDTConnection *server = NULL;
+std::vector<RDTServer *> shards;
+int traces_saved = 0;
+int stats_fd = -1;
 
-void sig_handler( int signal ) {
-    std::cout << "Caught signal " << signal << ", exiting" << std::endl;
+/**
+ * Blocks the signals that stop the server in the calling thread and every
+ * thread it starts from then on, so none of them is interrupted in the middle
+ * of holding a lock. wait_for_signal() takes them instead.
+ */
+void block_signals( sigset_t &signals ) {
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+/**
+ * Waits for one of the signals to arrive, then shuts the shards down and
+ * exits. Runs as a regular thread, so closing the shards may lock and join.
+ */
+void wait_for_signal( sigset_t const &signals ) {
+    int sig = 0;
+    while (sigwait(&signals, &sig) != 0)
+        ;
+
+    std::cout << "Caught signal " << sig << ", exiting" << std::endl;
+
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->close();
+
+    exit(sig);
+}
+
+// What a client asked for
+struct request_t {
+    std::string file_name;
+    rdt_stripe_t stripe;    // stripe.start is where a resumed fetch picks up
+    bool resumable;
+    std::string content_id; // of the file the fetch being resumed got its start from
+    bool batch;
+    std::vector<std::string> files; // a batch asks for, in order
+};
+
+/**
+ * Requests are a file name, optionally followed by a NUL and the stripe of the
+ * file wanted as "index count range_size". Resumable fetches add how much of
+ * the stripe they have and the content id of the file that came from ("0 -" to
+ * begin with). Returns false if the stripe is invalid.
+ *
+ * Batches have no file name, "batch" follows the NUL and then the names of the
+ * files wanted, one per line.
+ */
+bool parse_request( std::string const &data, request_t &request ) {
+    size_t end = data.find('\0');
+    request.file_name = data.substr(0, end);
+    request.stripe = rdt_stripe_t();
+    request.resumable = false;
+    request.batch = false;
+    request.files.clear();
+
+    if (end == std::string::npos)
+        return true;
+
+    if (data.compare(end + 1, 6, "batch\n") == 0) {
+        std::stringstream names(data.substr(end + 7));
+        std::string name;
+        while (std::getline(names, name)) {
+            if (!name.empty())
+                request.files.push_back(name);
+        }
+
+        request.batch = true;
+        return true;
+    }
+
+    rdt_stripe_t &stripe = request.stripe;
+    std::stringstream ss(data.substr(end + 1));
+    if (!(ss >> stripe.index >> stripe.count >> stripe.range_size) || stripe.count < 1
+            || stripe.count > RDT_MAX_STRIPES || stripe.index < 0 || stripe.index >= stripe.count
+            || stripe.range_size == 0)
+        return false;
+
+    request.resumable = (bool)(ss >> stripe.start >> request.content_id);
+    if (!request.resumable)
+        stripe.start = 0;
+    return true;
+}
+
+/**
+ * Tells versions of a file apart, so fetches never resume on a different one
+ */
+std::string content_id( struct stat const &file_stat ) {
+    std::stringstream id;
+    id << file_stat.st_size << "-" << file_stat.st_mtim.tv_sec << "." << file_stat.st_mtim.tv_nsec;
+    return id.str();
+}
+
+/**
+ * Sends the files of a batch from first on, up to RDT_MAX_STREAMS of them: a
+ * status line for each ("ok size", "not_found" or "error"), then the files
+ * found (but empty) side by side in one stream transfer. Returns false once
+ * the connection fails, a file which can't be served only fails itself.
+ */
+bool serve_batch_files( RDTConnection *conn, std::vector<std::string> const &files, size_t first ) {
+    size_t end = std::min(files.size(), first + RDT_MAX_STREAMS);
+    std::vector<int> fds;
+    std::stringstream status;
+    bool streams = false;
+
+    for (size_t i = first; i < end; i++) {
+        struct stat file_stat;
+        int fd = open(files[i].c_str(), O_RDONLY);
+
+        if (fd == -1 && (errno == ENOENT || errno == ENOTDIR)) {
+            status << "not_found\n";
+        } else if (fd == -1 || fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+            status << "error\n";
+        } else {
+            status << "ok " << file_stat.st_size << "\n";
+            if (file_stat.st_size > 0) {
+                conn->write_stream_fd(conn->open_stream(), fd, 0, file_stat.st_size);
+                streams = true;
+            }
+
+            fds.push_back(fd);
+            continue;
+        }
+
+        std::cout << "Invalid file \"" << files[i] << "\" requested in a batch" << std::endl;
+        if (fd != -1)
+            close(fd);
+    }
+
+    bool ok = conn->send_data(status.str()) && (!streams || conn->send_streams());
+
+    for (size_t i = 0; i < fds.size(); i++)
+        close(fds[i]);
+    return ok;
+}
+
+/**
+ * Serves batch requests over an accepted connection until the client closes
+ * it, so fetching many files costs a single handshake. Sending the files of a
+ * batch as streams of a few transfers rather than one after the other takes a
+ * couple of round trips per RDT_MAX_STREAMS files instead of per file, and
+ * keeps small files from waiting behind large ones.
+ */
+void serve_batch( RDTConnection *conn, request_t &request ) {
+    conn->set_fec(RDT_FEC_BLOCK, RDT_FEC_MAX_PARITY);
+    conn->set_compression(true);
 
-    if(server) {
-        delete server;
-        server = NULL;
+    std::string remote_msg;
+    bool ok = true;
+    do {
+        for (size_t i = 0; i < request.files.size() && ok; i += RDT_MAX_STREAMS)
+            ok = serve_batch_files(conn, request.files, i);
+    } while (ok && conn->receive_data(remote_msg) && parse_request(remote_msg, request) && request.batch);
+
+    conn->close();
+}
+
+/**
+ * Serves the file (or the stripe of it) requested over an accepted connection,
+ * or every batch the client asks for over it
+ */
+void serve_request( RDTConnection *conn ) {
+    std::string remote_msg;
+    request_t request;
+    conn->receive_data(remote_msg);
+
+    bool valid = parse_request(remote_msg, request);
+    if (valid && request.batch) {
+        serve_batch(conn, request);
+        return;
+    }
+
+    struct stat file_stat;
+    int fd = -1;
+    if (!valid || (fd = open(request.file_name.c_str(), O_RDONLY)) == -1 || fstat(fd, &file_stat) == -1) {
+        std::cout << "Invalid file \"" << request.file_name << "\" requested" << std::endl;
+        if (fd != -1)
+            close(fd);
+        conn->close();
+        return;
+    }
+
+    // Parity only goes out once we start seeing losses, so this is free on clean links
+    conn->set_fec(RDT_FEC_BLOCK, RDT_FEC_MAX_PARITY);
+
+    // Clients which take it get compressed segments, unless the file doesn't compress
+    conn->set_compression(true);
+
+    // Resumable fetches first get the content id and size of the file, on its
+    // own. Those resuming a different version of it start over.
+    if (request.resumable) {
+        std::stringstream header;
+        header << content_id(file_stat) << " " << file_stat.st_size;
+        if (request.content_id != content_id(file_stat))
+            request.stripe.start = 0;
+
+        if (!conn->send_data(header.str())) {
+            close(fd);
+            return;
+        }
+    }
+
+    // Clients which sent their request on the SYN also take our FIN on the EOF
+    conn->set_close_on_EOF(true);
+
+    // Stream the file straight from disk instead of loading it into memory
+    conn->send_fd(fd, 0, file_stat.st_size, request.stripe);
+    conn->close();
+    close(fd);
+}
+
+/**
+ * Saves the connection's event trace to $RDT_TRACE_DIR, if set, for rdt_trace to decode
+ */
+void save_trace( RDTConnection *conn ) {
+    char const *dir = getenv("RDT_TRACE_DIR");
+    if (!dir)
+        return;
+
+    std::stringstream path;
+    path << dir << "/sender-" << getpid() << "-" << __sync_fetch_and_add(&traces_saved, 1);
+    conn->save_trace(path.str());
+}
+
+/**
+ * Worker thread: keeps picking up whichever connection its shard accepts
+ * next, so one slow client only ever ties up a single worker
+ */
+void *worker_main( void *shard ) {
+    RDTServer *server = (RDTServer *)shard;
+    RDTConnection *conn;
+
+    while ((conn = server->accept()) != NULL) {
+        conn->set_stats_log(stats_fd);
+        serve_request(conn);
+        save_trace(conn);
+        delete conn;
     }
 
-    exit(signal);
+    return NULL;
 }
 
 int main( int argc, char **argv ) {
-    signal( SIGHUP, sig_handler );
-    signal( SIGINT, sig_handler );
-    signal( SIGTERM, sig_handler );
+    // Before any thread starts, they all inherit the mask
+    sigset_t signals;
+    block_signals(signals);
 
     int port = DEFAULT_PORT;
     int cwnd = WINDOW_SIZE;
@@ -47,44 +287,57 @@ int main( int argc, char **argv ) {
             break;
     }
 
-    server = new RDTConnection(cwnd, pdrop, pcorrupt);
+    // JSON stats snapshots of every transfer, one per line
+    char const *stats_file = getenv("RDT_STATS_FILE");
+    if (stats_file && (stats_fd = open(stats_file, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+        std::cout << "Failed to open stats file " << stats_file << std::endl;
 
-    if (!server->listen(port)) {
-        std::cout << "server listen failed, aborting" << std::endl;
-        delete server;
-        server = NULL;
-        exit(-1);
-    } else {
-        std::cout << "Listening on port " << server->port_number() << std::endl;
-    }
+    // Shards listen on the same port (SO_REUSEPORT), each with a socket and
+    // workers of its own, optionally pinned to a CPU of its own. The kernel
+    // spreads connections across them by peer address or, if steered, by
+    // connection id.
+    char const *shards_env = getenv("RDT_SHARDS");
+    int num_shards = shards_env ? std::max(1, std::min(MAX_SHARDS, atoi(shards_env))) : 1;
+    int num_cpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    bool pin = getenv("RDT_PIN_SHARDS") != NULL;
 
-    std::string remote_msg;
-    char buf[MAX_BUF_SIZE+1];
-    memset(buf, 0, MAX_BUF_SIZE+1);
+    for (int i = 0; i < num_shards; i++) {
+        RDTServer *shard = new RDTServer(cwnd, pdrop, pcorrupt);
+        shard->set_reuse_port(num_shards > 1);
+        if (pin)
+            shard->set_cpu(i % num_cpus);
 
-    while (true) {
-        if (!server->accept())
-            continue;
+        if (!shard->listen(port)) {
+            std::cout << "server listen failed, aborting" << std::endl;
+            delete shard;
+            for (size_t j = 0; j < shards.size(); j++)
+                delete shards[j];
+            shards.clear();
+            exit(-1);
+        }
 
-        server->receive_data(remote_msg);
+        // The rest join whichever port the first one got
+        port = shard->port_number();
+        shards.push_back(shard);
+    }
 
-        int fd = open(remote_msg.c_str(), O_RDONLY);
-        if (fd == -1) {
-            std::cout << "Invalid file \"" << remote_msg << "\" requested" << std::endl;
-            server->close();
-            continue;    
-        }
+    if (num_shards > 1 && getenv("RDT_STEER_CONN_ID") && !shards[0]->steer_by_conn_id(num_shards))
+        std::cout << "Failed to steer connections by id, shards go by peer address" << std::endl;
 
-        int read_len = 0;
-        std::string file_contents = "";
-        while( (read_len = read(fd, buf, MAX_BUF_SIZE)) > 0) {
-            file_contents.append(buf, read_len);
-            memset(buf, 0, MAX_BUF_SIZE);
-        }
+    std::cout << "Listening on port " << port;
+    if (num_shards > 1)
+        std::cout << " with " << num_shards << " shards";
+    std::cout << std::endl;
 
-        server->send_data(file_contents);
-        server->close();
+    std::vector<pthread_t> workers(num_shards * NUM_WORKERS);
+    for (size_t i = 0; i < workers.size(); i++) {
+        int shard = i / NUM_WORKERS;
+        pthread_create(&workers[i], NULL, worker_main, shards[shard]);
+        if (pin)
+            RDTServer::pin_thread(workers[i], shard % num_cpus);
     }
 
+    // The workers serve until a signal stops the server
+    wait_for_signal(signals);
     return 0;
 }
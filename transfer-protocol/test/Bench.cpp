@@ -0,0 +1,321 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../RDTConnection.h"
+#include "../RDTServer.h"
+
+#define DEFAULT_SIZES "1M,8M"
+#define DEFAULT_WINDOWS "16K,256K"
+#define DEFAULT_LOSSES "0,0.01,0.05"
+#define DEFAULT_CORRUPTIONS "0,0.01"
+#define DEFAULT_FEC "0,1"
+#define DEFAULT_TIMEOUT_SEC 120
+
+/**
+ * Throughput/latency benchmark matrix. Sweeps file size, window size, loss
+ * rate, corruption rate and FEC mode, transferring a random payload from a
+ * server session to a client over loopback for every combination. Loss and
+ * corruption are simulated on both ends, just like sender/receiver do.
+ *
+ * Every run happens in a child process of its own, so a transfer which
+ * stalls can be killed once it exceeds the timeout, and the CPU time
+ * measured (both ends, user and system) belongs to that run alone.
+ *
+ * Results are printed as they come in and written to <prefix>.csv and
+ * <prefix>.json for comparing builds.
+ */
+struct bench_case_t {
+    size_t size;
+    size_t window;
+    double loss;
+    double corrupt;
+    int fec;
+    int run;
+};
+
+struct bench_result_t {
+    bool ok;
+    double seconds;      // connect through the last byte received
+    double cpu_seconds;  // both ends
+    size_t segments;     // data segments the sender sent
+    size_t retransmits;  // of which retransmissions
+};
+
+struct server_args_t {
+    RDTServer *server;
+    std::string const *payload;
+    bench_case_t const *bench;
+    size_t segments;
+    size_t retransmits;
+};
+
+/**
+ * Parses sizes like 64K or 16M
+ */
+size_t parse_size( std::string const &arg ) {
+    char *end;
+    double value = strtod(arg.c_str(), &end);
+
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; break;
+        case 'm': case 'M': value *= 1024 * 1024; break;
+        case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+    }
+
+    return (size_t)value;
+}
+
+std::vector<std::string> split( std::string const &arg ) {
+    std::vector<std::string> items;
+    std::stringstream ss(arg);
+    std::string item;
+
+    while (std::getline(ss, item, ','))
+        items.push_back(item);
+
+    return items;
+}
+
+double elapsed( timeval const &start, timeval const &end ) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+double cpu_time() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    timeval total;
+    timeradd(&usage.ru_utime, &usage.ru_stime, &total);
+    return total.tv_sec + total.tv_usec / 1e6;
+}
+
+void *serve( void *arg ) {
+    server_args_t *args = (server_args_t *)arg;
+    RDTConnection *conn = args->server->accept();
+    if (!conn)
+        return NULL;
+
+    if (args->bench->fec)
+        conn->set_fec(RDT_FEC_BLOCK, RDT_FEC_MAX_PARITY);
+
+    conn->send_data(*args->payload);
+    rdt_stats_t stats = conn->stats();
+    args->segments = stats.segments_sent;
+    args->retransmits = stats.timeout_retransmits + stats.fast_retransmits;
+
+    conn->close();
+    delete conn;
+    return NULL;
+}
+
+/**
+ * Runs a single transfer, in the child process
+ */
+bench_result_t run_case( bench_case_t const &bench ) {
+    bench_result_t result;
+    memset(&result, 0, sizeof(result));
+
+    // Loss and corruption are seeded per case so reruns draw the same odds. Timing
+    // still decides which packets the draws fall on, so results vary a little.
+    unsigned int seed = bench.run * 7919 + bench.size;
+    srandom(seed);
+    std::string payload(bench.size, 0);
+    for (size_t i = 0; i < payload.size(); i++)
+        payload[i] = random();
+
+    RDTServer server(bench.window, bench.loss * 100, bench.corrupt * 100);
+    server.set_impairment_seed(seed);
+    if (!server.listen(0))
+        return result;
+
+    server_args_t args;
+    args.server = &server;
+    args.payload = &payload;
+    args.bench = &bench;
+    args.segments = 0;
+    args.retransmits = 0;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, &args);
+
+    timeval start, end;
+    double cpu_start = cpu_time();
+    gettimeofday(&start, NULL);
+
+    RDTConnection client(bench.window, bench.loss * 100, bench.corrupt * 100);
+    client.set_impairment_seed(~seed);
+    std::string received;
+    bool ok = client.connect("127.0.0.1", server.port_number()) && client.receive_data(received);
+
+    gettimeofday(&end, NULL);
+    pthread_join(thread, NULL);
+    result.cpu_seconds = cpu_time() - cpu_start;
+    client.close();
+    server.close();
+
+    result.ok = ok && received == payload;
+    result.seconds = elapsed(start, end);
+    result.segments = args.segments;
+    result.retransmits = args.retransmits;
+    return result;
+}
+
+/**
+ * Forks a child to run the case, killing it if it takes longer than timeout_sec
+ */
+bench_result_t fork_case( bench_case_t const &bench, int timeout_sec ) {
+    bench_result_t result;
+    memset(&result, 0, sizeof(result));
+    result.seconds = timeout_sec;
+
+    int fds[2];
+    if (pipe(fds) == -1)
+        return result;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The per packet log would dominate the measurements
+        freopen("/dev/null", "w", stderr);
+        ::close(fds[0]);
+
+        bench_result_t child = run_case(bench);
+        write(fds[1], &child, sizeof(child));
+        _exit(0);
+    }
+
+    ::close(fds[1]);
+
+    pollfd pfd;
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if (pid > 0 && poll(&pfd, 1, timeout_sec * 1000) > 0) {
+        if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+            result.ok = false;
+    } else if (pid > 0) {
+        kill(pid, SIGKILL);
+    }
+
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    ::close(fds[0]);
+    return result;
+}
+
+void usage( char const *name ) {
+    std::cout << "Usage: " << name << " [options]" << std::endl
+        << "  -s sizes     transfer sizes (default " << DEFAULT_SIZES << ")" << std::endl
+        << "  -w windows   window sizes (default " << DEFAULT_WINDOWS << ")" << std::endl
+        << "  -l losses    loss rates (default " << DEFAULT_LOSSES << ")" << std::endl
+        << "  -c rates     corruption rates (default " << DEFAULT_CORRUPTIONS << ")" << std::endl
+        << "  -f modes     FEC off (0) and/or adaptive (1) (default " << DEFAULT_FEC << ")" << std::endl
+        << "  -r runs      repetitions of every case (default 1)" << std::endl
+        << "  -t seconds   give up on a transfer after this long (default " << DEFAULT_TIMEOUT_SEC << ")" << std::endl
+        << "  -o prefix    write <prefix>.csv and <prefix>.json (default bench)" << std::endl
+        << "Lists are comma separated, sizes take K/M/G suffixes, rates are fractions." << std::endl;
+    exit(-1);
+}
+
+int main( int argc, char **argv ) {
+    std::string sizes = DEFAULT_SIZES;
+    std::string windows = DEFAULT_WINDOWS;
+    std::string losses = DEFAULT_LOSSES;
+    std::string corruptions = DEFAULT_CORRUPTIONS;
+    std::string fec_modes = DEFAULT_FEC;
+    std::string prefix = "bench";
+    int runs = 1;
+    int timeout_sec = DEFAULT_TIMEOUT_SEC;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:w:l:c:f:r:t:o:")) != -1) {
+        switch (c) {
+            case 's': sizes = optarg; break;
+            case 'w': windows = optarg; break;
+            case 'l': losses = optarg; break;
+            case 'c': corruptions = optarg; break;
+            case 'f': fec_modes = optarg; break;
+            case 'r': runs = atoi(optarg); break;
+            case 't': timeout_sec = atoi(optarg); break;
+            case 'o': prefix = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    std::vector<bench_case_t> cases;
+    std::vector<std::string> size_list = split(sizes), window_list = split(windows);
+    std::vector<std::string> loss_list = split(losses), corrupt_list = split(corruptions), fec_list = split(fec_modes);
+
+    for (size_t s = 0; s < size_list.size(); s++)
+        for (size_t w = 0; w < window_list.size(); w++)
+            for (size_t l = 0; l < loss_list.size(); l++)
+                for (size_t c = 0; c < corrupt_list.size(); c++)
+                    for (size_t f = 0; f < fec_list.size(); f++)
+                        for (int r = 0; r < runs; r++) {
+                            bench_case_t bench;
+                            bench.size = parse_size(size_list[s]);
+                            bench.window = parse_size(window_list[w]);
+                            bench.loss = atof(loss_list[l].c_str());
+                            bench.corrupt = atof(corrupt_list[c].c_str());
+                            bench.fec = atoi(fec_list[f].c_str());
+                            bench.run = r;
+                            cases.push_back(bench);
+                        }
+
+    std::ofstream csv((prefix + ".csv").c_str());
+    std::ofstream json((prefix + ".json").c_str());
+    csv << "size,window,loss,corrupt,fec,run,ok,seconds,goodput_mbps,segments,retransmits,retransmit_ratio,cpu_ns_per_byte" << std::endl;
+    json << "[" << std::endl;
+
+    std::cout << std::setw(10) << "size" << std::setw(10) << "window" << std::setw(7) << "loss" << std::setw(8) << "corrupt"
+        << std::setw(5) << "fec" << std::setw(5) << "ok" << std::setw(10) << "seconds" << std::setw(12) << "Mbit/s"
+        << std::setw(9) << "retx" << std::setw(10) << "ns/byte" << std::endl;
+
+    int failures = 0;
+    for (size_t i = 0; i < cases.size(); i++) {
+        bench_case_t const &bench = cases[i];
+        bench_result_t result = fork_case(bench, timeout_sec);
+
+        double goodput = result.ok ? bench.size * 8 / result.seconds / 1e6 : 0;
+        double retx_ratio = result.segments ? (double)result.retransmits / result.segments : 0;
+        double cpu_per_byte = bench.size ? result.cpu_seconds * 1e9 / bench.size : 0;
+        failures += !result.ok;
+
+        std::cout << std::fixed << std::setw(10) << bench.size << std::setw(10) << bench.window
+            << std::setprecision(3) << std::setw(7) << bench.loss << std::setw(8) << bench.corrupt
+            << std::setw(5) << bench.fec << std::setw(5) << (result.ok ? "yes" : "NO")
+            << std::setw(10) << result.seconds << std::setprecision(1) << std::setw(12) << goodput
+            << std::setprecision(3) << std::setw(9) << retx_ratio << std::setprecision(1) << std::setw(10) << cpu_per_byte << std::endl;
+
+        csv << bench.size << "," << bench.window << "," << bench.loss << "," << bench.corrupt << "," << bench.fec << ","
+            << bench.run << "," << result.ok << "," << result.seconds << "," << goodput << "," << result.segments << ","
+            << result.retransmits << "," << retx_ratio << "," << cpu_per_byte << std::endl;
+
+        json << "  {\"size\": " << bench.size << ", \"window\": " << bench.window << ", \"loss\": " << bench.loss
+            << ", \"corrupt\": " << bench.corrupt << ", \"fec\": " << bench.fec << ", \"run\": " << bench.run
+            << ", \"ok\": " << (result.ok ? "true" : "false") << ", \"seconds\": " << result.seconds
+            << ", \"goodput_mbps\": " << goodput << ", \"segments\": " << result.segments
+            << ", \"retransmits\": " << result.retransmits << ", \"retransmit_ratio\": " << retx_ratio
+            << ", \"cpu_ns_per_byte\": " << cpu_per_byte << "}" << (i + 1 < cases.size() ? "," : "") << std::endl;
+    }
+
+    json << "]" << std::endl;
+
+    std::cout << cases.size() - failures << " of " << cases.size() << " transfers succeeded, results in "
+        << prefix << ".csv and " << prefix << ".json" << std::endl;
+    return failures ? -1 : 0;
+}
@@ -0,0 +1,73 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <vector>
+#include <sys/time.h>
+#include "../CRC32C.h"
+#include "../RDTConnection.h"
+
+#define BENCH_BYTES (1024 * 1024 * 1024L) // checksum 1GB per run
+#define LARGE_BUFFER (1024 * 1024)
+
+typedef uint32_t (*crc32c_fn)(uint32_t, void const *, size_t);
+
+/**
+ * Checksums BENCH_BYTES in buf_len sized chunks, returning GB/s on this core
+ */
+double bench( crc32c_fn fn, std::vector<char> const &buf, size_t buf_len, uint32_t &result ) {
+    timeval start, end;
+    long iterations = BENCH_BYTES / buf_len;
+    uint32_t crc = 0;
+
+    gettimeofday(&start, NULL);
+    for (long i = 0; i < iterations; i++)
+        crc ^= fn(0, &buf[0], buf_len);
+    gettimeofday(&end, NULL);
+
+    result = crc;
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    return (double)iterations * buf_len / secs / 1e9;
+}
+
+/**
+ * Microbenchmark of the CRC32C implementations on packet sized (MSS) and
+ * large buffers. Also cross checks them against each other and the
+ * standard "123456789" check value.
+ */
+int main() {
+    std::vector<char> buf(LARGE_BUFFER);
+    for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = random();
+
+    if (crc32c(0, "123456789", 9) != 0xE3069283) {
+        std::cout << "crc32c check value mismatch!" << std::endl;
+        return -1;
+    }
+
+    for (size_t len = 0; len < 4096; len++) {
+        if (crc32c_portable(0, &buf[len % 7], len) != crc32c_hardware(0, &buf[len % 7], len)) {
+            std::cout << "Implementations disagree on length " << len << "!" << std::endl;
+            return -1;
+        }
+    }
+
+    std::cout << "SSE4.2 supported: " << (crc32c_hardware_supported() ? "yes" : "no") << std::endl;
+
+    size_t sizes[] = { MSS, LARGE_BUFFER };
+    for (int i = 0; i < 2; i++) {
+        uint32_t portable_crc, hardware_crc;
+        double portable = bench(crc32c_portable, buf, sizes[i], portable_crc);
+        double hardware = bench(crc32c_hardware, buf, sizes[i], hardware_crc);
+
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << sizes[i] << " byte buffers: portable " << portable << " GB/s, "
+                  << "hardware " << hardware << " GB/s" << std::endl;
+
+        if (portable_crc != hardware_crc) {
+            std::cout << "Implementations disagree!" << std::endl;
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include "../Compress.h"
+#include "../RDTConnection.h"
+
+#define BENCH_BYTES (256 * 1024 * 1024L) // compress 256MB per run
+
+/**
+ * Text-like data: words picked from a small vocabulary, so it compresses
+ * about as well as logs or markup do
+ */
+std::vector<char> make_text( size_t len ) {
+    char const *words[] = { "the ", "packet ", "window ", "<div class=\"row\">", "ACK ", "segment ",
+        "retransmit ", "\n", "2014-03-01 12:00:00 ", "connection ", "</div>\n", "of " };
+    std::string text;
+
+    while (text.size() < len)
+        text += words[random() % (sizeof(words) / sizeof(words[0]))];
+
+    return std::vector<char>(text.begin(), text.begin() + len);
+}
+
+std::vector<char> make_random( size_t len ) {
+    std::vector<char> buf(len);
+    for (size_t i = 0; i < len; i++)
+        buf[i] = random();
+    return buf;
+}
+
+/**
+ * Compresses src in blocks of up to cap bytes (the way segments are) and
+ * decompresses them again, checking every block round trips
+ */
+bool round_trip( std::vector<char> const &src, size_t cap, size_t &compressed ) {
+    std::vector<char> block(cap), out(LZ_MAX_BLOCK);
+    compressed = 0;
+
+    for (size_t offset = 0; offset < src.size(); ) {
+        size_t want = std::min(src.size() - offset, (size_t)LZ_MAX_BLOCK);
+        size_t consumed, len;
+        size_t size = lz_compress(&src[offset], want, &block[0], cap, consumed);
+
+        if (size > cap || consumed == 0 || !lz_decompress(&block[0], size, &out[0], out.size(), len)
+                || len != consumed || memcmp(&out[0], &src[offset], len) != 0)
+            return false;
+
+        offset += consumed;
+        compressed += size;
+    }
+
+    return true;
+}
+
+/**
+ * Compresses BENCH_BYTES in MSS sized blocks, returning MB/s on this core
+ */
+double bench( std::vector<char> const &src ) {
+    std::vector<char> block(MSS);
+    timeval start, end;
+    long total = 0;
+
+    gettimeofday(&start, NULL);
+    for (size_t offset = 0; total < BENCH_BYTES; offset = (offset + 1) % (src.size() / 2)) {
+        size_t consumed;
+        lz_compress(&src[offset], std::min(src.size() - offset, (size_t)LZ_MAX_BLOCK), &block[0], block.size(), consumed);
+        total += consumed;
+        offset += consumed;
+    }
+    gettimeofday(&end, NULL);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    return total / secs / 1e6;
+}
+
+/**
+ * Round trip checks of the segment compression on compressible and random
+ * data for a range of segment sizes, checks that garbage never decompresses
+ * past its buffer, and measures compression speed.
+ */
+int main() {
+    std::vector<char> text = make_text(1024 * 1024);
+    std::vector<char> noise = make_random(1024 * 1024);
+
+    size_t caps[] = { 2, 17, 300, MSS, 8192, LZ_MAX_BLOCK };
+    for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+        size_t text_size, noise_size;
+        if (!round_trip(text, caps[i], text_size) || !round_trip(noise, caps[i], noise_size)) {
+            std::cout << "Round trip failed with blocks of " << caps[i] << " bytes!" << std::endl;
+            return -1;
+        }
+
+        std::cout << "Blocks of " << std::setw(5) << caps[i] << " bytes: text " << std::fixed << std::setprecision(2)
+            << (double)text.size() / text_size << ":1, random " << (double)noise.size() / noise_size << ":1" << std::endl;
+    }
+
+    std::vector<char> out(LZ_MAX_BLOCK);
+    for (int i = 0; i < 100000; i++) {
+        std::vector<char> garbage = make_random(random() % 64);
+        size_t cap = random() % 256, len = 0;
+
+        if (lz_decompress(garbage.empty() ? NULL : &garbage[0], garbage.size(), &out[0], cap, len) && len > cap) {
+            std::cout << "Decompressed garbage past its buffer!" << std::endl;
+            return -1;
+        }
+    }
+
+    std::cout << "Compressing MSS segments of text: " << std::setprecision(1) << bench(text) << " MB/s, random data: "
+        << bench(noise) << " MB/s" << std::endl;
+    return 0;
+}
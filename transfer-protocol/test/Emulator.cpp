@@ -0,0 +1,523 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <queue>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cmath>
+#include <ctime>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define EMU_MAX_DATAGRAM 65535
+#define EMU_SOCKET_BUFFER (4 * 1024 * 1024)
+#define EMU_DEFAULT_QUEUE 100 // packets the bottleneck holds before tail dropping
+#define EMU_DEFAULT_REORDER_MS 10 // extra hold for reordered packets
+
+/**
+ * Network emulator: a UDP proxy which sits between an RDT client and server
+ * (typically on loopback) and impairs the traffic it relays. Every random
+ * decision comes from a seeded generator, one per direction, so a run with the
+ * same seed and options makes the same decisions for the same packets.
+ *
+ * Each packet runs through, in order:
+ *   - an MTU check (oversized packets vanish, like on a PMTU black hole)
+ *   - loss, either Bernoulli or a two state Gilbert-Elliott channel
+ *   - duplication
+ *   - a rate limited bottleneck with a tail drop queue
+ *   - propagation delay with uniform or normal jitter (order preserving)
+ *   - reordering: the packet is held back so the ones after it overtake it
+ *   - corruption of a single random bit
+ *
+ * Every client address gets its own upstream socket, so the server sees
+ * each of them as a distinct peer.
+ */
+
+enum direction_t { UPSTREAM = 0, DOWNSTREAM = 1 };
+char const *direction_names[] = { "up", "down" };
+
+struct options_t {
+    uint64_t seed;
+    double loss;
+    bool gilbert;
+    double ge_good_to_bad;
+    double ge_bad_to_good;
+    double ge_loss_good;
+    double ge_loss_bad;
+    double delay_ms;
+    double jitter_ms;
+    bool normal_jitter;
+    double reorder;
+    double reorder_ms;
+    double duplicate;
+    double corrupt;
+    double rate_kbps; // 0 is unlimited
+    size_t queue_limit;
+    size_t mtu; // 0 is unlimited
+    bool impair[2];
+    std::string trace_file;
+};
+
+/**
+ * splitmix64, small and good enough for picking packet fates
+ */
+class rng_t {
+public:
+    rng_t() : state( 0 ) {}
+    void seed( uint64_t s ) { state = s; }
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, 1)
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    bool chance( double p ) { return p > 0 && uniform() < p; }
+
+    // Standard normal, Box-Muller
+    double normal() {
+        double u1 = uniform(), u2 = uniform();
+        return sqrt(-2 * log(1 - u1)) * cos(2 * M_PI * u2);
+    }
+
+private:
+    uint64_t state;
+};
+
+/**
+ * Impairment state of one direction
+ */
+struct link_t {
+    rng_t rng;
+    bool ge_bad;                  // Gilbert-Elliott channel is in the bad state
+    int64_t link_free;            // when the bottleneck finishes sending what it has
+    int64_t last_arrival;         // delivery time of the previous in order packet
+    std::deque<int64_t> backlog;  // when each queued packet leaves the bottleneck
+};
+
+struct scheduled_t {
+    int64_t due;
+    uint64_t order; // breaks ties in arrival order
+    uint64_t id;
+    direction_t dir;
+    int fd;
+    sockaddr_in to;
+    std::string data;
+
+    bool operator<(scheduled_t const &o) const {
+        // std::priority_queue pops the largest, we want the earliest
+        return due != o.due ? due > o.due : order > o.order;
+    }
+};
+
+struct client_t {
+    sockaddr_in addr;
+    int upstream_fd;
+};
+
+typedef std::map<std::pair<in_addr_t, in_port_t>, client_t> client_map_t;
+typedef std::priority_queue<scheduled_t> schedule_t;
+
+options_t opts;
+link_t links[2];
+schedule_t schedule;
+client_map_t clients;
+std::ostream *trace = NULL;
+int64_t start_time;
+uint64_t packets_seen = 0;
+uint64_t packets_scheduled = 0;
+volatile sig_atomic_t running = 1;
+
+void stop( int ) {
+    running = 0;
+}
+
+int64_t now_usec() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_packet( int64_t t, direction_t dir, uint64_t id, size_t len, std::string const &event ) {
+    if (!trace)
+        return;
+
+    *trace << (t - start_time) << " " << direction_names[dir] << " " << id << " " << len << " " << event << "\n";
+}
+
+/**
+ * Parses up to count comma separated numbers, returning how many there were
+ */
+int parse_list( char const *arg, double *values, int count ) {
+    std::stringstream ss(arg);
+    std::string item;
+    int i = 0;
+
+    while (i < count && std::getline(ss, item, ','))
+        values[i++] = atof(item.c_str());
+
+    return i;
+}
+
+void usage( char const *name ) {
+    std::cout << "Usage: " << name << " listen_port server_host server_port [options]" << std::endl
+        << "  -s seed          random seed (default 1)" << std::endl
+        << "  -l p             Bernoulli loss probability" << std::endl
+        << "  -g p,r,k,h       Gilbert-Elliott loss: P(good->bad), P(bad->good)," << std::endl
+        << "                   loss probability in the good and in the bad state" << std::endl
+        << "  -d ms            one way delay" << std::endl
+        << "  -j ms            delay jitter (uniform +-ms, or standard deviation with -N)" << std::endl
+        << "  -N               normally distributed jitter" << std::endl
+        << "  -r p[,ms]        reorder probability and how long reordered packets are held back" << std::endl
+        << "  -u p             duplication probability" << std::endl
+        << "  -c p             single bit corruption probability" << std::endl
+        << "  -b kbit/s        bottleneck rate" << std::endl
+        << "  -q packets       bottleneck queue length (default " << EMU_DEFAULT_QUEUE << ")" << std::endl
+        << "  -m bytes         drop datagrams larger than this, IP and UDP headers included" << std::endl
+        << "  -o up|down|both  directions to impair (default both)" << std::endl
+        << "  -t file          per packet trace, - for stdout" << std::endl;
+    exit(-1);
+}
+
+void parse_options( int argc, char **argv ) {
+    opts.seed = 1;
+    opts.loss = 0;
+    opts.gilbert = false;
+    opts.delay_ms = 0;
+    opts.jitter_ms = 0;
+    opts.normal_jitter = false;
+    opts.reorder = 0;
+    opts.reorder_ms = EMU_DEFAULT_REORDER_MS;
+    opts.duplicate = 0;
+    opts.corrupt = 0;
+    opts.rate_kbps = 0;
+    opts.queue_limit = EMU_DEFAULT_QUEUE;
+    opts.mtu = 0;
+    opts.impair[UPSTREAM] = opts.impair[DOWNSTREAM] = true;
+
+    int c;
+    double values[4];
+    while ((c = getopt(argc, argv, "s:l:g:d:j:Nr:u:c:b:q:m:o:t:")) != -1) {
+        switch (c) {
+            case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+            case 'l': opts.loss = atof(optarg); break;
+            case 'g':
+                if (parse_list(optarg, values, 4) != 4)
+                    usage(argv[0]);
+                opts.gilbert = true;
+                opts.ge_good_to_bad = values[0];
+                opts.ge_bad_to_good = values[1];
+                opts.ge_loss_good = values[2];
+                opts.ge_loss_bad = values[3];
+                break;
+            case 'd': opts.delay_ms = atof(optarg); break;
+            case 'j': opts.jitter_ms = atof(optarg); break;
+            case 'N': opts.normal_jitter = true; break;
+            case 'r':
+                values[1] = EMU_DEFAULT_REORDER_MS;
+                if (parse_list(optarg, values, 2) == 0)
+                    usage(argv[0]);
+                opts.reorder = values[0];
+                opts.reorder_ms = values[1];
+                break;
+            case 'u': opts.duplicate = atof(optarg); break;
+            case 'c': opts.corrupt = atof(optarg); break;
+            case 'b': opts.rate_kbps = atof(optarg); break;
+            case 'q': opts.queue_limit = atoi(optarg); break;
+            case 'm': opts.mtu = atoi(optarg); break;
+            case 'o':
+                opts.impair[UPSTREAM] = strcmp(optarg, "down") != 0;
+                opts.impair[DOWNSTREAM] = strcmp(optarg, "up") != 0;
+                break;
+            case 't': opts.trace_file = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 3)
+        usage(argv[0]);
+}
+
+/**
+ * Decides whether the next packet is lost, stepping the Gilbert-Elliott channel
+ */
+bool lose_packet( link_t &link ) {
+    if (!opts.gilbert)
+        return link.rng.chance(opts.loss);
+
+    if (link.ge_bad)
+        link.ge_bad = !link.rng.chance(opts.ge_bad_to_good);
+    else
+        link.ge_bad = link.rng.chance(opts.ge_good_to_bad);
+
+    return link.rng.chance(link.ge_bad ? opts.ge_loss_bad : opts.ge_loss_good);
+}
+
+/**
+ * Runs a packet through the bottleneck and the delay line, scheduling its
+ * delivery. Returns false if the bottleneck queue overflowed.
+ */
+bool schedule_copy( int64_t now, direction_t dir, uint64_t id, int fd, sockaddr_in const &to, std::string const &data ) {
+    link_t &link = links[dir];
+    int64_t t = now;
+
+    if (opts.impair[dir] && opts.rate_kbps > 0) {
+        while (!link.backlog.empty() && link.backlog.front() <= now)
+            link.backlog.pop_front();
+
+        if (link.backlog.size() >= opts.queue_limit)
+            return false;
+
+        // Serialize the IP datagram (28 bytes of IP and UDP headers) onto the bottleneck
+        int64_t serialize = (int64_t)((data.size() + 28) * 8 * 1000 / opts.rate_kbps);
+        link.link_free = std::max(link.link_free, now) + serialize;
+        link.backlog.push_back(link.link_free);
+        t = link.link_free;
+    }
+
+    bool reordered = false;
+    if (opts.impair[dir]) {
+        double delay_ms = opts.delay_ms;
+        if (opts.jitter_ms > 0) {
+            if (opts.normal_jitter)
+                delay_ms += link.rng.normal() * opts.jitter_ms;
+            else
+                delay_ms += (link.rng.uniform() * 2 - 1) * opts.jitter_ms;
+        }
+
+        t += (int64_t)(std::max(0.0, delay_ms) * 1000);
+        reordered = link.rng.chance(opts.reorder);
+    }
+
+    // Jitter alone doesn't reorder packets, a real path keeps them in order
+    if (reordered) {
+        t += (int64_t)(opts.reorder_ms * 1000);
+    } else {
+        t = std::max(t, link.last_arrival);
+        link.last_arrival = t;
+    }
+
+    scheduled_t pkt;
+    pkt.due = t;
+    pkt.order = packets_scheduled++;
+    pkt.id = id;
+    pkt.dir = dir;
+    pkt.fd = fd;
+    pkt.to = to;
+    pkt.data = data;
+
+    if (opts.impair[dir] && link.rng.chance(opts.corrupt) && !pkt.data.empty()) {
+        uint64_t bit = link.rng.next() % (pkt.data.size() * 8);
+        pkt.data[bit / 8] ^= 1 << (bit % 8);
+        trace_packet(now, dir, id, data.size(), "corrupt");
+    }
+
+    std::stringstream ss;
+    ss << "queue " << (t - now) << (reordered ? " reorder" : "");
+    trace_packet(now, dir, id, data.size(), ss.str());
+
+    schedule.push(pkt);
+    return true;
+}
+
+/**
+ * Applies the impairments to a packet that just arrived, relaying it
+ * (possibly twice) to fd unless it is lost
+ */
+void relay( direction_t dir, int fd, sockaddr_in const &to, char const *buf, size_t len ) {
+    int64_t now = now_usec();
+    uint64_t id = packets_seen++;
+    std::string data(buf, len);
+    link_t &link = links[dir];
+
+    trace_packet(now, dir, id, len, "in");
+
+    if (opts.impair[dir]) {
+        if (opts.mtu > 0 && len + 28 > opts.mtu) {
+            trace_packet(now, dir, id, len, "drop mtu");
+            return;
+        } else if (lose_packet(link)) {
+            trace_packet(now, dir, id, len, "drop loss");
+            return;
+        }
+    }
+
+    int copies = opts.impair[dir] && link.rng.chance(opts.duplicate) ? 2 : 1;
+    if (copies > 1)
+        trace_packet(now, dir, id, len, "duplicate");
+
+    for (int i = 0; i < copies; i++) {
+        if (!schedule_copy(now, dir, id, fd, to, data))
+            trace_packet(now, dir, id, len, "drop queue");
+    }
+}
+
+/**
+ * Delivers every packet whose time has come
+ */
+void deliver_due() {
+    int64_t now = now_usec();
+
+    while (!schedule.empty() && schedule.top().due <= now) {
+        scheduled_t const &pkt = schedule.top();
+        sendto(pkt.fd, pkt.data.data(), pkt.data.size(), 0, (sockaddr const *)&pkt.to, sizeof(pkt.to));
+        trace_packet(now, pkt.dir, pkt.id, pkt.data.size(), "out");
+        schedule.pop();
+    }
+}
+
+int open_socket() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int buf_size = EMU_SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
+    // We relay whatever size we get, leave it to the endpoints to probe for MTUs
+    int pmtud = IP_PMTUDISC_PROBE;
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtud, sizeof(pmtud));
+    return fd;
+}
+
+int main( int argc, char **argv ) {
+    parse_options(argc, argv);
+
+    int listen_port = atoi(argv[optind]);
+    std::string server_host = argv[optind + 1];
+    int server_port = atoi(argv[optind + 2]);
+
+    hostent *server = gethostbyname(server_host.c_str());
+    if (!server) {
+        std::cout << "Unknown host " << server_host << std::endl;
+        return -1;
+    }
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+
+    sockaddr_in listen_addr;
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listen_addr.sin_port = htons(listen_port);
+
+    int listen_fd = open_socket();
+    if (::bind(listen_fd, (sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
+        std::cout << "Failed to bind port " << listen_port << std::endl;
+        return -1;
+    }
+
+    std::ofstream trace_out;
+    if (opts.trace_file == "-") {
+        trace = &std::cout;
+    } else if (opts.trace_file != "") {
+        trace_out.open(opts.trace_file.c_str());
+        trace = &trace_out;
+    }
+
+    // Independent streams keep each direction reproducible however the two interleave
+    for (int dir = 0; dir < 2; dir++) {
+        links[dir].rng.seed(opts.seed * 2 + dir);
+        links[dir].ge_bad = false;
+        links[dir].link_free = 0;
+        links[dir].last_arrival = 0;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    start_time = now_usec();
+
+    std::vector<char> buf(EMU_MAX_DATAGRAM);
+    std::vector<pollfd> fds;
+    std::vector<client_t *> fd_clients;
+
+    while (running) {
+        fds.clear();
+        fd_clients.clear();
+
+        pollfd pfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pfd.fd = listen_fd;
+        fds.push_back(pfd);
+        fd_clients.push_back(NULL);
+
+        for (client_map_t::iterator iter = clients.begin(); iter != clients.end(); ++iter) {
+            pfd.fd = iter->second.upstream_fd;
+            fds.push_back(pfd);
+            fd_clients.push_back(&iter->second);
+        }
+
+        timespec timeout;
+        timespec *timeout_ptr = NULL;
+        if (!schedule.empty()) {
+            int64_t wait = std::max((int64_t)0, schedule.top().due - now_usec());
+            timeout.tv_sec = wait / 1000000;
+            timeout.tv_nsec = (wait % 1000000) * 1000;
+            timeout_ptr = &timeout;
+        }
+
+        if (ppoll(&fds[0], fds.size(), timeout_ptr, NULL) < 0 && errno != EINTR)
+            break;
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+
+            sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t len = recvfrom(fds[i].fd, &buf[0], buf.size(), MSG_DONTWAIT, (sockaddr *)&from, &from_len);
+            if (len < 0)
+                continue;
+
+            if (fd_clients[i]) {
+                relay(DOWNSTREAM, listen_fd, fd_clients[i]->addr, &buf[0], len);
+                continue;
+            }
+
+            std::pair<in_addr_t, in_port_t> key(from.sin_addr.s_addr, from.sin_port);
+            client_map_t::iterator iter = clients.find(key);
+
+            if (iter == clients.end()) {
+                client_t client;
+                client.addr = from;
+                client.upstream_fd = open_socket();
+                ::connect(client.upstream_fd, (sockaddr *)&server_addr, sizeof(server_addr));
+                iter = clients.insert(std::make_pair(key, client)).first;
+
+                char ip_addr[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &from.sin_addr.s_addr, ip_addr, sizeof(ip_addr));
+                std::cerr << "Relaying " << ip_addr << ":" << ntohs(from.sin_port) << " to " << server_host << ":" << server_port << std::endl;
+            }
+
+            relay(UPSTREAM, iter->second.upstream_fd, server_addr, &buf[0], len);
+        }
+
+        deliver_due();
+    }
+
+    if (trace)
+        trace->flush();
+
+    for (client_map_t::iterator iter = clients.begin(); iter != clients.end(); ++iter)
+        ::close(iter->second.upstream_fd);
+    ::close(listen_fd);
+
+    return 0;
+}
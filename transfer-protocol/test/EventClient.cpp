@@ -0,0 +1,114 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "../RDTConnection.h"
+
+#define WINDOW_SIZE 1024
+#define DEFAULT_CONNECTIONS 32
+#define MAX_EVENTS 64
+
+/**
+ * Fetches the same file over many concurrent connections to the file server
+ * from a single thread, driving every connection through the non-blocking
+ * RDTConnection interface and epoll
+ */
+struct request_t {
+    RDTConnection *conn;
+    std::string response;
+    bool done;
+    bool success;
+};
+
+std::string file_name;
+int num_done = 0;
+
+void on_closed( RDTConnection &, bool, void *context ) {
+    request_t *req = (request_t *)context;
+    req->done = true;
+    num_done++;
+}
+
+void on_received( RDTConnection &conn, bool success, void *context ) {
+    request_t *req = (request_t *)context;
+    req->success = success;
+    if (!conn.start_close(on_closed, req))
+        on_closed(conn, false, req);
+}
+
+void on_sent( RDTConnection &conn, bool success, void *context ) {
+    request_t *req = (request_t *)context;
+    if (!success || !conn.start_receive(req->response, on_received, req))
+        on_received(conn, false, req);
+}
+
+void on_connected( RDTConnection &conn, bool success, void *context ) {
+    request_t *req = (request_t *)context;
+    if (!success || !conn.start_send(file_name, on_sent, req))
+        on_received(conn, false, req);
+}
+
+int main( int argc, char **argv ) {
+    if (argc < 4) {
+        std::cout << "Usage: " << argv[0] << " host port file [connections]" << std::endl;
+        exit(-1);
+    }
+
+    std::string host = argv[1];
+    int port = atoi(argv[2]);
+    file_name = argv[3];
+    int num_connections = argc > 4 ? atoi(argv[4]) : DEFAULT_CONNECTIONS;
+
+    int epoll_fd = epoll_create1(0);
+    request_t *requests = new request_t[num_connections];
+
+    for (int i = 0; i < num_connections; i++) {
+        requests[i].conn = new RDTConnection(WINDOW_SIZE);
+        requests[i].done = false;
+        requests[i].success = false;
+
+        if (!requests[i].conn->start_connect(host, port, on_connected, &requests[i])) {
+            std::cout << "Connection " << i << " failed to start, aborting" << std::endl;
+            exit(-1);
+        }
+
+        // Watch both the socket and the retransmission timer of every connection
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t)i << 1;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, requests[i].conn->fd(), &ev);
+        ev.data.u64 = ((uint64_t)i << 1) | 1;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, requests[i].conn->timer_fd(), &ev);
+    }
+
+    epoll_event events[MAX_EVENTS];
+    while (num_done < num_connections) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        for (int i = 0; i < n; i++) {
+            request_t &req = requests[events[i].data.u64 >> 1];
+            if (req.done)
+                continue;
+
+            if (events[i].data.u64 & 1)
+                req.conn->on_timer();
+            else
+                req.conn->on_readable();
+        }
+    }
+
+    int num_success = 0;
+    for (int i = 0; i < num_connections; i++) {
+        if (requests[i].success && requests[i].response == requests[0].response)
+            num_success++;
+        delete requests[i].conn;
+    }
+
+    delete [] requests;
+    ::close(epoll_fd);
+
+    std::cout << num_success << " of " << num_connections << " transfers succeeded" << std::endl;
+    return num_success == num_connections ? 0 : -1;
+}
@@ -0,0 +1,125 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <sys/time.h>
+#include "../FEC.h"
+#include "../RDTConnection.h"
+
+#define BENCH_BYTES (1024 * 1024 * 1024L) // XOR 1GB per run
+#define LARGE_BUFFER (1024 * 1024)
+#define MAX_LENGTH 4096 // cross checked lengths, every remainder of every vector width
+#define MAX_OFFSET 32   // and every misalignment up to the widest vector
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_SUPPORTS(feature) (__builtin_cpu_supports(feature) != 0)
+#else
+#define CPU_SUPPORTS(feature) true // the variants are the portable loop elsewhere
+#endif
+
+typedef void (*fec_xor_fn)(void *, void const *, size_t);
+
+struct implementation_t {
+    char const *name;
+    fec_xor_fn fn;
+    bool supported;
+};
+
+/**
+ * XORs BENCH_BYTES in buf_len sized chunks, returning GB/s on this core
+ */
+double bench( fec_xor_fn fn, std::vector<char> &dst, std::vector<char> const &src, size_t buf_len ) {
+    timeval start, end;
+    long iterations = BENCH_BYTES / buf_len;
+
+    gettimeofday(&start, NULL);
+    for (long i = 0; i < iterations; i++)
+        fn(&dst[0], &src[0], buf_len);
+    gettimeofday(&end, NULL);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    return (double)iterations * buf_len / secs / 1e9;
+}
+
+/**
+ * Runs fn on dst + dst_offset and src + src_offset and compares the result
+ * to XORing the same bytes one at a time. Bytes around the range have to be
+ * left alone.
+ */
+bool cross_check( fec_xor_fn fn, std::vector<char> const &dst, std::vector<char> const &src,
+        size_t len, size_t dst_offset, size_t src_offset ) {
+    std::vector<char> expected(dst), actual(dst);
+
+    for (size_t i = 0; i < len; i++)
+        expected[dst_offset + i] ^= src[src_offset + i];
+    fn(&actual[dst_offset], &src[src_offset], len);
+
+    return memcmp(&expected[0], &actual[0], expected.size()) == 0;
+}
+
+/**
+ * Microbenchmark of the FEC XOR implementations on packet sized (MSS) and
+ * large buffers. Also cross checks each of them against a byte at a time
+ * XOR at odd lengths and misaligned buffers, since packet payloads carry no
+ * alignment guarantees.
+ */
+int main() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+
+    implementation_t implementations[] = {
+        { "portable", fec_xor_portable, true },
+        { "SSE2", fec_xor_sse2, CPU_SUPPORTS("sse2") },
+        { "AVX2", fec_xor_avx2, CPU_SUPPORTS("avx2") },
+        { "selected", fec_xor, true },
+    };
+    int num_implementations = sizeof(implementations) / sizeof(implementations[0]);
+
+    std::vector<char> dst(MAX_LENGTH + 2 * MAX_OFFSET), src(MAX_LENGTH + 2 * MAX_OFFSET);
+    for (size_t i = 0; i < dst.size(); i++) {
+        dst[i] = random();
+        src[i] = random();
+    }
+
+    for (int i = 0; i < num_implementations; i++) {
+        implementation_t const &impl = implementations[i];
+        std::cout << impl.name << " supported: " << (impl.supported ? "yes" : "no") << std::endl;
+        if (!impl.supported)
+            continue;
+
+        for (size_t len = 0; len <= MAX_LENGTH; len++) {
+            // Both aligned, both misaligned alike, and misaligned relative to each other
+            size_t dst_offset = len % MAX_OFFSET;
+            size_t src_offset = (len / MAX_OFFSET) % MAX_OFFSET;
+
+            if (!cross_check(impl.fn, dst, src, len, 0, 0)
+                    || !cross_check(impl.fn, dst, src, len, dst_offset, dst_offset)
+                    || !cross_check(impl.fn, dst, src, len, dst_offset, src_offset)) {
+                std::cout << impl.name << " is wrong at length " << len << " (offsets "
+                          << dst_offset << ", " << src_offset << ")!" << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    std::vector<char> large_dst(LARGE_BUFFER), large_src(LARGE_BUFFER);
+    for (size_t i = 0; i < large_src.size(); i++)
+        large_src[i] = random();
+
+    size_t sizes[] = { MSS, LARGE_BUFFER };
+    for (int i = 0; i < 2; i++) {
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << sizes[i] << " byte buffers:";
+
+        for (int j = 0; j < num_implementations; j++) {
+            if (implementations[j].supported)
+                std::cout << " " << implementations[j].name << " "
+                          << bench(implementations[j].fn, large_dst, large_src, sizes[i]) << " GB/s";
+        }
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <cstdlib>
+#include <pthread.h>
+#include <sys/time.h>
+#include "../RDTConnection.h"
+
+#define DEFAULT_PORT 9531
+#define DEFAULT_STREAMS 4
+#define WINDOW_SIZE 65536
+
+/**
+ * Sends streams of very different sizes side by side over one connection on
+ * the loopback and checks each arrives intact. Small streams should complete
+ * long before the large ones they share the transfer with, loss or not.
+ */
+int port = DEFAULT_PORT;
+int num_streams = DEFAULT_STREAMS;
+double ploss = 0, pcorrupt = 0;
+
+std::vector<std::string> payloads;
+std::vector<std::string> received;
+std::vector<double> completed;
+timeval start;
+
+// Large and small streams take turns
+std::string make_payload( int stream ) {
+    size_t len = stream % 2 == 0 ? 2 * 1024 * 1024 : 16 * 1024 * (stream + 1);
+    std::string payload(len, '\0');
+
+    for (size_t i = 0; i < len; i++)
+        payload[i] = (stream * 31 + i * 7 + i / 251) & 0xFF;
+
+    return payload;
+}
+
+double elapsed() {
+    timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
+}
+
+void *serve( void *arg ) {
+    RDTConnection *server = (RDTConnection *)arg;
+
+    if (!server->accept()) {
+        std::cout << "Accept failed" << std::endl;
+        return NULL;
+    }
+
+    for (int i = 0; i < num_streams; i++)
+        server->write_stream(server->open_stream(), payloads[i]);
+
+    if (!server->send_streams())
+        std::cout << "Sending the streams failed" << std::endl;
+
+    server->close();
+    return NULL;
+}
+
+void on_stream_done( RDTConnection &, int stream, void * ) {
+    completed[stream] = elapsed();
+}
+
+int main( int argc, char **argv ) {
+    if (argc > 1)
+        port = atoi(argv[1]);
+    if (argc > 2)
+        num_streams = atoi(argv[2]);
+    if (argc > 3)
+        ploss = atof(argv[3]);
+    if (argc > 4)
+        pcorrupt = atof(argv[4]);
+
+    if (num_streams < 1 || num_streams > RDT_MAX_STREAMS) {
+        std::cout << "Usage: " << argv[0] << " [port] [streams, at most " << RDT_MAX_STREAMS << "] [ploss] [pcorrupt]" << std::endl;
+        exit(-1);
+    }
+
+    for (int i = 0; i < num_streams; i++)
+        payloads.push_back(make_payload(i));
+    received.resize(num_streams);
+    completed.resize(num_streams, -1);
+
+    RDTConnection server(WINDOW_SIZE, ploss, pcorrupt);
+    if (!server.listen(port)) {
+        std::cout << "Listen failed, aborting" << std::endl;
+        exit(-1);
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, &server);
+
+    RDTConnection client(WINDOW_SIZE, ploss, pcorrupt);
+    if (!client.connect("127.0.0.1", port)) {
+        std::cout << "Connection failed, aborting" << std::endl;
+        exit(-1);
+    }
+
+    for (int i = 0; i < num_streams; i++)
+        client.read_stream(client.open_stream(), received[i]);
+
+    gettimeofday(&start, NULL);
+    bool success = client.receive_streams(on_stream_done);
+    double total = elapsed();
+
+    client.close();
+    pthread_join(thread, NULL);
+
+    int failures = success ? 0 : 1;
+    for (int i = 0; i < num_streams; i++) {
+        bool intact = received[i] == payloads[i];
+        failures += intact ? 0 : 1;
+
+        std::cout << "Stream " << i << ": " << received[i].length() << "/" << payloads[i].length() << " bytes, "
+            << (intact ? "intact" : "CORRUPT") << ", done after " << completed[i] << "s" << std::endl;
+    }
+
+    std::cout << (success ? "Transfer completed" : "Transfer FAILED") << " in " << total << "s" << std::endl;
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../RDTConnection.h"
+#include "../RDTTrace.h"
+
+/**
+ * Decodes the binary event traces RDTConnection::write_trace() dumps
+ * (sender and receiver save them to $RDT_TRACE_DIR), one event per line.
+ * Times are relative to the first event of the first trace, so traces of
+ * both ends of a connection line up.
+ */
+struct flag_name_t {
+    uint16_t mask;
+    char const *name;
+};
+
+flag_name_t const flag_names[] = {
+    { SYN_MASK, "SYN" }, { SYNACK_MASK, "SYNACK" }, { ACK_MASK, "ACK" }, { EOF_MASK, "EOF" },
+    { EOFACK_MASK, "EOFACK" }, { FIN_MASK, "FIN" }, { FINACK_MASK, "FINACK" }, { ACKNOW_MASK, "ACKNOW" },
+    { PROBE_MASK, "PROBE" }, { PROBEACK_MASK, "PROBEACK" }, { FEC_MASK, "FEC" }, { PARITY_MASK, "PARITY" },
+    { SACK_MASK, "SACK" }, { COMPRESS_MASK, "COMPRESS" }, { WPROBE_MASK, "WPROBE" }, { STREAM_MASK, "STREAM" }
+};
+
+std::string flags_string( uint16_t flags ) {
+    std::string result;
+
+    for (size_t i = 0; i < sizeof(flag_names) / sizeof(flag_names[0]); i++) {
+        if (flags & flag_names[i].mask)
+            result += (result.empty() ? "" : ",") + std::string(flag_names[i].name);
+    }
+
+    return result.empty() ? "-" : result;
+}
+
+bool decode( char const *path, uint64_t &start ) {
+    std::ifstream in(path, std::ios::binary);
+    rdt_trace_header_t header;
+
+    if (!in.read((char *)&header, sizeof(header)) || header.magic != RDT_TRACE_MAGIC) {
+        std::cerr << path << ": not an RDT trace" << std::endl;
+        return false;
+    } else if (header.version != RDT_TRACE_VERSION || header.record_size != sizeof(rdt_trace_record_t)) {
+        std::cerr << path << ": unsupported trace version " << header.version << std::endl;
+        return false;
+    }
+
+    std::vector<rdt_trace_record_t> records(header.count);
+    if (header.count > 0 && !in.read((char *)&records[0], header.count * sizeof(rdt_trace_record_t))) {
+        std::cerr << path << ": trace is truncated" << std::endl;
+        return false;
+    }
+
+    std::cout << "# " << path << ": connection " << std::hex << header.conn_id << std::dec << ", "
+        << header.count << " events (" << header.overwritten << " older ones overwritten)" << std::endl;
+    std::cout << "#" << std::setw(12) << "time" << std::setw(16) << "event" << std::setw(14) << "seq"
+        << std::setw(14) << "ack" << std::setw(7) << "len" << std::setw(12) << "window"
+        << std::setw(11) << "in_flight" << "  flags" << std::endl;
+
+    if (start == 0 && !records.empty())
+        start = records[0].time_usec;
+
+    for (size_t i = 0; i < records.size(); i++) {
+        rdt_trace_record_t const &r = records[i];
+        double t = ((int64_t)(r.time_usec - start)) / 1e6;
+
+        std::cout << std::fixed << std::setprecision(6) << std::setw(13) << t
+            << std::setw(16) << rdt_trace_event_name(r.event) << std::setw(14) << r.seq
+            << std::setw(14) << r.ack << std::setw(7) << r.data_len << std::setw(12) << r.window
+            << std::setw(11) << r.in_flight << "  " << flags_string(r.flags) << std::endl;
+    }
+
+    return true;
+}
+
+int main( int argc, char **argv ) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " trace..." << std::endl;
+        return -1;
+    }
+
+    uint64_t start = 0;
+    bool ok = true;
+    for (int i = 1; i < argc; i++)
+        ok = decode(argv[i], start) && ok;
+
+    return ok ? 0 : -1;
+}